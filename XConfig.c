@@ -7,64 +7,107 @@
 #include "cparse_core.h"
 
 /* Read file content */
-XC_STATIC(char *) ReadFileContent(const char *file)
+XC_STATIC(char *) ReadFileContent(int fd, size_t *length)
 {
-	/* Get file status */
-	struct stat st;
-	if (stat(file, &st) < 0) {
+	/* Read the whole file, NUL-terminated and decompressed */
+	char *content = cparse_read_fd(fd, length);
+	if (!content)
+	{
 		return NULL;
 	}
 
-	/* Open file */
-	int fd = open(file, O_RDONLY);
-	if (fd < 0)
+	TRACE("Content: \n%s\n", content);
+
+	return content;
+}
+
+/* Check that XC is not an attached read-only image or a cached file */
+XC_STATIC(bool) XConfig_IsWritable(XConfig *xc)
+{
+	if (xc->config->image)
 	{
-		return NULL;
+		cparse_set_error(&xc->parser, "Config is a read-only shared image");
+		return false;
 	}
 
-	/* Allocate memory for buffer */
-	char *content = malloc(st.st_size);
-	if (!content)
+	if (xc->config->cache)
 	{
-		close(fd);
-		return NULL;
+		cparse_set_error(&xc->parser, "Config is shared by the file cache, read-only");
+		return false;
 	}
 
-	/* Read content */
-	read(fd, content, st.st_size);
-	close(fd);
-
-	TRACE("Content: \n%s\n", content);
-
-	return content;
+	return true;
 }
 
 /* Parse config file. */
 XC_EXPORT(XConfig *) XConfig_ParseFile(const char *file)
+{
+	return XConfig_ParseFileEx(file, 0);
+}
+
+/* Parse config file with flags. */
+XC_EXPORT(XConfig *) XConfig_ParseFileEx(const char *file, unsigned flags)
 {
 	/* Allocate memory for new pointer. */
 	XConfig *xc = malloc(sizeof(XConfig));
 	if (!xc)
 		return NULL;
 
-	/* Read file content. */
-	char *content = ReadFileContent(file);
-	if (!content)
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
 	{
 		free(xc);
 		return NULL;
 	}
 
-	/* Load configuration. */
-	cparse_init(&(xc->parser), P_STR, -1, content);
-	xc->config = cparse_load(&(xc->parser));
+	/* A compressed file is decompressed block by block into the parser,
+	 * unless XC_LAZY or XC_PRESERVE need the whole text kept */
+	if (!(flags & (XC_LAZY | XC_PRESERVE)) && cparse_fd_compression(fd) != COMPRESS_NONE)
+	{
+		memset(&(xc->parser), 0, sizeof(CPState));
+		cparse_init(&(xc->parser), P_FD, fd, NULL);
+		xc->parser.path = file;
+		xc->parser.flags = flags;
+		xc->config = cparse_load(&(xc->parser));
+		xc->parser.path = NULL;
+		close(fd);
+	}
+	else
+	{
+		/* Read file content. */
+		size_t length = 0;
+		char *content = ReadFileContent(fd, &length);
+		close(fd);
+		if (!content)
+		{
+			free(xc);
+			return NULL;
+		}
 
-	/* Now, CONTENT is not neccessary, just free it */
-	free(content);
+		/* Load configuration, CONTENT is kept if the config needs it */
+		memset(&(xc->parser), 0, sizeof(CPState));
+		cparse_set_error(NULL, "%s", "");
+		xc->parser.type = P_STR;
+		xc->parser.str = content;
+		xc->parser.len = length; /* NULs in values are kept */
+		xc->parser.path = file; /* Includes are relative to this file */
+		xc->parser.flags = flags;
+		xc->config = cparse_load(&(xc->parser));
+		xc->parser.path = NULL;
+
+		if (!(flags & (XC_LAZY | XC_PRESERVE)))
+		{
+			/* Now, CONTENT is not neccessary, just free it */
+			free(content);
+			xc->parser.str = NULL;
+			xc->parser.len = 0;
+		}
+	}
 
 	if (!xc->config)
 	{
 		cparse_cleanup(&(xc->parser));
+		free(xc);
 		return NULL;
 	}
 
@@ -73,39 +116,310 @@ XC_EXPORT(XConfig *) XConfig_ParseFile(const char *file)
 
 /* Parse config string */
 XC_EXPORT(XConfig *) XConfig_ParseString(const char *string)
+{
+	return XConfig_ParseStringEx(string, 0);
+}
+
+/* Parse config string with flags */
+XC_EXPORT(XConfig *) XConfig_ParseStringEx(const char *string, unsigned flags)
 {
 	XConfig *xc = malloc(sizeof(XConfig));
+	if (!xc)
+		return NULL;
 
-	/* Load configuration. */
-	cparse_init(&(xc->parser), P_STR, -1, string);
-	xc->config = cparse_load(&(xc->parser));
+	if (string && !(flags & (XC_LAZY | XC_PRESERVE)))
+	{
+		/* Only read during the parse, no copy needed */
+		memset(&(xc->parser), 0, sizeof(CPState));
+		cparse_set_error(NULL, "%s", "");
+		xc->parser.type = P_STR;
+		xc->parser.str = (char *)string;
+		xc->parser.flags = flags;
+		xc->config = cparse_load(&(xc->parser));
+		xc->parser.str = NULL;
+	}
+	else
+	{
+		/* Load configuration, the copy lives as long as the config. */
+		cparse_init(&(xc->parser), P_STR, -1, string);
+		xc->parser.flags = flags;
+		xc->config = cparse_load(&(xc->parser));
+	}
 
 	if (!xc->config)
 	{
 		cparse_cleanup(&(xc->parser));
+		free(xc);
+		return NULL;
+	}
+
+	return xc;
+}
+
+/* Parse config file through the file cache */
+XC_EXPORT(XConfig *) XConfig_ParseFileCached(const char *file)
+{
+	return XConfig_ParseFileCachedEx(file, 0);
+}
+
+/* Parse config file through the file cache with flags */
+XC_EXPORT(XConfig *) XConfig_ParseFileCachedEx(const char *file, unsigned flags)
+{
+	XConfig *xc = calloc(1, sizeof(XConfig));
+	if (!xc)
+		return NULL;
+
+	/* Each open has its own handle on the shared config */
+	cparse_set_error(NULL, "%s", "");
+	xc->parser.type = P_STR;
+	xc->config = cparse_cache_open(file, flags);
+
+	if (!xc->config)
+	{
+		free(xc);
+		return NULL;
+	}
+
+	return xc;
+}
+
+/* Memory budget of the file cache */
+XC_EXPORT(void) XConfig_CacheSetBudget(size_t bytes)
+{
+	cparse_cache_set_budget(bytes);
+}
+
+/* Counters of the file cache */
+XC_EXPORT(void) XConfig_CacheStats(XConfigCacheStats *stats)
+{
+	cparse_cache_stats(stats);
+}
+
+/* Empty the file cache */
+XC_EXPORT(void) XConfig_CacheClear(void)
+{
+	cparse_cache_clear();
+}
+
+/* Parse files of a directory into one config */
+XC_EXPORT(XConfig *) XConfig_ParseDirectory(const char *dir, const char *pattern, unsigned flags)
+{
+	XConfig *xc = calloc(1, sizeof(XConfig));
+	if (!xc)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+	xc->parser.type = P_STR;
+	xc->config = cparse_load_directory(dir, pattern, flags);
+
+	if (!xc->config)
+	{
+		free(xc);
+		return NULL;
+	}
+
+	return xc;
+}
+
+/* Per-file timings of XConfig_ParseDirectory() */
+XC_EXPORT(const XConfigLoadStat *) XConfig_GetLoadStats(XConfig *xc, size_t *count)
+{
+	if (count)
+		*count = xc->config->load_stat_count;
+
+	return xc->config->load_stats;
+}
+
+/* Parse source into callbacks, no config is built */
+XC_EXPORT(bool) XConfig_ParseEvents(const XConfigSource *source,
+				const XConfigCallbacks *callbacks, void *user)
+{
+	CPState st;
+	bool ok;
+
+	if (!source || !callbacks)
+		return false;
+
+	memset(&st, 0, sizeof(CPState));
+
+	if (source->string)
+	{
+		/* Borrowed, never freed through cparse_cleanup() */
+		st.type = P_STR;
+		st.str = (char *)source->string;
+		return cparse_events(&st, callbacks, user);
+	}
+
+	st.type = P_FD;
+	st.fd = source->fd;
+
+	if (source->file)
+	{
+		if ((st.fd = open(source->file, O_RDONLY)) < 0)
+		{
+			cparse_set_error(&st, "Cannot open '%s'", source->file);
+			return false;
+		}
+		posix_fadvise(st.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	ok = cparse_events(&st, callbacks, user);
+
+	if (source->file)
+		close(st.fd);
+
+	return ok;
+}
+
+struct XConfig_Parser
+{
+	CPLoader loader;
+	bool ready;
+	CPLoader reuse;  /* Of XConfig_ParserParse(), owns its config */
+	XConfig result;
+};
+
+/* Create a push parser */
+XC_EXPORT(XConfig_Parser *) XConfig_ParserNew(void)
+{
+	XConfig_Parser *p = calloc(1, sizeof(XConfig_Parser));
+	if (!p)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+	p->ready = cparse_loader_init(&p->loader, 0);
+	if (!p->ready)
+	{
+		free(p);
 		return NULL;
 	}
 
+	return p;
+}
+
+/* Feed a chunk, the lexer state is kept between chunks */
+XC_EXPORT(bool) XConfig_ParserFeed(XConfig_Parser *p, const char *chunk, size_t len)
+{
+	if (!p || !p->ready)
+		return false;
+
+	return cparse_loader_feed(&p->loader, chunk, len);
+}
+
+/* End of input, returns the parsed config */
+XC_EXPORT(XConfig *) XConfig_ParserFinish(XConfig_Parser *p)
+{
+	if (!p || !p->ready)
+		return NULL;
+
+	Config *config = cparse_loader_finish(&p->loader);
+
+	/* Get ready for the next document */
+	cparse_loader_free(&p->loader);
+	p->ready = cparse_loader_init(&p->loader, 0);
+
+	if (config && config->include_count > 0)
+		config = cparse_include_resolve(config, NULL);
+
+	if (!config)
+		return NULL;
+
+	XConfig *xc = calloc(1, sizeof(XConfig));
+	if (!xc)
+	{
+		cparse_free(config);
+		return NULL;
+	}
+
+	xc->parser.type = P_STR;
+	xc->config = config;
+
 	return xc;
 }
 
+/* Free a push parser */
+XC_EXPORT(void) XConfig_ParserDelete(XConfig_Parser *p)
+{
+	if (!p)
+		return;
+
+	cparse_loader_free(&p->loader);
+	cparse_loader_free(&p->reuse);
+	free(p);
+}
+
+/* Parse a whole string into the parser's reused config */
+XC_EXPORT(XConfig *) XConfig_ParserParse(XConfig_Parser *p, const char *string,
+					size_t len, unsigned flags)
+{
+	if (!p)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+
+	/* XC_LAZY and XC_PRESERVE would need the string to outlive the parse */
+	Config *config = cparse_loader_parse(&p->reuse, string, len, flags & ~(XC_LAZY | XC_PRESERVE));
+	if (config && config->include_count > 0)
+	{
+		/* Consumed, the merged config is reused instead */
+		config = cparse_include_resolve(config, NULL);
+		p->reuse.config = config;
+	}
+
+	if (!config)
+		return NULL;
+
+	p->result.parser.type = P_STR;
+	p->result.config = config;
+	return &p->result;
+}
+
 /* Free memory. */
 XC_EXPORT(void) XConfig_Delete(XConfig *xc)
 {
 	if (!xc)
 		return;
 
-	/* Clean up */
-	cparse_free(xc->config);
+	/* Clean up, a cached config is only released */
+	if (xc->config && xc->config->cache)
+		cparse_cache_release(xc->config);
+	else
+		cparse_free(xc->config);
 	cparse_cleanup(&xc->parser);
 
 	free(xc);
 }
 
+/* Wrap a config built without a source, consumes CONFIG */
+XC_STATIC(XConfig *) XConfig_Wrap(Config *config)
+{
+	if (!config)
+		return NULL;
+
+	XConfig *xc = calloc(1, sizeof(XConfig));
+	if (!xc)
+	{
+		cparse_free(config);
+		return NULL;
+	}
+
+	xc->parser.type = P_STR;
+	xc->config = config;
+
+	return xc;
+}
+
 /* Read config data. */
 XC_EXPORT(const char *) XConfig_Read(XConfig *xc, const char *section, const char *key)
 {
-	return cparse_read(xc->config, section, key);
+	return cparse_read(xc->config, section, key, NULL);
+}
+
+/* Read config data and its length, values may hold NULs */
+XC_EXPORT(const char *) XConfig_ReadN(XConfig *xc, const char *section, const char *key,
+				size_t *len)
+{
+	return cparse_read(xc->config, section, key, len);
 }
 
 /* Get error string */
@@ -114,117 +428,138 @@ XC_EXPORT(const char *) XConfig_GetError(void)
 	return cparse_get_error();
 }
 
-/* Convert XConfig pointer to string. */
-#define INITIAL_BUF (1024)
-#define CHANGE_SZ() if (used_size > size) \
-		{ \
-			size *= 2; \
-			ret_buf = realloc(ret_buf, size); \
-			if (!ret_buf) \
-				return NULL; \
-		}
+/* Malformed lines skipped by the parse */
+XC_EXPORT(const XConfigDiag *) XConfig_GetDiagnostics(XConfig *xc, size_t *count,
+						size_t *total, const char **text)
+{
+	const ConfigDiags *diags = &xc->config->diags;
+
+	if (count)
+		*count = diags->count;
+	if (total)
+		*total = diags->total;
+	if (text)
+		*text = diags->text.data;
+
+	return diags->records;
+}
+
+/* Diagnostics kept by the parses of this thread */
+XC_EXPORT(void) XConfig_SetDiagLimit(size_t limit)
+{
+	cparse_set_diag_limit(limit);
+}
+
+/* Read a list value as string views */
+XC_EXPORT(const XConfigStr *) XConfig_ReadList(XConfig *xc, const char *section,
+					const char *key, size_t *count)
+{
+	return cparse_list_read(xc->config, section, key, XC_TYPE_STRING, count);
+}
 
+/* Read a list value as integers */
+XC_EXPORT(const int64_t *) XConfig_ReadIntArray(XConfig *xc, const char *section,
+					const char *key, size_t *count)
+{
+	return cparse_list_read(xc->config, section, key, XC_TYPE_INT, count);
+}
+
+/* Read a list value as doubles */
+XC_EXPORT(const double *) XConfig_ReadFloatArray(XConfig *xc, const char *section,
+					const char *key, size_t *count)
+{
+	return cparse_list_read(xc->config, section, key, XC_TYPE_FLOAT, count);
+}
+
+/* Append emitted output to a CPBuf */
+XC_STATIC(int) XConfig_BufSink(void *user, const char *data, size_t len)
+{
+	return !cparse_buf_append((CPBuf *)user, data, len);
+}
+
+/* Convert XConfig pointer to string. */
 XC_EXPORT(char *) XConfig_Print(XConfig *xc)
 {
-	size_t size = INITIAL_BUF;
-	size_t used_size = 0;
-	char *ret_buf = NULL;
+	return XConfig_PrintN(xc, NULL);
+}
+
+/* Convert XConfig pointer to string, its length in LEN */
+XC_EXPORT(char *) XConfig_PrintN(XConfig *xc, size_t *len)
+{
+	CPBuf buf = { 0 };
+	XConfigSink sink = { -1, XConfig_BufSink, &buf };
 
 	if (!xc->config)
 		return NULL;
 
-	/* Initialize the buffer */
-	ret_buf = malloc(size);
-	memset(ret_buf, 0, size);
-
-	ConfigSection *cs = xc->config->sections;
-	if (!cs)
-		return ret_buf;
+	/* An image has no sections to walk, do not print it as empty */
+	if (!XConfig_IsWritable(xc))
+		return NULL;
 
-	while (cs)
+	if (!cparse_emit(xc->config, EMIT_INI, &sink))
 	{
-		/* Catenet section name */
-		CHANGE_SZ();
-		if (strlen(cs->name) <= 0) {
-			cs = cs->next;
-			continue;
-		}
-		strcat(ret_buf, "[");
-		strcat(ret_buf, cs->name);
-		strcat(ret_buf, "]\n");
-		used_size += strlen(cs->name) + 2;
-
-		CHANGE_SZ();
-
-		/* Catenet Keys */
-		ConfigEntry *ce = cs->entries;
-		while (ce)
-		{
-			CHANGE_SZ();
-			strcat(ret_buf, ce->key);
-			strcat(ret_buf, " = \"");
-			strcat(ret_buf, ce->value);
-			strcat(ret_buf, "\"\n");
-			used_size += strlen(ce->value) + strlen(ce->key) + 6;
-			ce = ce->next;
-		}
-		strcat(ret_buf, "\n");
-		used_size++;
-		cs = cs->next;
+		free(buf.data);
+		return NULL;
 	}
 
-	/* Remove last '\n' */
-	ret_buf[strlen(ret_buf) - 1] = '\0';
+	if (len)
+		*len = buf.len;
 
-	return ret_buf;
+	/* An empty config prints as "" */
+	return buf.data ? buf.data : strdup("");
 }
 
-#undef CHANGE_SZ
-#undef INITIAL_BUF
+/* Write XC in a format */
+XC_EXPORT(bool) XConfig_Emit(XConfig *xc, int format, const XConfigSink *sink)
+{
+	return cparse_emit(xc->config, format, sink);
+}
 
 /* Have error */
 XC_EXPORT(bool) XConfig_HaveError(void)
 {
-	return (strlen(XConfig_GetError()) > 0);
+	return XConfig_GetError()[0] != '\0';
+}
+
+/* Emit a config as INI to a file being written */
+XC_STATIC(int) XConfig_WriteEmit(void *user, int fd)
+{
+	XConfigSink sink = { fd, NULL, NULL };
+	return cparse_emit((Config *)user, EMIT_INI, &sink);
 }
 
 /* Write config string to file */
 XC_EXPORT(bool) XConfig_WriteFile(XConfig *xc, const char *file)
 {
-	char *cstr = NULL;
-	int fd = -1;
-
-	/* Convert config pointer to string */
-	if ((cstr = XConfig_Print(xc)) == NULL)
+	/* Parsed with XC_PRESERVE: only changed entries are rewritten */
+	if ((xc->config->flags & CONFIG_PRESERVE) && xc->parser.str)
 	{
-		return false;
+		return cparse_save(xc->config, xc->parser.str,
+				xc->parser.len ? xc->parser.len : strlen(xc->parser.str), file);
 	}
 
-	/* Create and open file with W */
-	if ((fd = open(file, O_WRONLY | O_CREAT, 0666)) < 0)
-	{
-		free(cstr);
+	/* An image has no sections to walk, do not write it as empty */
+	if (!XConfig_IsWritable(xc))
 		return false;
-	}
-
-	/* Write to FD */
-	write(fd, cstr, strlen(cstr));
 
-	/* Clean up */
-	free(cstr);
-	close(fd);
-
-	return true;
+	/* Replace the file atomically, emitted straight into it */
+	return cparse_write_stream(file, XConfig_WriteEmit, xc->config);
 }
 
 /* Create a XConfig pointer */
 XC_EXPORT(XConfig *) XConfig_Create(void)
 {
-	XConfig *s = (XConfig*)malloc(sizeof(XConfig));
+	return XConfig_CreateEx(0);
+}
+
+/* Create a XConfig pointer with flags */
+XC_EXPORT(XConfig *) XConfig_CreateEx(unsigned flags)
+{
+	XConfig *s = (XConfig*)calloc(1, sizeof(XConfig));
 	if (!s)
 		return NULL;
 
-	s->config = (Config*)malloc(sizeof(Config));
+	s->config = (Config*)calloc(1, sizeof(Config));
 
 	if (!s->config)
 	{
@@ -232,77 +567,424 @@ XC_EXPORT(XConfig *) XConfig_Create(void)
 		return NULL;
 	}
 
+	s->config->flags = flags;
+
 	return s;
 }
 
 /* Add a section */
 XC_EXPORT(bool) XConfig_AddSection(XConfig *xc, const char *name)
 {
+	if (!XConfig_IsWritable(xc))
+		return false;
+
 	bool succ = config_add_section(xc->config, name);
 	return succ;
 }
 
 /* Check if a key had added */
-XC_STATIC(bool) XConfig_IsKeyAdded(ConfigSection *css, const char *key)
+XC_STATIC(bool) XConfig_IsKeyAdded(Config *config, ConfigSection *css, const char *key)
 {
 	bool found = false;
-	if (!css)
+	size_t len;
+	if (!css || !key)
 	{
 		return false;
 	}
 
-	if (!(css->entries) || !(css->entries->key))
-	{
-		return false;
-	}
+	/* Same matching as reads, XC_ICASE and XC_LAZY included. The key
+	 * table built here is kept up to date by the adds that follow */
+	len = strlen(key);
+	found = cparse_section_find(config, css, key, len, cparse_fold_hash(key, len)) != NULL;
 
-	ConfigEntry *ce = css->entries;
-	while (ce)
-	{
-		if (ce->key && strcmp(key, ce->key) != 0) {
-			ce = ce->next;
-			continue;
-		}
+	return found;
+}
+
+/* Section a write names, NULL for the first one */
+XC_STATIC(ConfigSection *) XConfig_WriteSection(XConfig *xc, const char *section)
+{
+	ConfigSection *css = section ? config_find_section(xc->config, section)
+		: xc->config->sections;
 
-		found = true;
-		break;
+	if (!css)
+	{
+		cparse_set_error(&xc->parser, "Section not found");
 	}
 
-	return found;
+	return css;
 }
 
 /* Add key-value pair to configuration */
 XC_EXPORT(bool) XConfig_AddKeyValue(XConfig *xc, const char *section,
 					const char *key, const char *name)
 {
-	ConfigSection *current_section = xc->config->sections;
-	bool found = false;
+	return XConfig_AddKeyValueN(xc, section, key, name, name ? strlen(name) : 0);
+}
 
-	/* Search section */
-	while (current_section)
+/* Add a key and a value of LEN bytes, NULs included */
+XC_EXPORT(bool) XConfig_AddKeyValueN(XConfig *xc, const char *section,
+					const char *key, const char *name, size_t len)
+{
+	ConfigSection *current_section;
+
+	if (!XConfig_IsWritable(xc))
+		return false;
+
+	/* Sections are found through a table once there are many */
+	current_section = XConfig_WriteSection(xc, section);
+	if (!current_section)
+		return false;
+
+	if (XConfig_IsKeyAdded(xc->config, current_section, key))
+	{
+		cparse_set_error(&xc->parser, "The key had already added");
+		return false;
+	}
+	if (key && strlen(key) > ENTRY_MAX_KEY)
 	{
-		if (section && strcmp(current_section->name, section) != 0)
+		cparse_set_error(&xc->parser, "Key longer than %d bytes", ENTRY_MAX_KEY);
+		return false;
+	}
+	TRACE("Founded section : '%s'\n", section);
+	xc->config->current_section = current_section;
+	if (!config_add_entry_len(xc->config, key, name, len))
+	{
+		cparse_set_error(&xc->parser, "Failed to add configuration entry");
+		return false;
+	}
+
+	return true;
+}
+
+/* Add a batch of key-value pairs to a section */
+XC_EXPORT(bool) XConfig_AddKeyValues(XConfig *xc, const char *section,
+					const XConfigKV *kvs, size_t n)
+{
+	ConfigSection *current_section;
+	size_t taken;
+	size_t i;
+
+	if (!XConfig_IsWritable(xc))
+		return false;
+
+	if (!kvs && n)
+	{
+		cparse_set_error(&xc->parser, "Invalid arguments");
+		return false;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (!kvs[i].key || !kvs[i].value)
 		{
-			current_section = current_section->next;
-			continue;
+			cparse_set_error(&xc->parser, "Invalid arguments");
+			return false;
 		}
-
-		found = true;
-		if (XConfig_IsKeyAdded(current_section, "key"))
+		if (strlen(kvs[i].key) > ENTRY_MAX_KEY)
 		{
-			cparse_set_error(&xc->parser, "The key had already added");
+			cparse_set_error(&xc->parser, "Key longer than %d bytes", ENTRY_MAX_KEY);
 			return false;
 		}
-		TRACE("Founded section : '%s'\n", section);
-		xc->config->current_section = current_section;
-		config_add_entry(xc->config, key, name);
-		break;
 	}
 
-	if (!found)
+	current_section = XConfig_WriteSection(xc, section);
+	if (!current_section)
+		return false;
+
+	/* Nothing is added unless every key is new */
+	taken = cparse_index_find_taken(xc->config, current_section, kvs, n);
+	if (taken == (size_t)-1)
+		return false;
+	if (taken < n)
 	{
-		cparse_set_error(&xc->parser, "Section not found");
+		cparse_set_error(&xc->parser, "The key had already added: %s", kvs[taken].key);
+		return false;
 	}
 
-	return found;
+	xc->config->current_section = current_section;
+	if (!config_add_entries(xc->config, kvs, n))
+	{
+		cparse_set_error(&xc->parser, "Failed to add configuration entries");
+		return false;
+	}
+
+	return true;
+}
+
+/* Preallocate for what is about to be added */
+XC_EXPORT(bool) XConfig_Reserve(XConfig *xc, size_t sections, size_t entries,
+				size_t string_bytes)
+{
+	if (!XConfig_IsWritable(xc))
+		return false;
+
+	return config_reserve(xc->config, sections, entries, string_bytes);
+}
+
+/* Set the value of a key */
+XC_EXPORT(bool) XConfig_Set(XConfig *xc, const char *section,
+				const char *key, const char *value)
+{
+	return XConfig_SetN(xc, section, key, value, value ? strlen(value) : 0);
+}
+
+/* Set the value of a key to LEN bytes, NULs included */
+XC_EXPORT(bool) XConfig_SetN(XConfig *xc, const char *section,
+				const char *key, const char *value, size_t len)
+{
+	ConfigSection *where = NULL;
+	ConfigEntry *ce;
+
+	if (!XConfig_IsWritable(xc))
+		return false;
+
+	ce = cparse_find(xc->config, section, key, &where);
+
+	/* Update in place, dependent expansions are invalidated */
+	if (ce)
+	{
+		return config_set_value(xc->config, where, ce, value, len);
+	}
+
+	return XConfig_AddKeyValueN(xc, section, key, value, len);
+}
+
+/* Remove a key */
+XC_EXPORT(bool) XConfig_Remove(XConfig *xc, const char *section, const char *key)
+{
+	ConfigSection *where = NULL;
+	ConfigEntry *ce;
+
+	if (!XConfig_IsWritable(xc))
+		return false;
+
+	ce = cparse_find(xc->config, section, key, &where);
+	if (!ce)
+	{
+		cparse_set_error(&xc->parser, "Key not found");
+		return false;
+	}
+
+	/* A parsed entry's line is dropped by the next XConfig_WriteFile() */
+	if (!config_remove_entry(xc->config, where, ce))
+	{
+		cparse_set_error(&xc->parser, "Failed to allocate memory");
+		return false;
+	}
+
+	return true;
+}
+
+/* Visit keys starting with a prefix, in key order */
+XC_EXPORT(bool) XConfig_ScanPrefix(XConfig *xc, const char *section, const char *prefix,
+				XConfigScanFn cb, void *user)
+{
+	return cparse_scan(xc->config, section, prefix ? prefix : "", NULL, 1, cb, user);
+}
+
+/* Visit keys in [from, to), in key order */
+XC_EXPORT(bool) XConfig_ScanRange(XConfig *xc, const char *section, const char *from,
+				const char *to, XConfigScanFn cb, void *user)
+{
+	return cparse_scan(xc->config, section, from, to, 0, cb, user);
+}
+
+/* Export a read-only image for other processes */
+XC_EXPORT(int) XConfig_Share(XConfig *xc)
+{
+	return cparse_image_export(xc->config);
+}
+
+/* Map a shared image, nothing is parsed or copied */
+XC_EXPORT(XConfig *) XConfig_Attach(int fd)
+{
+	XConfig *xc = calloc(1, sizeof(XConfig));
+	if (!xc)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+	xc->parser.type = P_STR;
+	xc->config = cparse_image_attach(fd);
+
+	if (!xc->config)
+	{
+		free(xc);
+		return NULL;
+	}
+
+	return xc;
+}
+
+/* Hash of a name, as XConfig_ReadHashed() expects it */
+XC_EXPORT(uint32_t) XConfig_Hash(const char *name, size_t len)
+{
+	return cparse_fold_hash(name, len);
+}
+
+/* Read config data with precomputed name hashes */
+XC_EXPORT(const char *) XConfig_ReadHashed(XConfig *xc, const char *section, uint32_t section_hash,
+					const char *key, uint32_t key_hash)
+{
+	return XConfig_ReadHashedN(xc, section, section_hash, key, key_hash, NULL);
+}
+
+/* Read config data and its length with precomputed name hashes */
+XC_EXPORT(const char *) XConfig_ReadHashedN(XConfig *xc, const char *section, uint32_t section_hash,
+					const char *key, uint32_t key_hash, size_t *len)
+{
+	ConfigSection *where = NULL;
+	ConfigEntry *ce;
+
+	/* An image has its own index */
+	if (xc->config->image)
+		return cparse_image_read(xc->config->image, section, key, len);
+
+	ce = cparse_find_hashed(xc->config, section, section_hash, key, key_hash, &where);
+	if (!ce)
+		return NULL;
+
+	return cparse_entry_value(xc->config, where, ce, len);
+}
+
+
+struct XConfig_Schema
+{
+	ConfigSchema *schema;
+};
+
+/* Create an empty schema */
+XC_EXPORT(XConfig_Schema *) XConfig_SchemaNew(unsigned flags)
+{
+	XConfig_Schema *schema = malloc(sizeof(XConfig_Schema));
+	if (!schema)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+	schema->schema = cparse_schema_new(flags);
+	if (!schema->schema)
+	{
+		free(schema);
+		return NULL;
+	}
+
+	return schema;
+}
+
+/* Declare a section */
+XC_EXPORT(bool) XConfig_SchemaSection(XConfig_Schema *schema, const char *section, bool required)
+{
+	return cparse_schema_section(schema->schema, section, required);
+}
+
+/* Declare a key */
+XC_EXPORT(bool) XConfig_SchemaKey(XConfig_Schema *schema, const char *section, const char *key,
+				int type, bool required)
+{
+	return cparse_schema_key(schema->schema, section, key, type, required);
+}
+
+/* Bound a key's value */
+XC_EXPORT(bool) XConfig_SchemaRange(XConfig_Schema *schema, const char *section, const char *key,
+				double min, double max)
+{
+	return cparse_schema_range(schema->schema, section, key, min, max);
+}
+
+/* Restrict a key to a set of values */
+XC_EXPORT(bool) XConfig_SchemaEnum(XConfig_Schema *schema, const char *section, const char *key,
+				const char *const *values, size_t count)
+{
+	return cparse_schema_enum(schema->schema, section, key, values, count);
+}
+
+/* Compile the declarations into lookup tables and bitsets */
+XC_EXPORT(bool) XConfig_SchemaCompile(XConfig_Schema *schema)
+{
+	return cparse_schema_compile(schema->schema);
+}
+
+/* Free a schema */
+XC_EXPORT(void) XConfig_SchemaDelete(XConfig_Schema *schema)
+{
+	if (!schema)
+		return;
+
+	cparse_schema_free(schema->schema);
+	free(schema);
+}
+
+/* Check a config against a schema in one pass */
+XC_EXPORT(bool) XConfig_Validate(XConfig *xc, const XConfig_Schema *schema,
+				XConfigViolation **violations, size_t *count)
+{
+	return cparse_validate(xc->config, schema->schema, violations, count);
+}
+
+
+struct XConfig_Builder
+{
+	ConfigBuilder *builder;
+};
+
+/* Create a builder fed by several threads */
+XC_EXPORT(XConfig_Builder *) XConfig_BuilderNew(unsigned flags, unsigned producers)
+{
+	XConfig_Builder *b = malloc(sizeof(XConfig_Builder));
+	if (!b)
+		return NULL;
+
+	cparse_set_error(NULL, "%s", "");
+	b->builder = cparse_builder_new(flags, producers);
+	if (!b->builder)
+	{
+		free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+/* Add a key-value pair from one producer thread */
+XC_EXPORT(bool) XConfig_BuilderAdd(XConfig_Builder *b, unsigned producer, const char *section,
+				const char *key, const char *value)
+{
+	return cparse_builder_add(b->builder, producer, section, key, value);
+}
+
+/* Link what the producers added into a config */
+XC_EXPORT(XConfig *) XConfig_BuilderFreeze(XConfig_Builder *b)
+{
+	return XConfig_Wrap(cparse_builder_freeze(b->builder));
+}
+
+/* Free a builder */
+XC_EXPORT(void) XConfig_BuilderDelete(XConfig_Builder *b)
+{
+	if (!b)
+		return;
+
+	cparse_builder_free(b->builder);
+	free(b);
+}
+
+/* Report the keys that differ between two configs */
+XC_EXPORT(bool) XConfig_Diff(XConfig *a, XConfig *b, XConfigDiffFn cb, void *user)
+{
+	return cparse_diff(a->config, b->config, cb, user);
+}
+
+/* Three-way merge, conflicts keep ours */
+XC_EXPORT(XConfig *) XConfig_Merge3(XConfig *base, XConfig *ours, XConfig *theirs,
+				XConfigConflictFn cb, void *user)
+{
+	return XConfig_Wrap(cparse_merge3(base->config, ours->config, theirs->config, cb, user));
+}
+
+/* Content hash, maintained by the adds, updates and removals */
+XC_EXPORT(bool) XConfig_Fingerprint(XConfig *xc, XConfigFingerprint *fp)
+{
+	if (!xc || !fp)
+		return false;
+
+	return cparse_fingerprint(xc->config, fp);
 }
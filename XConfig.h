@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #if defined (_WIN32) || defined (_WINDOWS)
  #define XC_EXPORT(type) __declspec(dllexport) type
@@ -21,6 +22,10 @@
 # define TRACE(...)
 #endif // NO_TRACE
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #if !defined(__CPState_defined)
 typedef struct
 {
@@ -31,8 +36,11 @@ typedef struct
 	} type;
 
 	char *str;
+	size_t len;       /* Of STR, 0: up to its NUL */
 	int fd;
 	off_t off;
+	const char *path; /* Source file, used to resolve includes */
+	unsigned flags;   /* XC_* parse flags */
 } CPState;
 
 #define __CPState_defined
@@ -40,29 +48,305 @@ typedef struct
 
 typedef struct Config Config;
 
+#if !defined(__XConfigCallbacks_defined)
+/* Event callbacks, views are NUL-terminated and valid during the call.
+ * Return non-zero to stop parsing. */
+typedef struct
+{
+	int (*on_section)(void *user, const char *name, size_t len);
+	int (*on_entry)(void *user, const char *key, size_t key_len,
+			const char *value, size_t value_len);
+	int (*on_error)(void *user, int line, const char *msg, size_t len);
+} XConfigCallbacks;
+#define __XConfigCallbacks_defined
+#endif /* __XConfigCallbacks_defined */
+
+#if !defined(__XConfigLoadStat_defined)
+/* Per-file timing of XConfig_ParseDirectory() */
+typedef struct
+{
+	const char *file;   /* File name inside the directory */
+	uint64_t read_ns;   /* Open and read */
+	uint64_t parse_ns;  /* Parse, including its includes */
+} XConfigLoadStat;
+#define __XConfigLoadStat_defined
+#endif /* __XConfigLoadStat_defined */
+
+#if !defined(__XConfigDiag_defined)
+/* Malformed line found by a parse, see XConfig_GetDiagnostics() */
+typedef struct
+{
+	int line;
+	int column;          /* 1-based byte column */
+	int code;            /* XC_DIAG_* */
+	uint32_t message;    /* Offset of the message in the diagnostics text */
+} XConfigDiag;
+#define __XConfigDiag_defined
+#endif /* __XConfigDiag_defined */
+
+#if !defined(__XConfigViolation_defined)
+/* Schema violation found by XConfig_Validate() */
+typedef struct
+{
+	int kind;            /* XC_VIOLATION_* */
+	const char *section;
+	const char *key;     /* NULL when about the section */
+	const char *value;   /* Offending value, NULL if missing */
+	int line;            /* Entry or section header, 0 if unknown */
+} XConfigViolation;
+#define __XConfigViolation_defined
+#endif /* __XConfigViolation_defined */
+
+#if !defined(__XConfigScanFn_defined)
+/* Key scan callback, return non-zero to stop the scan */
+typedef int (*XConfigScanFn)(void *user, const char *key, const char *value);
+#define __XConfigScanFn_defined
+#endif /* __XConfigScanFn_defined */
+
+#if !defined(__XConfigKV_defined)
+/* Key-value pair of XConfig_AddKeyValues() */
+typedef struct
+{
+	const char *key;
+	const char *value;
+} XConfigKV;
+#define __XConfigKV_defined
+#endif /* __XConfigKV_defined */
+
+#if !defined(__XConfigStr_defined)
+/* Element of XConfig_ReadList(), not NUL-terminated */
+typedef struct
+{
+	const char *ptr;
+	size_t len;
+} XConfigStr;
+#define __XConfigStr_defined
+#endif /* __XConfigStr_defined */
+
+#if !defined(__XConfigDiffFn_defined)
+/* Diff callback, OLD is NULL for an added key and NEW for a removed
+ * one. Return non-zero to stop the diff */
+typedef int (*XConfigDiffFn)(void *user, int kind, const char *section, const char *key,
+				const char *old_value, const char *new_value);
+#define __XConfigDiffFn_defined
+#endif /* __XConfigDiffFn_defined */
+
+#if !defined(__XConfigConflictFn_defined)
+/* Merge conflict callback, a NULL value is a missing key. Return
+ * non-zero to give up the merge */
+typedef int (*XConfigConflictFn)(void *user, const char *section, const char *key,
+				const char *base, const char *ours, const char *theirs);
+#define __XConfigConflictFn_defined
+#endif /* __XConfigConflictFn_defined */
+
+#if !defined(__XConfigSink_defined)
+/* Output of XConfig_Emit(): WRITE if set, else the file descriptor FD.
+ * WRITE returns non-zero to stop the output */
+typedef struct
+{
+	int fd;
+	int (*write)(void *user, const char *data, size_t len);
+	void *user;
+} XConfigSink;
+#define __XConfigSink_defined
+#endif /* __XConfigSink_defined */
+
+#if !defined(__XConfigCacheStats_defined)
+/* Counters of the file cache, see XConfig_ParseFileCached() */
+typedef struct
+{
+	uint64_t hits;       /* Opens that found the file unchanged */
+	uint64_t misses;     /* Opens that parsed it */
+	uint64_t evictions;  /* Files dropped to stay within the budget */
+	size_t entries;      /* Files cached now */
+	size_t bytes;        /* Their memory, as charged to the budget */
+	size_t budget;
+} XConfigCacheStats;
+#define __XConfigCacheStats_defined
+#endif /* __XConfigCacheStats_defined */
+
+#if !defined(__XConfigFingerprint_defined)
+/* 128-bit content hash, see XConfig_Fingerprint() */
+typedef struct
+{
+	uint64_t hi;
+	uint64_t lo;
+} XConfigFingerprint;
+#define __XConfigFingerprint_defined
+#endif /* __XConfigFingerprint_defined */
+
+/* Input of XConfig_ParseEvents(), the first one set is used */
+typedef struct
+{
+	const char *string; /* NUL-terminated config string */
+	const char *file;   /* Path of a config file */
+	int fd;             /* Open file descriptor */
+} XConfigSource;
+
+/* Flags for XConfig_*Ex() */
+#define XC_INTERPOLATE 0x1 /* Expand ${section.key} references on read */
+#define XC_PRESERVE 0x2 /* Keep the source, XConfig_WriteFile() rewrites only changes */
+#define XC_ICASE 0x4 /* Sections and keys match ignoring ASCII case */
+#define XC_LINES 0x8 /* Remember the line of each entry, for XConfig_Validate() */
+#define XC_LAZY 0x10 /* Index section headers only, parse a section when first used,
+                        * ignored with XC_FAIL_FAST */
+#define XC_DEFER_ESCAPES 0x20 /* Decode escapes of a quoted value when it is first read */
+#define XC_FAIL_FAST 0x40 /* A malformed line fails the parse instead of being skipped */
+#define XC_DIR_STRICT 0x100 /* XConfig_ParseDirectory(): a key set by two files is an error */
+
+/* Value types of XConfig_SchemaKey() */
+#define XC_TYPE_STRING 0
+#define XC_TYPE_INT 1    /* Decimal, 64-bit */
+#define XC_TYPE_FLOAT 2
+#define XC_TYPE_BOOL 3   /* 1/0, true/false, yes/no, on/off */
+
+/* Flags for XConfig_SchemaNew() */
+#define XC_SCHEMA_STRICT 0x1 /* Undeclared sections and keys are violations */
+
+/* Kinds of XConfigViolation */
+#define XC_VIOLATION_MISSING 1 /* Required section or key */
+#define XC_VIOLATION_UNKNOWN 2 /* Not declared, XC_SCHEMA_STRICT */
+#define XC_VIOLATION_TYPE 3
+#define XC_VIOLATION_RANGE 4
+#define XC_VIOLATION_ENUM 5
+
+/* Codes of XConfigDiag */
+#define XC_DIAG_SECTION 1     /* Missing ']' in section header */
+#define XC_DIAG_KEY_QUOTE 2   /* Unclosed quotes in key */
+#define XC_DIAG_EQUALS 3      /* Expected '=' after key */
+#define XC_DIAG_VALUE_QUOTE 4 /* Unclosed quote */
+#define XC_DIAG_KEY_LENGTH 5  /* Key longer than 65535 bytes, the line is skipped */
+
+/* Kinds of XConfig_Diff() changes */
+#define XC_DIFF_ADDED 1
+#define XC_DIFF_REMOVED 2
+#define XC_DIFF_CHANGED 3
+
+/* Formats of XConfig_Emit() */
+#define XC_EMIT_INI 0  /* Parser syntax, every entry, references kept */
+#define XC_EMIT_JSON 1 /* Object of section objects, values as read */
+#define XC_EMIT_ENV 2  /* SECTION_KEY=value lines for a POSIX shell */
+
 typedef struct {
 	CPState parser;
 	Config *config;
 } XConfig;
 
+/* Resumable parser for input arriving in chunks */
+typedef struct XConfig_Parser XConfig_Parser;
+
+/* Declared sections and keys, compiled into a validator */
+typedef struct XConfig_Schema XConfig_Schema;
+
+/* Config built by several threads at once, see XConfig_BuilderAdd() */
+typedef struct XConfig_Builder XConfig_Builder;
+
 /* Parse config file */
 XC_EXPORT(XConfig *) XConfig_ParseFile(const char *file);
 
 /* Parse config string */
 XC_EXPORT(XConfig *) XConfig_ParseString(const char *string);
 
+/* Parse config file with XC_* flags */
+XC_EXPORT(XConfig *) XConfig_ParseFileEx(const char *file, unsigned flags);
+
+/* Parse config string with XC_* flags */
+XC_EXPORT(XConfig *) XConfig_ParseStringEx(const char *string, unsigned flags);
+
+/* Parse a file through the process-wide cache: while its inode, size and
+ * mtime are unchanged, every open shares one read-only config and costs
+ * one stat(). XConfig_Delete() drops the reference */
+XC_EXPORT(XConfig *) XConfig_ParseFileCached(const char *file);
+
+/* XConfig_ParseFileCached() with XC_* flags, part of the cache key.
+ * XC_PRESERVE is ignored */
+XC_EXPORT(XConfig *) XConfig_ParseFileCachedEx(const char *file, unsigned flags);
+
+/* Limit the memory of cached files, 64 MB by default, 0 turns the cache
+ * off. The least recently used files are evicted */
+XC_EXPORT(void) XConfig_CacheSetBudget(size_t bytes);
+
+/* Hit, miss and eviction counters and the size of the file cache */
+XC_EXPORT(void) XConfig_CacheStats(XConfigCacheStats *stats);
+
+/* Drop every cached file, configs still open stay valid */
+XC_EXPORT(void) XConfig_CacheClear(void);
+
+/* Parse files of DIR matching PATTERN (default "*.conf") into one config */
+XC_EXPORT(XConfig *) XConfig_ParseDirectory(const char *dir, const char *pattern, unsigned flags);
+
+/* Per-file timings of XConfig_ParseDirectory(), in lexical file order */
+XC_EXPORT(const XConfigLoadStat *) XConfig_GetLoadStats(XConfig *xc, size_t *count);
+
+/* Parse SOURCE into callbacks without building a config */
+XC_EXPORT(bool) XConfig_ParseEvents(const XConfigSource *source,
+				const XConfigCallbacks *callbacks, void *user);
+
+/* Create a push parser */
+XC_EXPORT(XConfig_Parser *) XConfig_ParserNew(void);
+
+/* Feed a chunk of input, chunks may end anywhere */
+XC_EXPORT(bool) XConfig_ParserFeed(XConfig_Parser *p, const char *chunk, size_t len);
+
+/* End of input, returns the parsed config. P can parse again afterwards */
+XC_EXPORT(XConfig *) XConfig_ParserFinish(XConfig_Parser *p);
+
+/* Free a push parser */
+XC_EXPORT(void) XConfig_ParserDelete(XConfig_Parser *p);
+
+/* Parse a whole string of LEN bytes with XC_* flags (XC_LAZY and
+ * XC_PRESERVE ignored, XConfig_WriteFile() regenerates the file)
+ * into a config P keeps and reuses: valid until the next call or
+ * XConfig_ParserDelete(), never passed to XConfig_Delete(). Once
+ * earlier parses made room, a parse allocates no memory */
+XC_EXPORT(XConfig *) XConfig_ParserParse(XConfig_Parser *p, const char *string,
+					size_t len, unsigned flags);
+
 /* Free memory */
 XC_EXPORT(void) XConfig_Delete(XConfig *xc);
 
 /* Read config data */
 XC_EXPORT(const char *) XConfig_Read(XConfig *xc, const char *section, const char *key);
 
+/* Read config data and its length in LEN, stored with the value. The
+ * value is NUL-terminated but may hold NULs, such as from "\0" */
+XC_EXPORT(const char *) XConfig_ReadN(XConfig *xc, const char *section, const char *key,
+				size_t *len);
+
+/* Elements of a list value such as "a, b, c", "[1 2 3]" or
+ * ["x,y", z], split once and kept until the value changes */
+XC_EXPORT(const XConfigStr *) XConfig_ReadList(XConfig *xc, const char *section,
+					const char *key, size_t *count);
+
+/* Elements of a list value as decimal 64-bit integers, NULL if one is not */
+XC_EXPORT(const int64_t *) XConfig_ReadIntArray(XConfig *xc, const char *section,
+					const char *key, size_t *count);
+
+/* Elements of a list value as doubles, NULL if one is not a number */
+XC_EXPORT(const double *) XConfig_ReadFloatArray(XConfig *xc, const char *section,
+					const char *key, size_t *count);
+
 /* Convert XConfig pointer to string */
 XC_EXPORT(char *) XConfig_Print(XConfig *xc);
 
+/* XConfig_Print() with the length of the string in LEN */
+XC_EXPORT(char *) XConfig_PrintN(XConfig *xc, size_t *len);
+
+/* Write XC to SINK as XC_EMIT_*, a few KB buffered at a time */
+XC_EXPORT(bool) XConfig_Emit(XConfig *xc, int format, const XConfigSink *sink);
+
 /* Get error string */
 XC_EXPORT(const char *) XConfig_GetError(void);
 
+/* Malformed lines the parse of XC skipped, COUNT records kept of TOTAL
+ * found (may be NULL). A message is *TEXT + record->message */
+XC_EXPORT(const XConfigDiag *) XConfig_GetDiagnostics(XConfig *xc, size_t *count,
+						size_t *total, const char **text);
+
+/* Keep at most LIMIT diagnostics in each parse this thread starts,
+ * 100 by default. Others are only counted */
+XC_EXPORT(void) XConfig_SetDiagLimit(size_t limit);
+
 /* Have error */
 XC_EXPORT(bool) XConfig_HaveError(void);
 
@@ -72,6 +356,9 @@ XC_EXPORT(bool) XConfig_WriteFile(XConfig *xc, const char *file);
 /* Create a XConfig pointer */
 XC_EXPORT(XConfig *) XConfig_Create(void);
 
+/* Create a XConfig pointer with XC_* flags */
+XC_EXPORT(XConfig *) XConfig_CreateEx(unsigned flags);
+
 /* Add a section */
 XC_EXPORT(bool) XConfig_AddSection(XConfig *xc, const char *section);
 
@@ -79,4 +366,115 @@ XC_EXPORT(bool) XConfig_AddSection(XConfig *xc, const char *section);
 XC_EXPORT(bool) XConfig_AddKeyValue(XConfig *xc, const char *section,
 					const char *key, const char *value);
 
+/* Add a key and the LEN bytes of VALUE, which may hold NULs */
+XC_EXPORT(bool) XConfig_AddKeyValueN(XConfig *xc, const char *section,
+					const char *key, const char *value, size_t len);
+
+/* Add N key-value pairs to SECTION at once, all or none. Fails if a
+ * key is in SECTION already or repeated in KVS */
+XC_EXPORT(bool) XConfig_AddKeyValues(XConfig *xc, const char *section,
+					const XConfigKV *kvs, size_t n);
+
+/* Preallocate for SECTIONS sections and ENTRIES entries whose keys and
+ * values take STRING_BYTES in all, before adding them */
+XC_EXPORT(bool) XConfig_Reserve(XConfig *xc, size_t sections, size_t entries,
+				size_t string_bytes);
+
+/* Set the value of a key, adding it to an existing section if needed */
+XC_EXPORT(bool) XConfig_Set(XConfig *xc, const char *section,
+				const char *key, const char *value);
+
+/* XConfig_Set() to the LEN bytes of VALUE, which may hold NULs */
+XC_EXPORT(bool) XConfig_SetN(XConfig *xc, const char *section,
+				const char *key, const char *value, size_t len);
+
+/* Remove a key */
+XC_EXPORT(bool) XConfig_Remove(XConfig *xc, const char *section, const char *key);
+
+/* Visit keys of SECTION starting with PREFIX, in key order */
+XC_EXPORT(bool) XConfig_ScanPrefix(XConfig *xc, const char *section, const char *prefix,
+				XConfigScanFn cb, void *user);
+
+/* Visit keys of SECTION in [FROM, TO), in key order. NULL bounds are open */
+XC_EXPORT(bool) XConfig_ScanRange(XConfig *xc, const char *section, const char *from,
+				const char *to, XConfigScanFn cb, void *user);
+
+/* Export a read-only image of XC in a sealed memfd, returns the fd or -1 */
+XC_EXPORT(int) XConfig_Share(XConfig *xc);
+
+/* Map an image made by XConfig_Share(), XConfig_Read() only */
+XC_EXPORT(XConfig *) XConfig_Attach(int fd);
+
+/* Hash of a section or key name for XConfig_ReadHashed():
+ * 32-bit FNV-1a of its ASCII lower case */
+XC_EXPORT(uint32_t) XConfig_Hash(const char *name, size_t len);
+
+/* XConfig_Read() with precomputed XConfig_Hash() of SECTION and KEY */
+XC_EXPORT(const char *) XConfig_ReadHashed(XConfig *xc, const char *section, uint32_t section_hash,
+					const char *key, uint32_t key_hash);
+
+/* XConfig_ReadHashed() with the length of the value in LEN */
+XC_EXPORT(const char *) XConfig_ReadHashedN(XConfig *xc, const char *section, uint32_t section_hash,
+					const char *key, uint32_t key_hash, size_t *len);
+
+/* Create an empty schema with XC_SCHEMA_* flags */
+XC_EXPORT(XConfig_Schema *) XConfig_SchemaNew(unsigned flags);
+
+/* Declare a section, NULL for entries before any section header */
+XC_EXPORT(bool) XConfig_SchemaSection(XConfig_Schema *schema, const char *section, bool required);
+
+/* Declare a key of XC_TYPE_*, required when its section is present */
+XC_EXPORT(bool) XConfig_SchemaKey(XConfig_Schema *schema, const char *section, const char *key,
+				int type, bool required);
+
+/* Bound a declared number key to [MIN, MAX], or a string key's length */
+XC_EXPORT(bool) XConfig_SchemaRange(XConfig_Schema *schema, const char *section, const char *key,
+				double min, double max);
+
+/* Restrict a declared key to COUNT values */
+XC_EXPORT(bool) XConfig_SchemaEnum(XConfig_Schema *schema, const char *section, const char *key,
+				const char *const *values, size_t count);
+
+/* Compile the declarations, the schema is read-only afterwards */
+XC_EXPORT(bool) XConfig_SchemaCompile(XConfig_Schema *schema);
+
+/* Free a schema */
+XC_EXPORT(void) XConfig_SchemaDelete(XConfig_Schema *schema);
+
+/* Check XC against a compiled schema. True if valid, else VIOLATIONS
+ * (free() it, may be NULL) holds COUNT records, none on errors */
+XC_EXPORT(bool) XConfig_Validate(XConfig *xc, const XConfig_Schema *schema,
+				XConfigViolation **violations, size_t *count);
+
+/* Report the keys added, removed or changed from A to B, by stored value */
+XC_EXPORT(bool) XConfig_Diff(XConfig *a, XConfig *b, XConfigDiffFn cb, void *user);
+
+/* Merge the changes from BASE to OURS and to THEIRS. Conflicts are
+ * passed to CB (may be NULL) and keep OURS */
+XC_EXPORT(XConfig *) XConfig_Merge3(XConfig *base, XConfig *ours, XConfig *theirs,
+				XConfigConflictFn cb, void *user);
+
+/* 128-bit hash of the stored content, in order. Kept up to date by every
+ * change, so equal configs compare in O(1). Not a cryptographic hash */
+XC_EXPORT(bool) XConfig_Fingerprint(XConfig *xc, XConfigFingerprint *fp);
+
+/* Create a builder for PRODUCERS threads, XC_INTERPOLATE and XC_ICASE apply */
+XC_EXPORT(XConfig_Builder *) XConfig_BuilderNew(unsigned flags, unsigned producers);
+
+/* Add KEY = VALUE to SECTION (NULL: before any section) as producer
+ * PRODUCER, in [0, producers). Threads must use different producers. */
+XC_EXPORT(bool) XConfig_BuilderAdd(XConfig_Builder *b, unsigned producer, const char *section,
+				const char *key, const char *value);
+
+/* Build the config from all that was added, in a deterministic order.
+ * B is empty afterwards; no thread may add during the call */
+XC_EXPORT(XConfig *) XConfig_BuilderFreeze(XConfig_Builder *b);
+
+/* Free a builder and what was added since the last freeze */
+XC_EXPORT(void) XConfig_BuilderDelete(XConfig_Builder *b);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // _XCONFIG_H
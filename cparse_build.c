@@ -0,0 +1,476 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* A section of a stage and its position among the stage's sections */
+typedef struct
+{
+	ConfigSection *section;
+	size_t pos;
+} BuildRef;
+
+/* Staging area of one producer, only its thread touches it */
+typedef struct
+{
+	Config *config;       /* Own sections and arena */
+	ConfigSection **map;  /* Open addressing by name hash */
+	size_t map_size;      /* Power of two, at least twice the sections */
+	BuildRef *shards[BUILD_SHARDS]; /* Sections by name hash, in order */
+	size_t shard_count[BUILD_SHARDS];
+	size_t shard_capacity[BUILD_SHARDS];
+} BuildStage;
+
+struct ConfigBuilder
+{
+	unsigned flags;
+	unsigned producers;
+	BuildStage **stages;  /* One per producer, created on its first add */
+};
+
+/* Sections of all stages with one name, merged into the first */
+typedef struct
+{
+	ConfigSection *section;
+	unsigned producer;    /* Stage and position of the first */
+	size_t pos;
+} BuildGroup;
+
+/* Groups of one shard, filled by a freeze worker */
+typedef struct
+{
+	BuildGroup *groups;
+	size_t count;
+	XConfigFingerprint fingerprint; /* Change made by the merges */
+	int failed;
+} BuildShard;
+
+typedef struct
+{
+	const ConfigBuilder *builder;
+	BuildShard *shards;
+} BuildFreeze;
+
+// ==================== Stages ====================
+
+/**
+ * Find the section NAME of STAGE
+ */
+static ConfigSection *stage_find(const BuildStage *stage, const char *name, uint32_t hash)
+{
+	if (!stage->map) return NULL;
+
+	size_t mask = stage->map_size - 1;
+	for (size_t i = hash & mask; stage->map[i]; i = (i + 1) & mask) {
+		ConfigSection *cs = stage->map[i];
+		if (cs->name_hash == hash && config_name_equal(stage->config, cs->name, name)) {
+			return cs;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Put SECTION, already added to the stage's config, in its map
+ */
+static int stage_map_put(BuildStage *stage, ConfigSection *section)
+{
+	if (stage->config->section_count * 2 > stage->map_size) {
+		size_t size = stage->map_size ? stage->map_size * BUFFER_GROWTH_FACTOR : 16;
+		ConfigSection **map = calloc(size, sizeof(ConfigSection *));
+		if (!map) return 0;
+
+		for (size_t i = 0; i < stage->map_size; i++) {
+			ConfigSection *cs = stage->map[i];
+			if (!cs) continue;
+
+			size_t j = cs->name_hash & (size - 1);
+			while (map[j]) j = (j + 1) & (size - 1);
+			map[j] = cs;
+		}
+
+		free(stage->map);
+		stage->map = map;
+		stage->map_size = size;
+	}
+
+	size_t i = section->name_hash & (stage->map_size - 1);
+	while (stage->map[i]) i = (i + 1) & (stage->map_size - 1);
+	stage->map[i] = section;
+	return 1;
+}
+
+/**
+ * Section NAME of STAGE, added and filed under its shard on first use
+ */
+static ConfigSection *stage_section(BuildStage *stage, const char *name)
+{
+	uint32_t hash = cparse_fold_hash(name, strlen(name));
+
+	ConfigSection *section = stage_find(stage, name, hash);
+	if (section) return section;
+
+	size_t shard = hash % BUILD_SHARDS;
+	if (stage->shard_count[shard] == stage->shard_capacity[shard]) {
+		size_t capacity = stage->shard_capacity[shard] ? stage->shard_capacity[shard] * BUFFER_GROWTH_FACTOR : 8;
+		BuildRef *refs = realloc(stage->shards[shard], capacity * sizeof(BuildRef));
+		if (!refs) return NULL;
+		stage->shards[shard] = refs;
+		stage->shard_capacity[shard] = capacity;
+	}
+
+	size_t pos = stage->config->section_count;
+	section = config_add_section(stage->config, name);
+	if (!section || !stage_map_put(stage, section)) {
+		return NULL;
+	}
+
+	stage->shards[shard][stage->shard_count[shard]++] = (BuildRef){ section, pos };
+	return section;
+}
+
+/**
+ * Create the stage of a producer
+ */
+static BuildStage *stage_new(unsigned flags)
+{
+	BuildStage *stage = calloc(1, sizeof(BuildStage));
+	if (!stage) return NULL;
+
+	stage->config = calloc(1, sizeof(Config));
+	if (!stage->config) {
+		free(stage);
+		return NULL;
+	}
+	stage->config->flags = flags;
+
+	return stage;
+}
+
+/**
+ * Free STAGE and what is left in its config
+ */
+static void stage_free(BuildStage *stage)
+{
+	if (!stage) return;
+
+	cparse_free(stage->config);
+	free(stage->map);
+	for (size_t i = 0; i < BUILD_SHARDS; i++) {
+		free(stage->shards[i]);
+	}
+	free(stage);
+}
+
+// ==================== Builder ====================
+
+/**
+ * Builder fed by up to PRODUCERS threads at once. Each producer adds
+ * to a stage of its own, a private config, so adding takes no lock.
+ */
+ConfigBuilder *cparse_builder_new(unsigned flags, unsigned producers)
+{
+	if (producers == 0) {
+		cparse_set_error(NULL, "A builder needs at least one producer");
+		return NULL;
+	}
+
+	ConfigBuilder *builder = calloc(1, sizeof(ConfigBuilder));
+	if (builder) {
+		builder->stages = calloc(producers, sizeof(BuildStage *));
+	}
+	if (!builder || !builder->stages) {
+		free(builder);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	builder->flags = flags & (CONFIG_INTERPOLATE | CONFIG_ICASE);
+	builder->producers = producers;
+	return builder;
+}
+
+/**
+ * Add KEY = VALUE to SECTION from PRODUCER. One thread at a time may
+ * use a given producer, different producers may add concurrently.
+ */
+int cparse_builder_add(ConfigBuilder *builder, unsigned producer, const char *section,
+			const char *key, const char *value)
+{
+	if (!builder || !key || !value) return 0;
+
+	if (producer >= builder->producers) {
+		cparse_set_error(NULL, "No producer %u in this builder", producer);
+		return 0;
+	}
+
+	BuildStage *stage = builder->stages[producer];
+	if (!stage) {
+		stage = stage_new(builder->flags);
+		if (!stage) {
+			cparse_set_error(NULL, "Failed to allocate memory");
+			return 0;
+		}
+		builder->stages[producer] = stage;
+	}
+
+	if (!section) section = "";
+
+	ConfigSection *cs = stage_section(stage, section);
+	if (!cs) {
+		cparse_set_error(NULL, "Failed to add section: %s", section);
+		return 0;
+	}
+
+	stage->config->current_section = cs;
+	if (!config_add_entry(stage->config, key, value)) {
+		cparse_set_error(NULL, "Failed to add configuration entry");
+		return 0;
+	}
+
+	return 1;
+}
+
+// ==================== Freeze ====================
+
+/**
+ * Worker: group the sections of one shard by name across stages. The
+ * entries of later sections of a name are appended to the first, in
+ * producer order.
+ */
+static void freeze_shard_worker(void *arg, size_t index)
+{
+	BuildFreeze *fz = arg;
+	const ConfigBuilder *builder = fz->builder;
+	BuildShard *shard = &fz->shards[index];
+
+	size_t total = 0;
+	for (unsigned p = 0; p < builder->producers; p++) {
+		if (builder->stages[p]) total += builder->stages[p]->shard_count[index];
+	}
+	if (total == 0) return;
+
+	size_t size = 16;
+	while (size < total * 2) size *= 2;
+
+	/* Group of each slot, SIZE_MAX when free */
+	size_t *slots = malloc(size * sizeof(size_t));
+	shard->groups = malloc(total * sizeof(BuildGroup));
+	if (!slots || !shard->groups) {
+		free(slots);
+		shard->failed = 1;
+		return;
+	}
+	memset(slots, 0xff, size * sizeof(size_t));
+
+	for (unsigned p = 0; p < builder->producers; p++) {
+		const BuildStage *stage = builder->stages[p];
+		if (!stage) continue;
+
+		for (size_t r = 0; r < stage->shard_count[index]; r++) {
+			const BuildRef *ref = &stage->shards[index][r];
+			ConfigSection *cs = ref->section;
+
+			size_t i = cs->name_hash & (size - 1);
+			for (; slots[i] != SIZE_MAX; i = (i + 1) & (size - 1)) {
+				const ConfigSection *first = shard->groups[slots[i]].section;
+				if (first->name_hash == cs->name_hash &&
+				    config_name_equal(stage->config, first->name, cs->name)) {
+					break;
+				}
+			}
+
+			if (slots[i] == SIZE_MAX) {
+				slots[i] = shard->count;
+				shard->groups[shard->count++] = (BuildGroup){ cs, p, ref->pos };
+				continue;
+			}
+
+			ConfigSection *first = shard->groups[slots[i]].section;
+			cparse_fp_splice(&shard->fingerprint, first, cs);
+			if (cs->entries) {
+				if (first->entries) {
+					first->last_entry->next = cs->entries;
+				} else {
+					first->entries = cs->entries;
+				}
+				first->last_entry = cs->last_entry;
+				cs->entries = NULL;
+				cs->last_entry = NULL;
+			}
+			cs->flags |= SECTION_MERGED;
+		}
+	}
+
+	free(slots);
+}
+
+/**
+ * qsort() comparator, the default section first, then the order in
+ * which names were first added
+ */
+static int freeze_compare(const void *a, const void *b)
+{
+	const BuildGroup *ga = a, *gb = b;
+
+	int named_a = ga->section->name[0] != '\0';
+	int named_b = gb->section->name[0] != '\0';
+	if (named_a != named_b) return named_a - named_b;
+
+	if (ga->producer != gb->producer) return ga->producer < gb->producer ? -1 : 1;
+	return ga->pos < gb->pos ? -1 : ga->pos > gb->pos;
+}
+
+/**
+ * Move the arena, entry count and entry terms of the fingerprint of
+ * STAGE to CONFIG and free the sections whose entries were merged
+ * elsewhere. Section terms are added once the order is known.
+ */
+static void freeze_stage(Config *config, BuildStage *stage)
+{
+	Config *staged = stage->config;
+
+	cparse_fp_apply(config, staged->fingerprint, 1);
+
+	ConfigSection *cs = staged->sections;
+	if (cs) cparse_fp_section(&config->fingerprint, NULL, cs, -1);
+	while (cs) {
+		ConfigSection *next = cs->next;
+		if (next) cparse_fp_section(&config->fingerprint, cs, next, -1);
+		cs->next = NULL;
+		if (cs->flags & SECTION_MERGED) {
+			free(cs->name);
+			free(cs);
+		}
+		cs = next;
+	}
+	staged->sections = NULL;
+	staged->last_section = NULL;
+	staged->current_section = NULL;
+
+	/* Chunks move as a whole, entries stay where they are */
+	if (staged->arena) {
+		ConfigChunk *tail = staged->arena;
+		while (tail->next) tail = tail->next;
+		tail->next = config->arena;
+		config->arena = staged->arena;
+		staged->arena = NULL;
+	}
+
+	config->entry_count += staged->entry_count;
+	staged->entry_count = 0;
+	staged->section_count = 0;
+}
+
+/**
+ * Turn everything added so far into one configuration and empty the
+ * builder. Sections come in the order their names were first added,
+ * by the lowest numbered producer, and a section's entries in producer
+ * order and then in the order each producer added them; the result
+ * does not depend on thread timing. Nothing is copied, the sections
+ * and arenas of the stages are linked into the configuration. Shards
+ * of section names are grouped in parallel. Repeated keys are kept,
+ * reads find the first one as in a parsed file. After a failure the
+ * builder can only be freed.
+ */
+Config *cparse_builder_freeze(ConfigBuilder *builder)
+{
+	if (!builder) return NULL;
+
+	BuildShard *shards = calloc(BUILD_SHARDS, sizeof(BuildShard));
+	Config *config = calloc(1, sizeof(Config));
+	if (!shards || !config) {
+		free(shards);
+		free(config);
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		return NULL;
+	}
+	config->flags = builder->flags;
+
+	BuildFreeze fz = { builder, shards };
+	cparse_pool_run(BUILD_SHARDS, BUILD_MAX_THREADS, freeze_shard_worker, &fz);
+
+	size_t count = 0;
+	int failed = 0;
+	for (size_t s = 0; s < BUILD_SHARDS; s++) {
+		count += shards[s].count;
+		failed |= shards[s].failed;
+	}
+
+	BuildGroup *groups = failed ? NULL : malloc((count ? count : 1) * sizeof(BuildGroup));
+	if (groups) {
+		count = 0;
+		for (size_t s = 0; s < BUILD_SHARDS; s++) {
+			if (shards[s].count == 0) continue;
+			memcpy(groups + count, shards[s].groups, shards[s].count * sizeof(BuildGroup));
+			count += shards[s].count;
+		}
+	}
+
+	for (size_t s = 0; s < BUILD_SHARDS; s++) {
+		cparse_fp_apply(config, shards[s].fingerprint, 1);
+	}
+
+	for (size_t s = 0; s < BUILD_SHARDS; s++) {
+		free(shards[s].groups);
+	}
+	free(shards);
+
+	if (!groups) {
+		free(config);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	qsort(groups, count, sizeof(BuildGroup), freeze_compare);
+
+	int interp = 0;
+	for (unsigned p = 0; p < builder->producers; p++) {
+		BuildStage *stage = builder->stages[p];
+		if (!stage) continue;
+
+		interp |= stage->config->interp != NULL;
+		freeze_stage(config, stage);
+		stage_free(stage);
+		builder->stages[p] = NULL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		ConfigSection *cs = groups[i].section;
+		cparse_fp_section(&config->fingerprint, config->last_section, cs, 1);
+		if (!config->sections) {
+			config->sections = cs;
+		} else {
+			config->last_section->next = cs;
+		}
+		config->last_section = cs;
+	}
+	config->section_count = count;
+	config->current_section = config->last_section;
+	free(groups);
+
+	/* Expansions are memoized per config */
+	if (interp && !cparse_interp_init(config)) {
+		cparse_free(config);
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		return NULL;
+	}
+
+	return config;
+}
+
+/**
+ * Free BUILDER and everything not frozen
+ */
+void cparse_builder_free(ConfigBuilder *builder)
+{
+	if (!builder) return;
+
+	for (unsigned p = 0; p < builder->producers; p++) {
+		stage_free(builder->stages[p]);
+	}
+	free(builder->stages);
+	free(builder);
+}
@@ -0,0 +1,466 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+#define CACHE_MIN_BUCKETS 16
+
+/* One parsed file. The cache holds a reference while the node is in
+ * it, and every open one more. */
+struct ConfigCacheNode
+{
+	ConfigCacheNode *chain;   /* Next in the bucket, or to free */
+	ConfigCacheNode *prev;    /* LRU list, most recently used first */
+	ConfigCacheNode *next;
+	char *path;
+	uint32_t hash;
+	unsigned flags;           /* XC_* parse flags, part of the key */
+	dev_t dev;                /* The file as it was parsed */
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	Config *config;
+	char *content;            /* Source of a CONFIG_LAZY config */
+	size_t bytes;             /* Charged to the budget */
+	size_t refs;
+	int cached;               /* Linked in the table and the LRU list */
+};
+
+/* Process-wide state, every field under LOCK */
+static struct
+{
+	pthread_mutex_t lock;
+	ConfigCacheNode **buckets;
+	size_t bucket_count;      /* Power of two */
+	size_t count;
+	ConfigCacheNode *head;    /* Most recently used */
+	ConfigCacheNode *tail;
+	size_t bytes;
+	size_t budget;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, NULL, 0, CACHE_DEFAULT_BUDGET, 0, 0, 0 };
+
+// ==================== Table ====================
+
+/**
+ * Hash of a key: the path and the flags it was parsed with
+ */
+static uint32_t cache_hash(const char *path, unsigned flags)
+{
+	return cparse_fold_hash(path, strlen(path)) ^ (flags * 0x9e3779b1u);
+}
+
+/**
+ * Node of PATH parsed with FLAGS, NULL if none is cached
+ */
+static ConfigCacheNode *cache_find(const char *path, uint32_t hash, unsigned flags)
+{
+	if (!cache.buckets) return NULL;
+
+	for (ConfigCacheNode *node = cache.buckets[hash & (cache.bucket_count - 1)]; node;
+	     node = node->chain) {
+		if (node->hash == hash && node->flags == flags && strcmp(node->path, path) == 0) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Check that the file SB describes is the one NODE was parsed from:
+ * same inode, size and modification time
+ */
+static int cache_same_file(const ConfigCacheNode *node, const struct stat *sb)
+{
+	return node->dev == sb->st_dev && node->ino == sb->st_ino && node->size == sb->st_size &&
+		node->mtime.tv_sec == sb->st_mtim.tv_sec && node->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+/**
+ * Make NODE the most recently used
+ */
+static void cache_touch(ConfigCacheNode *node)
+{
+	if (cache.head == node) return;
+
+	/* Not the head, so it has a predecessor */
+	node->prev->next = node->next;
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		cache.tail = node->prev;
+	}
+
+	node->prev = NULL;
+	node->next = cache.head;
+	cache.head->prev = node;
+	cache.head = node;
+}
+
+/**
+ * Double the buckets once there are as many nodes. Chains only get
+ * longer if that fails.
+ */
+static int cache_grow(void)
+{
+	if (cache.count < cache.bucket_count) return 1;
+
+	size_t size = cache.bucket_count ? cache.bucket_count * 2 : CACHE_MIN_BUCKETS;
+	ConfigCacheNode **buckets = calloc(size, sizeof(ConfigCacheNode *));
+	if (!buckets) return cache.buckets != NULL;
+
+	for (size_t i = 0; i < cache.bucket_count; i++) {
+		ConfigCacheNode *node = cache.buckets[i];
+		while (node) {
+			ConfigCacheNode *next = node->chain;
+			node->chain = buckets[node->hash & (size - 1)];
+			buckets[node->hash & (size - 1)] = node;
+			node = next;
+		}
+	}
+
+	free(cache.buckets);
+	cache.buckets = buckets;
+	cache.bucket_count = size;
+	return 1;
+}
+
+/**
+ * Add NODE to the table as the most recently used
+ */
+static int cache_link(ConfigCacheNode *node)
+{
+	if (!cache_grow()) return 0;
+
+	ConfigCacheNode **bucket = &cache.buckets[node->hash & (cache.bucket_count - 1)];
+	node->chain = *bucket;
+	*bucket = node;
+
+	node->prev = NULL;
+	node->next = cache.head;
+	if (cache.head) {
+		cache.head->prev = node;
+	} else {
+		cache.tail = node;
+	}
+	cache.head = node;
+
+	node->cached = 1;
+	cache.count++;
+	cache.bytes += node->bytes;
+	return 1;
+}
+
+/**
+ * Take NODE out of the table and drop the cache's reference. Returns
+ * GARBAGE with NODE in front if that was the last one, for the caller
+ * to free once the lock is released.
+ */
+static ConfigCacheNode *cache_unlink(ConfigCacheNode *node, ConfigCacheNode *garbage)
+{
+	ConfigCacheNode **link = &cache.buckets[node->hash & (cache.bucket_count - 1)];
+	while (*link != node) link = &(*link)->chain;
+	*link = node->chain;
+
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		cache.head = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		cache.tail = node->prev;
+	}
+
+	node->cached = 0;
+	node->prev = node->next = NULL;
+	cache.count--;
+	cache.bytes -= node->bytes;
+
+	if (--node->refs > 0) return garbage;
+	node->chain = garbage;
+	return node;
+}
+
+/**
+ * Evict the least recently used files until the cache fits in its
+ * budget, never KEEP. Returns GARBAGE with the nodes to free added.
+ */
+static ConfigCacheNode *cache_evict(const ConfigCacheNode *keep, ConfigCacheNode *garbage)
+{
+	while (cache.bytes > cache.budget && cache.tail && cache.tail != keep) {
+		garbage = cache_unlink(cache.tail, garbage);
+		cache.evictions++;
+	}
+
+	return garbage;
+}
+
+// ==================== Nodes ====================
+
+/**
+ * Free NODE and its config
+ */
+static void cache_node_free(ConfigCacheNode *node)
+{
+	node->config->cache = NULL;
+	cparse_free(node->config);
+	free(node->content);
+	free(node->path);
+	free(node);
+}
+
+/**
+ * Free the nodes chained from GARBAGE
+ */
+static void cache_free_all(ConfigCacheNode *garbage)
+{
+	while (garbage) {
+		ConfigCacheNode *next = garbage->chain;
+		cache_node_free(garbage);
+		garbage = next;
+	}
+}
+
+/**
+ * Memory of CONFIG as charged to the budget: its arena, sections and
+ * kept source. Lazy sections are charged as parsed when cached.
+ */
+static size_t cache_size(const Config *config, size_t content)
+{
+	size_t bytes = sizeof(Config) + sizeof(ConfigCacheNode) + content;
+
+	for (const ConfigChunk *chunk = config->arena; chunk; chunk = chunk->next) {
+		bytes += sizeof(ConfigChunk) + chunk->size;
+	}
+	for (const ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		bytes += sizeof(ConfigSection) + cs->name_size;
+	}
+
+	return bytes;
+}
+
+/**
+ * Read and parse PATH into a new node, not linked yet. The file is
+ * described by the descriptor that was read, so a file replaced
+ * meanwhile is cached as what was parsed.
+ */
+static ConfigCacheNode *cache_parse(const char *path, uint32_t hash, unsigned flags)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		cparse_set_error(NULL, "Cannot open '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat sb;
+	size_t length = 0;
+	char *content = fstat(fd, &sb) == 0 ? cparse_read_fd(fd, &length) : NULL;
+	close(fd);
+	if (!content) {
+		cparse_set_error(NULL, "Cannot read '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	CPState st;
+	memset(&st, 0, sizeof(CPState));
+	cparse_set_error(NULL, "%s", "");
+	st.type = P_STR;
+	st.str = content;
+	st.len = length;
+	st.path = path; /* Includes are relative to this file */
+	st.flags = flags;
+
+	Config *config = cparse_load(&st);
+	if (!config) {
+		free(content);
+		return NULL;
+	}
+
+	/* A lazy config parses its sections from the source later */
+	if (!(flags & CONFIG_LAZY)) {
+		free(content);
+		content = NULL;
+		length = 0;
+	}
+
+	ConfigCacheNode *node = calloc(1, sizeof(ConfigCacheNode));
+	char *copy = strdup(path);
+	if (!node || !copy) {
+		free(node);
+		free(copy);
+		cparse_free(config);
+		free(content);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	node->path = copy;
+	node->hash = hash;
+	node->flags = flags;
+	node->dev = sb.st_dev;
+	node->ino = sb.st_ino;
+	node->size = sb.st_size;
+	node->mtime = sb.st_mtim;
+	node->config = config;
+	node->content = content;
+	node->bytes = cache_size(config, length);
+	config->cache = node;
+
+	return node;
+}
+
+// ==================== Opening ====================
+
+/**
+ * Config of the file at PATH parsed with FLAGS, shared by every open
+ * of the same file while its inode, size and modification time stay
+ * the same: such an open costs one stat() and no parse. A changed
+ * file is parsed again and replaces the cached one; configs already
+ * open keep the old contents. Included files are not checked.
+ * Parsing happens outside of the lock, so two threads missing the
+ * same file at once may both parse it and one copy is kept. Configs
+ * are read-only, XC_PRESERVE is ignored. Release with
+ * cparse_cache_release().
+ */
+Config *cparse_cache_open(const char *path, unsigned flags)
+{
+	if (!path) {
+		cparse_set_error(NULL, "Invalid arguments");
+		return NULL;
+	}
+
+	/* Shared configs are never saved */
+	flags &= ~CONFIG_PRESERVE;
+
+	struct stat sb;
+	if (stat(path, &sb) < 0) {
+		cparse_set_error(NULL, "Cannot open '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	uint32_t hash = cache_hash(path, flags);
+
+	pthread_mutex_lock(&cache.lock);
+	ConfigCacheNode *node = cache_find(path, hash, flags);
+	if (node && cache_same_file(node, &sb)) {
+		node->refs++;
+		cache.hits++;
+		cache_touch(node);
+		pthread_mutex_unlock(&cache.lock);
+		return node->config;
+	}
+	cache.misses++;
+	pthread_mutex_unlock(&cache.lock);
+
+	node = cache_parse(path, hash, flags);
+	if (!node) return NULL;
+
+	pthread_mutex_lock(&cache.lock);
+
+	/* Another thread may have parsed the same file meanwhile */
+	ConfigCacheNode *old = cache_find(path, hash, flags);
+	if (old && old->dev == node->dev && old->ino == node->ino && old->size == node->size &&
+	    old->mtime.tv_sec == node->mtime.tv_sec && old->mtime.tv_nsec == node->mtime.tv_nsec) {
+		old->refs++;
+		cache_touch(old);
+		pthread_mutex_unlock(&cache.lock);
+
+		cache_node_free(node);
+		return old->config;
+	}
+
+	ConfigCacheNode *garbage = old ? cache_unlink(old, NULL) : NULL;
+
+	/* A file larger than the whole budget is parsed but not kept */
+	node->refs = 1;
+	if (node->bytes <= cache.budget && cache_link(node)) {
+		node->refs++;
+		garbage = cache_evict(node, garbage);
+	}
+
+	pthread_mutex_unlock(&cache.lock);
+
+	cache_free_all(garbage);
+	return node->config;
+}
+
+/**
+ * Drop a reference to CONFIG taken by cparse_cache_open(). A config
+ * that is no longer cached is freed with its last reference.
+ */
+void cparse_cache_release(Config *config)
+{
+	ConfigCacheNode *node = config ? config->cache : NULL;
+	if (!node) {
+		cparse_free(config);
+		return;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+	int last = --node->refs == 0;
+	pthread_mutex_unlock(&cache.lock);
+
+	if (last) {
+		cache_node_free(node);
+	}
+}
+
+// ==================== Control ====================
+
+/**
+ * Limit the memory of cached files to BYTES, evicting the least
+ * recently used now if they take more. 0 turns caching off.
+ */
+void cparse_cache_set_budget(size_t bytes)
+{
+	pthread_mutex_lock(&cache.lock);
+	cache.budget = bytes;
+	ConfigCacheNode *garbage = cache_evict(NULL, NULL);
+	pthread_mutex_unlock(&cache.lock);
+
+	cache_free_all(garbage);
+}
+
+/**
+ * Counters and size of the cache
+ */
+void cparse_cache_stats(XConfigCacheStats *stats)
+{
+	if (!stats) return;
+
+	pthread_mutex_lock(&cache.lock);
+	stats->hits = cache.hits;
+	stats->misses = cache.misses;
+	stats->evictions = cache.evictions;
+	stats->entries = cache.count;
+	stats->bytes = cache.bytes;
+	stats->budget = cache.budget;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Drop every cached file. Configs still open stay valid and are freed
+ * when released. Counters are kept.
+ */
+void cparse_cache_clear(void)
+{
+	ConfigCacheNode *garbage = NULL;
+
+	pthread_mutex_lock(&cache.lock);
+	while (cache.head) {
+		garbage = cache_unlink(cache.head, garbage);
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	cache_free_all(garbage);
+}
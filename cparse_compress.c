@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(XCONFIG_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(XCONFIG_ZSTD)
+#include <zstd.h>
+#endif
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* Input of a decompressor: bytes already read, then the descriptor */
+typedef struct
+{
+	int fd;
+	const char *head;
+	size_t head_len;
+	char *chunk;
+} CompressInput;
+
+// ==================== Detection ====================
+
+/**
+ * Compression of data starting with the LEN bytes of HEAD, COMPRESS_*
+ */
+int cparse_compression(const void *head, size_t len)
+{
+	const unsigned char *p = head;
+
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) return COMPRESS_GZIP;
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+		return COMPRESS_ZSTD;
+	}
+
+	return COMPRESS_NONE;
+}
+
+/**
+ * Compression of the file open as FD, told by its first bytes. The
+ * file offset does not move.
+ */
+int cparse_fd_compression(int fd)
+{
+	unsigned char magic[COMPRESS_MAGIC_SIZE];
+
+	ssize_t n = pread(fd, magic, sizeof(magic), 0);
+	return n > 0 ? cparse_compression(magic, n) : COMPRESS_NONE;
+}
+
+#if defined(XCONFIG_ZLIB) || defined(XCONFIG_ZSTD)
+/**
+ * Next block of compressed input, the head first. Returns its length,
+ * 0 at end of file, -1 on error.
+ */
+static ssize_t compress_read(CompressInput *in, const char **data)
+{
+	if (in->head_len) {
+		ssize_t n = in->head_len;
+		*data = in->head;
+		in->head_len = 0;
+		return n;
+	}
+
+	for (;;) {
+		ssize_t n = read(in->fd, in->chunk, READ_CHUNK_SIZE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			cparse_set_error(NULL, "Read failed: %s", strerror(errno));
+		}
+		*data = in->chunk;
+		return n;
+	}
+}
+#endif
+
+// ==================== gzip ====================
+
+#if defined(XCONFIG_ZLIB)
+/**
+ * Inflate gzip members from IN, passing each block of output to FN
+ */
+static int compress_gzip(CompressInput *in, char *out, CPBlockFn fn, void *user)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(z_stream));
+
+	/* 16: gzip wrapper, not zlib */
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	int ok = 1, done = 0, ended = 0;
+	while (ok && !done) {
+		const char *data;
+		ssize_t n = compress_read(in, &data);
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+
+		zs.next_in = (Bytef *)data;
+		zs.avail_in = n;
+
+		for (;;) {
+			/* Concatenated members, as gzip -c a b > c writes */
+			if (ended) {
+				if (zs.avail_in == 0) break;
+				inflateReset(&zs);
+				ended = 0;
+			}
+
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = READ_CHUNK_SIZE;
+
+			int ret = inflate(&zs, Z_NO_FLUSH);
+			if (ret == Z_BUF_ERROR && zs.avail_in == 0) break;
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				cparse_set_error(NULL, "Corrupt gzip data: %s", zs.msg ? zs.msg : "inflate failed");
+				ok = 0;
+				break;
+			}
+			ended = ret == Z_STREAM_END;
+
+			size_t len = READ_CHUNK_SIZE - zs.avail_out;
+			if (len > 0 && !fn(user, out, len)) {
+				done = 1;
+				break;
+			}
+
+			/* Input used up and nothing left to flush */
+			if (zs.avail_in == 0 && zs.avail_out > 0 && !ended) break;
+		}
+	}
+
+	if (ok && !done && !ended) {
+		cparse_set_error(NULL, "Truncated gzip data");
+		ok = 0;
+	}
+
+	inflateEnd(&zs);
+	return ok;
+}
+#endif
+
+// ==================== zstd ====================
+
+#if defined(XCONFIG_ZSTD)
+/**
+ * Decompress zstd frames from IN, passing each block of output to FN
+ */
+static int compress_zstd(CompressInput *in, char *out, CPBlockFn fn, void *user)
+{
+	ZSTD_DStream *zs = ZSTD_createDStream();
+	if (!zs) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	int ok = 1, done = 0;
+	size_t last = 0;  /* 0 once a frame is complete */
+	while (ok && !done) {
+		const char *data;
+		ssize_t n = compress_read(in, &data);
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+
+		ZSTD_inBuffer input = { data, (size_t)n, 0 };
+		for (;;) {
+			ZSTD_outBuffer output = { out, READ_CHUNK_SIZE, 0 };
+
+			last = ZSTD_decompressStream(zs, &output, &input);
+			if (ZSTD_isError(last)) {
+				cparse_set_error(NULL, "Corrupt zstd data: %s", ZSTD_getErrorName(last));
+				ok = 0;
+				break;
+			}
+
+			if (output.pos > 0 && !fn(user, out, output.pos)) {
+				done = 1;
+				break;
+			}
+
+			/* A full block may leave output in the decoder */
+			if (input.pos == input.size && output.pos < output.size) break;
+		}
+	}
+
+	if (ok && !done && last != 0) {
+		cparse_set_error(NULL, "Truncated zstd data");
+		ok = 0;
+	}
+
+	ZSTD_freeDStream(zs);
+	return ok;
+}
+#endif
+
+// ==================== Streaming ====================
+
+/**
+ * Decompress data of KIND (COMPRESS_*): the LEN bytes of HEAD already
+ * read, then the rest of FD. Output is passed to FN one block of at
+ * most READ_CHUNK_SIZE bytes at a time, so memory does not grow with
+ * the data. FN returning 0 stops without an error. Returns 0 on error,
+ * also when support for KIND is not compiled in.
+ */
+int cparse_decompress(int fd, const void *head, size_t len, int kind, CPBlockFn fn, void *user)
+{
+	int (*run)(CompressInput *, char *, CPBlockFn, void *) = NULL;
+#if defined(XCONFIG_ZLIB)
+	if (kind == COMPRESS_GZIP) run = compress_gzip;
+#endif
+#if defined(XCONFIG_ZSTD)
+	if (kind == COMPRESS_ZSTD) run = compress_zstd;
+#endif
+
+	if (!run) {
+		const char *name = kind == COMPRESS_GZIP ? "gzip" : kind == COMPRESS_ZSTD ? "zstd" : NULL;
+		if (name) {
+			cparse_set_error(NULL, "Input is %s compressed, but %s support is not compiled in",
+					name, name);
+		} else {
+			cparse_set_error(NULL, "Unknown compression: %d", kind);
+		}
+		return 0;
+	}
+
+	CompressInput in = { fd, head, len, malloc(READ_CHUNK_SIZE) };
+	char *out = malloc(READ_CHUNK_SIZE);
+
+	int ok = 0;
+	if (in.chunk && out) {
+		ok = run(&in, out, fn, user);
+	} else {
+		cparse_set_error(NULL, "Failed to allocate memory");
+	}
+
+	free(in.chunk);
+	free(out);
+	return ok;
+}
+
+/* Output of cparse_decompress_all() */
+typedef struct
+{
+	CPBuf buf;
+	int failed;
+} CompressBuffer;
+
+/**
+ * Append a block of output to the buffer
+ */
+static int compress_append(void *user, const char *data, size_t len)
+{
+	CompressBuffer *cb = user;
+
+	if (!cparse_buf_append(&cb->buf, data, len)) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		cb->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Decompress the rest of FD, see cparse_decompress(), into one
+ * NUL-terminated buffer
+ */
+char *cparse_decompress_all(int fd, const void *head, size_t len, int kind, size_t *length)
+{
+	CompressBuffer cb;
+	memset(&cb, 0, sizeof(CompressBuffer));
+
+	if (!cparse_decompress(fd, head, len, kind, compress_append, &cb) || cb.failed) {
+		free(cb.buf.data);
+		return NULL;
+	}
+
+	if (!cb.buf.data && !(cb.buf.data = calloc(1, 1))) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	if (length) *length = cb.buf.len;
+	return cb.buf.data;
+}
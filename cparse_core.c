@@ -4,11 +4,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #define _XCONFIG_H
 #include "cparse_core.h"
 
-static char glb_err_buf[MAX_ERRBUF];
+/* Per-thread, so worker threads never clobber the caller's error */
+static __thread char glb_err_buf[MAX_ERRBUF];
+static __thread size_t glb_diag_limit = DIAG_DEFAULT_LIMIT;
 
 // ==================== Utility Functions ====================
 
@@ -49,31 +57,122 @@ static char *dynamic_strndup(const char *str, size_t len)
 	return new_str;
 }
 
+// ==================== Case Folding ====================
+
 /**
- * Dynamic string concatenation with automatic buffer growth
+ * ASCII lower case of CH, other bytes are kept
  */
-static int dynamic_strcat(char **dest, size_t *dest_size, const char *src)
+static inline unsigned char fold_char(unsigned char ch)
 {
-	if (!dest || !src) return 0;
-	
-	size_t src_len = strlen(src);
-	size_t dest_len = *dest ? strlen(*dest) : 0;
-	size_t needed_size = dest_len + src_len + 1;
-	
-	if (needed_size > *dest_size) {
-		size_t new_size = needed_size * BUFFER_GROWTH_FACTOR;
-		char *new_dest = realloc(*dest, new_size);
-		if (!new_dest) {
-			return 0;
+	return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
+
+#if defined(__SSE2__)
+/**
+ * Fold 16 bytes at once. Bytes >= 0x80 are negative as signed chars,
+ * so they never fall in 'A'..'Z'.
+ */
+static inline __m128i fold_block(__m128i v)
+{
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+				_mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+#endif
+
+/**
+ * Copy LEN bytes of SRC to DST in ASCII lower case
+ */
+void cparse_fold(char *dst, const char *src, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), fold_block(v));
+	}
+#endif
+
+	for (; i < len; i++) {
+		dst[i] = fold_char(src[i]);
+	}
+}
+
+/**
+ * FNV-1a hash of the folded STR, without allocating
+ */
+uint32_t cparse_fold_hash(const char *str, size_t len)
+{
+	char block[64];
+	uint32_t h = 2166136261u;
+
+	for (size_t off = 0; off < len; off += sizeof(block)) {
+		size_t n = len - off < sizeof(block) ? len - off : sizeof(block);
+		cparse_fold(block, str + off, n);
+		for (size_t i = 0; i < n; i++) {
+			h ^= (unsigned char)block[i];
+			h *= 16777619u;
 		}
-		*dest = new_dest;
-		*dest_size = new_size;
 	}
-	
-	strcat(*dest + dest_len, src);
+
+	return h;
+}
+
+/**
+ * Compare LEN bytes of A and B ignoring ASCII case
+ */
+int cparse_fold_equal(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = fold_block(_mm_loadu_si128((const __m128i *)(a + i)));
+		__m128i y = fold_block(_mm_loadu_si128((const __m128i *)(b + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) return 0;
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (fold_char(a[i]) != fold_char(b[i])) return 0;
+	}
+
 	return 1;
 }
 
+/**
+ * Compare section names, ignoring ASCII case with CONFIG_ICASE
+ */
+int config_name_equal(const Config *config, const char *a, const char *b)
+{
+	if (!(config->flags & CONFIG_ICASE)) {
+		return strcmp(a, b) == 0;
+	}
+
+	size_t len = strlen(a);
+	return strlen(b) == len && cparse_fold_equal(a, b, len);
+}
+
+/**
+ * Compare at most N bytes of keys in scan order, strncmp() style.
+ * With CONFIG_ICASE both are compared folded.
+ */
+int config_key_compare(const Config *config, const char *a, const char *b, size_t n)
+{
+	if (!(config->flags & CONFIG_ICASE)) {
+		return strncmp(a, b, n);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		unsigned char x = fold_char(a[i]), y = fold_char(b[i]);
+		if (x != y) return x < y ? -1 : 1;
+		if (!x) break;
+	}
+
+	return 0;
+}
+
 // ==================== Configuration Management ====================
 
 /**
@@ -95,734 +194,2066 @@ ConfigSection *config_add_section(Config *config, const char *name)
 		return NULL;
 	}
 	
-	ConfigSection *section = malloc(sizeof(ConfigSection));
-	if (!section) {
-		return NULL;
-	}
-	
-	memset(section, 0, sizeof(ConfigSection));
-	section->name = dynamic_strdup(name);
-	if (!section->name) {
-		free(section);
-		return NULL;
+	size_t len = strlen(name);
+	ConfigSection *section = config->spare_sections;
+	if (section) {
+		/* Left by cparse_reset(), with its name buffer and key table */
+		config->spare_sections = section->next;
+		cparse_index_clear(config, section);
+
+		char *buf = section->name;
+		size_t size = section->name_size;
+		ConfigKeyTable *keys = section->keys;
+		if (len >= size) {
+			char *grown = realloc(buf, len + 1);
+			if (!grown) {
+				free(buf);
+				free(keys);
+				free(section);
+				return NULL;
+			}
+			buf = grown;
+			size = len + 1;
+		}
+
+		memset(section, 0, sizeof(ConfigSection));
+		memcpy(buf, name, len + 1);
+		section->name = buf;
+		section->name_size = size;
+		section->keys = keys;
+	} else {
+		section = malloc(sizeof(ConfigSection));
+		if (!section) {
+			return NULL;
+		}
+
+		memset(section, 0, sizeof(ConfigSection));
+		section->name = dynamic_strndup(name, len);
+		if (!section->name) {
+			free(section);
+			return NULL;
+		}
+		section->name_size = len + 1;
 	}
+	section->name_hash = cparse_fold_hash(name, len);
+	cparse_fp_name(section);
+	cparse_fp_section(&config->fingerprint, config->last_section, section, 1);
 	
-	/* Add to linked list */
+	/* Add to linked list, files may have thousands of sections */
 	if (!config->sections) {
 		config->sections = section;
 	} else {
-		ConfigSection *last = config->sections;
-		while (last->next) {
-			last = last->next;
-		}
-		last->next = section;
+		config->last_section->next = section;
 	}
+	config->last_section = section;
 	
 	config->current_section = section;
 	config->section_count++;
+	cparse_index_section_added(config, section);
 	
 	return section;
 }
 
+/**
+ * Allocate SIZE bytes (8-byte aligned) from the config's arena.
+ * Chunks grow geometrically, large blocks get a chunk of their own.
+ */
+static void *config_alloc(Config *config, size_t size)
+{
+	size = (size + 7) & ~(size_t)7;
+
+	ConfigChunk *head = config->arena;
+	if (head && head->used + size <= head->size) {
+		void *ptr = head->data + head->used;
+		head->used += size;
+		return ptr;
+	}
+
+	size_t chunk_size = head ? head->size * BUFFER_GROWTH_FACTOR : ARENA_MIN_CHUNK;
+	if (chunk_size > ARENA_MAX_CHUNK) chunk_size = ARENA_MAX_CHUNK;
+
+	int dedicated = size > chunk_size / 4;
+	if (dedicated) chunk_size = size;
+
+	ConfigChunk *chunk = malloc(sizeof(ConfigChunk) + chunk_size);
+	if (!chunk) {
+		return NULL;
+	}
+	chunk->size = chunk_size;
+	chunk->used = size;
+
+	/* Keep a partly used head for later small allocations */
+	if (dedicated && head) {
+		chunk->next = head->next;
+		head->next = chunk;
+	} else {
+		chunk->next = head;
+		config->arena = chunk;
+	}
+
+	return chunk->data;
+}
+
+/**
+ * Copy LEN bytes of STR into the arena, NUL-terminated
+ */
+static char *config_strdup(Config *config, const char *str, size_t len)
+{
+	char *copy = config_alloc(config, len + 1);
+	if (copy) {
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
 /**
  * Add key-value pair to current section
  */
 int config_add_entry(Config *config, const char *key, const char *value)
+{
+	return config_add_entry_len(config, key, value, value ? strlen(value) : 0);
+}
+
+/**
+ * Add KEY and the VALUE_LEN bytes of VALUE to current section. VALUE
+ * may hold NULs, it is stored with its length and a NUL after it.
+ */
+int config_add_entry_len(Config *config, const char *key, const char *value, size_t value_len)
+{
+	if (!key) return 0;
+
+	return config_add_entry_at(config, key, strlen(key), value, value_len, NULL, 0, NULL);
+}
+
+/**
+ * Add key-value pair to current section. SPAN, if any, is stored
+ * right after the node, so configs parsed without CONFIG_PRESERVE
+ * do not pay for it. So is a non-zero LINE, with CONFIG_LINES.
+ * A value with DECODED, its decoded bytes, is kept as is and decoded
+ * again by its first read: DECODED is only hashed.
+ */
+int config_add_entry_at(Config *config, const char *key, size_t key_len,
+			const char *value, size_t value_len,
+			const ConfigSpan *span, int line, const CPBuf *decoded)
 {
 	if (!config || !key || !value || !config->current_section) {
 		return 0;
 	}
-	
-	ConfigEntry *entry = malloc(sizeof(ConfigEntry));
+
+	/* '\$\{' decodes to a reference, so values to expand are stored decoded */
+	if (decoded && (config->flags & CONFIG_INTERPOLATE) && memchr(value, '$', value_len)) {
+		return config_add_entry_at(config, key, key_len, decoded->data ? decoded->data : "",
+					decoded->len, span, line, NULL);
+	}
+
+	if (key_len > ENTRY_MAX_KEY || value_len > UINT32_MAX) {
+		return 0;
+	}
+
+	int refs = (config->flags & CONFIG_INTERPOLATE) && cparse_find_ref(value, value_len);
+	if (refs && !cparse_interp_init(config)) {
+		return 0;
+	}
+
+	size_t span_size = span ? sizeof(ConfigSpan) : 0;
+	int icase = config->flags & CONFIG_ICASE;
+	int lines = (config->flags & CONFIG_LINES) && line > 0;
+
+	ConfigEntry *entry = config_alloc(config, sizeof(ConfigEntry) + span_size +
+					(icase ? sizeof(uint32_t) : 0) +
+					(lines ? sizeof(uint32_t) : 0));
 	if (!entry) {
 		return 0;
 	}
-	
+
 	memset(entry, 0, sizeof(ConfigEntry));
-	
-	entry->key = dynamic_strdup(key);
-	entry->value = dynamic_strdup(value);
-	
-	if (!entry->key || !entry->value) {
-		if (entry->key) free(entry->key);
-		if (entry->value) free(entry->value);
-		free(entry);
-		return 0;
+	if (span) {
+		memcpy(entry + 1, span, sizeof(ConfigSpan));
+		entry->flags |= ENTRY_SPAN;
 	}
-	
-	/* Add to linked list */
-	if (!config->current_section->entries) {
-		config->current_section->entries = entry;
+	if (icase) {
+		/* Folded once here, lookups only compare hashes */
+		uint32_t hash = cparse_fold_hash(key, key_len);
+		memcpy((char *)(entry + 1) + span_size, &hash, sizeof(hash));
+		entry->flags |= ENTRY_HASH;
+	}
+	if (lines) {
+		uint32_t at = line;
+		memcpy((char *)(entry + 1) + span_size + (icase ? sizeof(uint32_t) : 0), &at, sizeof(at));
+		entry->flags |= ENTRY_LINE;
+	}
+	entry->key_len = key_len;
+	entry->value_len = value_len;
+
+	if (!decoded && key_len + value_len + 2 <= ENTRY_INLINE_SIZE) {
+		memcpy(entry->u.data, key, key_len);
+		entry->u.data[key_len] = '\0';
+		memcpy(entry->u.data + key_len + 1, value, value_len);
+		entry->u.data[key_len + 1 + value_len] = '\0';
+		entry->flags |= ENTRY_INLINE;
 	} else {
-		ConfigEntry *last = config->current_section->entries;
-		while (last->next) {
-			last = last->next;
+		entry->u.ptr.key = config_strdup(config, key, key_len);
+		entry->u.ptr.value = config_strdup(config, value, value_len);
+		if (!entry->u.ptr.key || !entry->u.ptr.value) {
+			return 0; /* Arena memory is released with the config */
+		}
+		if (decoded) {
+			entry->flags |= ENTRY_ENCODED;
 		}
-		last->next = entry;
 	}
-	
+
+	if (refs) {
+		entry->flags |= ENTRY_REFS;
+	}
+
+	/* Add to linked list */
+	ConfigSection *section = config->current_section;
+	if (!section->entries) {
+		section->entries = entry;
+	} else {
+		section->last_entry->next = entry;
+	}
+	section->last_entry = entry;
+	cparse_index_added(config, section, entry);
+	cparse_fp_entry_added(config, section, entry, decoded);
+
 	config->entry_count++;
 	return 1;
 }
 
 /**
- * Free configuration memory
+ * Append the COUNT pairs of KVS to the current section. Nodes and the
+ * strings that do not fit in them are laid out in one arena block and
+ * linked to the section at once, so a batch costs one allocation at
+ * most. Either every pair is added or none is. Keys are not checked
+ * for duplicates here.
  */
-static void config_free(Config *config)
+int config_add_entries(Config *config, const XConfigKV *kvs, size_t count)
 {
-	if (!config) return;
-	
-	ConfigSection *section = config->sections;
-	while (section) {
-		ConfigEntry *entry = section->entries;
-		while (entry) {
-			ConfigEntry *next_entry = entry->next;
-			if (entry->key) free(entry->key);
-			if (entry->value) free(entry->value);
-			free(entry);
-			entry = next_entry;
-		}
-		
-		ConfigSection *next_section = section->next;
-		if (section->name) free(section->name);
-		free(section);
-		section = next_section;
+	if (!config || (!kvs && count) || !config->current_section) {
+		return 0;
 	}
-	
-	memset(config, 0, sizeof(Config));
-}
+	if (count == 0) return 1;
 
-// ==================== Error Handling ====================
+	int icase = config->flags & CONFIG_ICASE;
+	size_t node_size = (sizeof(ConfigEntry) + (icase ? sizeof(uint32_t) : 0) + 7) & ~(size_t)7;
+	size_t bytes = 0;
+	int refs = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!kvs[i].key || !kvs[i].value) return 0;
+
+		size_t key_len = strlen(kvs[i].key);
+		size_t value_len = strlen(kvs[i].value);
+		if (key_len > ENTRY_MAX_KEY || value_len > UINT32_MAX) {
+			return 0;
+		}
+		if (key_len + value_len + 2 > ENTRY_INLINE_SIZE) {
+			bytes += key_len + value_len + 2;
+		}
+		refs |= (config->flags & CONFIG_INTERPOLATE) && strstr(kvs[i].value, "${");
+	}
+
+	if (refs && !cparse_interp_init(config)) {
+		return 0;
+	}
+
+	char *block = config_alloc(config, count * node_size + bytes);
+	if (!block) {
+		return 0;
+	}
+	char *strings = block + count * node_size;
+
+	ConfigEntry *first = NULL, *last = NULL;
+	for (size_t i = 0; i < count; i++) {
+		const char *key = kvs[i].key, *value = kvs[i].value;
+		size_t key_len = strlen(key);
+		size_t value_len = strlen(value);
+
+		ConfigEntry *entry = (ConfigEntry *)(block + i * node_size);
+		memset(entry, 0, sizeof(ConfigEntry));
+		if (icase) {
+			uint32_t hash = cparse_fold_hash(key, key_len);
+			memcpy(entry + 1, &hash, sizeof(hash));
+			entry->flags |= ENTRY_HASH;
+		}
+		entry->key_len = key_len;
+		entry->value_len = value_len;
+
+		if (key_len + value_len + 2 <= ENTRY_INLINE_SIZE) {
+			memcpy(entry->u.data, key, key_len + 1);
+			memcpy(entry->u.data + key_len + 1, value, value_len + 1);
+			entry->flags |= ENTRY_INLINE;
+		} else {
+			entry->u.ptr.key = memcpy(strings, key, key_len + 1);
+			strings += key_len + 1;
+			entry->u.ptr.value = memcpy(strings, value, value_len + 1);
+			strings += value_len + 1;
+		}
+
+		if ((config->flags & CONFIG_INTERPOLATE) && strstr(value, "${")) {
+			entry->flags |= ENTRY_REFS;
+		}
+
+		if (last) {
+			last->next = entry;
+		} else {
+			first = entry;
+		}
+		last = entry;
+	}
+
+	ConfigSection *section = config->current_section;
+	if (!section->entries) {
+		section->entries = first;
+	} else {
+		section->last_entry->next = first;
+	}
+	section->last_entry = last;
+
+	for (ConfigEntry *entry = first; entry; entry = entry->next) {
+		cparse_index_added(config, section, entry);
+		cparse_fp_entry_added(config, section, entry, NULL);
+	}
+
+	config->entry_count += count;
+	return 1;
+}
 
 /**
- * Set error message
+ * Make room for SECTIONS more sections and ENTRIES more entries whose
+ * keys and values take BYTES in all: one arena chunk for the entries,
+ * used by the adds that follow, and a section table of that size.
  */
-void cparse_set_error(CPState *st, const char *str, ...)
+int config_reserve(Config *config, size_t sections, size_t entries, size_t bytes)
 {
-	if (!str) return;
-	(void)st;
-	
-	va_list args;
-	va_start(args, str);
-	vsnprintf(glb_err_buf, MAX_ERRBUF, str, args);
-	va_end(args);
-}
+	if (!config) return 0;
 
-// ==================== Parser Initialization ====================
+	size_t node_size = (sizeof(ConfigEntry) + sizeof(uint32_t) + 7) & ~(size_t)7;
+	if (entries > (SIZE_MAX - bytes) / (node_size + 2)) {
+		cparse_set_error(NULL, "Reservation too large");
+		return 0;
+	}
+
+	size_t size = (entries * (node_size + 2) + bytes + 7) & ~(size_t)7;
+	ConfigChunk *head = config->arena;
+	if (size > 0 && (!head || head->size - head->used < size)) {
+		ConfigChunk *chunk = malloc(sizeof(ConfigChunk) + size);
+		if (!chunk) {
+			cparse_set_error(NULL, "Failed to allocate memory");
+			return 0;
+		}
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = head;
+		config->arena = chunk;
+	}
+
+	return sections == 0 || cparse_index_reserve_sections(config, config->section_count + sections);
+}
 
 /**
- * Initialize parser state
+ * Replace the value of an existing entry of SECTION with the
+ * VALUE_LEN bytes of VALUE, which may be its own. Updated values that
+ * do not fit in the node are malloc'ed, so repeated updates do not
+ * grow the arena.
  */
-void cparse_init(CPState *st, int from, int fd, const char *str)
+int config_set_value(Config *config, const ConfigSection *section, ConfigEntry *entry,
+			const char *value, size_t value_len)
 {
-	if (!st) return;
-	
-	memset(glb_err_buf, 0, MAX_ERRBUF);
-	
-	if (from == P_FD) {
-		if (fd < 0) {
-			cparse_set_error(st, "Invalid file descriptor: %d", fd);
-			return;
+	if (!config || !section || !entry || !value) {
+		return 0;
+	}
+
+	if (value_len > UINT32_MAX) {
+		return 0;
+	}
+
+	XConfigFingerprint old = cparse_fp_value(section, entry);
+
+	if ((entry->flags & ENTRY_INLINE) &&
+	    entry->key_len + value_len + 2 <= ENTRY_INLINE_SIZE) {
+		char *data = entry->u.data + entry->key_len + 1;
+		memmove(data, value, value_len);
+		data[value_len] = '\0';
+	} else {
+		char *new_value = malloc(value_len + 1);
+		if (!new_value) {
+			return 0;
 		}
-		st->fd = fd;
-	} else if (from == P_STR) {
-		if (!str) {
-			cparse_set_error(st, "Invalid string: NULL");
-			return;
+		memcpy(new_value, value, value_len);
+		new_value[value_len] = '\0';
+
+		if (entry->flags & ENTRY_INLINE) {
+			/* Move the key out of the node first, it shares the space */
+			char *key = config_strdup(config, entry->u.data, entry->key_len);
+			if (!key) {
+				free(new_value);
+				return 0;
+			}
+			entry->u.ptr.key = key;
+			entry->flags &= ~ENTRY_INLINE;
+		} else if (entry->flags & ENTRY_VALUE_HEAP) {
+			free(entry->u.ptr.value);
 		}
-		st->str = dynamic_strdup(str);
-		if (!st->str) {
-			cparse_set_error(st, "Failed to allocate memory");
-			return;
+
+		entry->u.ptr.value = new_value;
+		entry->flags |= ENTRY_VALUE_HEAP;
+	}
+	if (entry->flags & ENTRY_ENCODED) {
+		free(entry->u.ptr.decoded);
+		entry->u.ptr.decoded = NULL;
+		entry->flags &= ~ENTRY_ENCODED;
+	}
+	entry->value_len = value_len;
+	entry->flags |= ENTRY_DIRTY;
+	cparse_fp_apply(config, old, -1);
+	cparse_fp_apply(config, cparse_fp_value(section, entry), 1);
+
+	entry->flags &= ~ENTRY_REFS;
+	if ((config->flags & CONFIG_INTERPOLATE) && cparse_find_ref(entry_value(entry), value_len) &&
+	    cparse_interp_init(config)) {
+		entry->flags |= ENTRY_REFS;
+	}
+
+	if (config->interp) {
+		cparse_interp_invalidate(config, entry);
+	}
+	cparse_list_invalidate(config, entry);
+
+	return 1;
+}
+
+/**
+ * Unlink ENTRY from SECTION. The node stays in the arena, a parsed
+ * entry's span is remembered so that a save can drop its line.
+ */
+int config_remove_entry(Config *config, ConfigSection *section, ConfigEntry *entry)
+{
+	if (!config || !section || !entry) {
+		return 0;
+	}
+
+	ConfigEntry **link = &section->entries;
+	ConfigEntry *prev = NULL;
+	while (*link && *link != entry) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	if (!*link) {
+		return 0;
+	}
+
+	const ConfigSpan *span = entry_span(entry);
+	if (span) {
+		if (config->removed_count == config->removed_capacity) {
+			size_t capacity = config->removed_capacity ? config->removed_capacity * BUFFER_GROWTH_FACTOR : 8;
+			ConfigSpan *removed = realloc(config->removed, capacity * sizeof(ConfigSpan));
+			if (!removed) {
+				return 0;
+			}
+			config->removed = removed;
+			config->removed_capacity = capacity;
+		}
+		config->removed[config->removed_count++] = *span;
+	}
+
+	cparse_fp_entry_removed(config, section, prev, entry);
+	*link = entry->next;
+	if (section->last_entry == entry) {
+		section->last_entry = prev;
+	}
+	entry->next = NULL;
+	config->entry_count--;
+	cparse_index_invalidate(section);
+
+	/* Expansions that used it must fail from now on */
+	if (config->interp) {
+		cparse_interp_invalidate(config, entry);
+	}
+	cparse_list_invalidate(config, entry);
+
+	if (entry->flags & ENTRY_VALUE_HEAP) {
+		free(entry->u.ptr.value);
+		entry->u.ptr.value = NULL;
+		entry->flags &= ~ENTRY_VALUE_HEAP;
+	}
+	if (entry->flags & ENTRY_ENCODED) {
+		free(entry->u.ptr.decoded);
+		entry->u.ptr.decoded = NULL;
+		entry->flags &= ~ENTRY_ENCODED;
+	}
+
+	return 1;
+}
+
+/**
+ * Find the first section named NAME
+ */
+ConfigSection *config_find_section(const Config *config, const char *name)
+{
+	if (!config || !name) return NULL;
+
+	return cparse_index_section(config, name, cparse_fold_hash(name, strlen(name)));
+}
+
+/**
+ * Find the first entry of SECTION named KEY. With CONFIG_ICASE the
+ * stored folded hashes are compared before any key bytes.
+ */
+ConfigEntry *config_find_entry(const Config *config, const ConfigSection *section, const char *key)
+{
+	if (!config || !section || !key) return NULL;
+	if (!section_ready(config, (ConfigSection *)section)) return NULL;
+
+	if (!(config->flags & CONFIG_ICASE)) {
+		for (ConfigEntry *entry = section->entries; entry; entry = entry->next) {
+			if (strcmp(entry_key(entry), key) == 0) {
+				return entry;
+			}
+		}
+		return NULL;
+	}
+
+	size_t len = strlen(key);
+	uint32_t hash = cparse_fold_hash(key, len);
+
+	for (ConfigEntry *entry = section->entries; entry; entry = entry->next) {
+		if (entry->key_len == len &&
+		    (!(entry->flags & ENTRY_HASH) || entry_hash(entry) == hash) &&
+		    cparse_fold_equal(entry_key(entry), key, len)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Merge entries of SRC into the section of the same name in DST.
+ * A key that already exists there takes the later value, or is an
+ * error when STRICT is set.
+ */
+int config_merge_section(Config *dst, const ConfigSection *src, int strict)
+{
+	ConfigSection *target = config_find_section(dst, src->name);
+	int fresh = !target;
+
+	if (fresh && !(target = config_add_section(dst, src->name))) {
+		return 0;
+	}
+	dst->current_section = target;
+
+	for (const ConfigEntry *ce = src->entries; ce; ce = ce->next) {
+		/* A section seen for the first time keeps its entries verbatim */
+		ConfigEntry *old = fresh ? NULL : config_find_entry(dst, target, entry_key(ce));
+
+		if (old && strict) {
+			cparse_set_error(NULL, "Duplicate key '%s' in section '%s'", entry_key(ce), src->name);
+			return 0;
+		}
+
+		const char *value = entry_value(ce);
+		if (!value) return 0;
+
+		if (old) {
+			if (!config_set_value(dst, target, old, value, entry_value_len(ce))) return 0;
+		} else if (!config_add_entry_len(dst, entry_key(ce), value, entry_value_len(ce))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Record an include directive. Directives are kept in placeholder
+ * sections so that their position among the real sections is preserved.
+ */
+static int config_add_include(Config *config, const char *path)
+{
+	ConfigSection *current = config->current_section;
+
+	if (!current) {
+		return 0;
+	}
+
+	if (!(current->flags & SECTION_INCLUDE)) {
+		/* Top level 'include = ...', reuse a trailing placeholder */
+		ConfigSection *last = config->last_section;
+
+		if (!(last->flags & SECTION_INCLUDE)) {
+			last = config_add_section(config, INCLUDE_KEY);
+			if (!last) {
+				return 0;
+			}
+			last->flags |= SECTION_INCLUDE;
+		}
+		config->current_section = last;
+	}
+
+	int ok = config_add_entry(config, INCLUDE_KEY, path);
+	config->current_section = current;
+	if (ok) {
+		config->entry_count--; /* Directives are not entries */
+		config->include_count++;
+	}
+
+	return ok;
+}
+
+/**
+ * Check whether KEY in the current section is an include directive
+ */
+static int config_is_include(const Config *config, const char *key)
+{
+	const ConfigSection *current = config->current_section;
+
+	if (!current) return 0;
+	if (current->flags & SECTION_INCLUDE) return 1;
+
+	/* 'include = ...' is only a directive outside of any section */
+	return current == config->sections && strcmp(key, INCLUDE_KEY) == 0;
+}
+
+/**
+ * Free the values of SECTION's entries that updates and decodes
+ * malloc'ed, nodes live in the arena
+ */
+static void section_free_values(ConfigSection *section)
+{
+	for (ConfigEntry *entry = section->entries; entry; entry = entry->next) {
+		if (entry->flags & ENTRY_VALUE_HEAP) {
+			free(entry->u.ptr.value);
+		}
+		if (entry->flags & ENTRY_ENCODED) {
+			free(entry->u.ptr.decoded);
+		}
+	}
+	section->entries = NULL;
+	section->last_entry = NULL;
+}
+
+/**
+ * Empty CONFIG for another parse, keeping its memory: sections go to a
+ * spare list that config_add_section() takes from, with their names
+ * and key tables, the arena is rewound and the section table and
+ * diagnostics are emptied in place. Only values malloc'ed by updates
+ * and decodes, and state made by reads (expansions, lists), are freed.
+ */
+void cparse_reset(Config *config)
+{
+	if (!config) return;
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		section_free_values(cs);
+	}
+	if (config->sections) {
+		config->last_section->next = config->spare_sections;
+		config->spare_sections = config->sections;
+	}
+	config->sections = NULL;
+	config->last_section = NULL;
+	config->current_section = NULL;
+	config->entry_count = 0;
+	config->section_count = 0;
+	config->include_count = 0;
+	memset(&config->fingerprint, 0, sizeof(XConfigFingerprint));
+	cparse_index_clear(config, NULL);
+
+	cparse_list_free(config);
+	cparse_interp_free(config);
+	cparse_image_free(config);
+	cparse_lazy_free(config);
+
+	/* One chunk as large as all of them, so that the next parse of a
+	 * config this size allocates nothing */
+	if (config->arena && config->arena->next) {
+		size_t total = 0;
+		while (config->arena) {
+			ConfigChunk *next = config->arena->next;
+			total += config->arena->size;
+			free(config->arena);
+			config->arena = next;
+		}
+
+		config->arena = malloc(sizeof(ConfigChunk) + total);
+		if (config->arena) {
+			config->arena->next = NULL;
+			config->arena->size = total;
+		}
+	}
+	if (config->arena) config->arena->used = 0;
+
+	for (size_t i = 0; i < config->load_stat_count; i++) {
+		free((char *)config->load_stats[i].file);
+	}
+	free(config->load_stats);
+	config->load_stats = NULL;
+	config->load_stat_count = 0;
+	config->removed_count = 0;
+	config->diags.count = 0;
+	config->diags.total = 0;
+	config->diags.text.len = 0;
+}
+
+/**
+ * Free configuration memory
+ */
+static void config_free(Config *config)
+{
+	if (!config) return;
+	
+	/* Spare sections are empty already, see cparse_reset() */
+	for (int spare = 0; spare < 2; spare++) {
+		ConfigSection *section = spare ? config->spare_sections : config->sections;
+		while (section) {
+			section_free_values(section);
+
+			ConfigSection *next_section = section->next;
+			if (section->name) free(section->name);
+			cparse_index_invalidate(section);
+			free(section);
+			section = next_section;
+		}
+	}
+
+	free(config->section_table);
+	cparse_list_free(config);
+	cparse_interp_free(config);
+	cparse_image_free(config);
+	cparse_lazy_free(config);
+
+	while (config->arena) {
+		ConfigChunk *next = config->arena->next;
+		free(config->arena);
+		config->arena = next;
+	}
+
+	for (size_t i = 0; i < config->load_stat_count; i++) {
+		free((char *)config->load_stats[i].file);
+	}
+	free(config->load_stats);
+	free(config->removed);
+	free(config->diags.records);
+	free(config->diags.text.data);
+	
+	memset(config, 0, sizeof(Config));
+}
+
+// ==================== Error Handling ====================
+
+/**
+ * Set error message
+ */
+void cparse_set_error(CPState *st, const char *str, ...)
+{
+	if (!str) return;
+	(void)st;
+	
+	va_list args;
+	va_start(args, str);
+	vsnprintf(glb_err_buf, MAX_ERRBUF, str, args);
+	va_end(args);
+}
+
+// ==================== Parser Initialization ====================
+
+/**
+ * Initialize parser state
+ */
+void cparse_init(CPState *st, int from, int fd, const char *str)
+{
+	if (!st) return;
+	
+	memset(glb_err_buf, 0, MAX_ERRBUF);
+	
+	if (from == P_FD) {
+		if (fd < 0) {
+			cparse_set_error(st, "Invalid file descriptor: %d", fd);
+			return;
+		}
+		st->fd = fd;
+	} else if (from == P_STR) {
+		if (!str) {
+			cparse_set_error(st, "Invalid string: NULL");
+			return;
+		}
+		st->str = dynamic_strdup(str);
+		if (!st->str) {
+			cparse_set_error(st, "Failed to allocate memory");
+			return;
+		}
+	} else {
+		cparse_set_error(st, "Invalid source: %d", from);
+		return;
+	}
+	
+	st->type = from;
+	st->len = 0;
+	st->off = 0;
+	st->path = NULL;
+	st->flags = 0;
+}
+
+// ==================== File Input ====================
+
+/**
+ * Read a whole file into a NUL-terminated buffer
+ */
+char *cparse_read_file(const char *path, size_t *length)
+{
+	if (!path) return NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	char *content = cparse_read_fd(fd, length);
+	close(fd);
+
+	return content;
+}
+
+/**
+ * Read the file open as FD into a NUL-terminated buffer, decompressed
+ * if it is gzip or zstd data
+ */
+char *cparse_read_fd(int fd, size_t *length)
+{
+	int kind = cparse_fd_compression(fd);
+	if (kind != COMPRESS_NONE) {
+		return cparse_decompress_all(fd, NULL, 0, kind, length);
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		return NULL;
+	}
+
+	char *content = malloc((size_t)sb.st_size + 1);
+	if (!content) {
+		return NULL;
+	}
+
+	size_t pos = 0;
+	while (pos < (size_t)sb.st_size) {
+		ssize_t n = read(fd, content + pos, (size_t)sb.st_size - pos);
+		if (n < 0) {
+			free(content);
+			return NULL;
+		}
+		if (n == 0) break; /* File shrank while reading */
+		pos += n;
+	}
+
+	content[pos] = '\0';
+	if (length) *length = pos;
+
+	return content;
+}
+
+// ==================== Parser Cleanup ====================
+
+/**
+ * Clean up parser resources
+ */
+void cparse_cleanup(CPState *st)
+{
+	if (st && st->type == P_STR && st->str) {
+		free(st->str);
+		st->str = NULL;
+	}
+}
+
+// ==================== Lexer Buffers ====================
+
+/**
+ * Append LEN bytes to BUF, keeping it NUL-terminated
+ */
+int cparse_buf_append(CPBuf *buf, const char *data, size_t len)
+{
+	if (buf->len + len + 1 > buf->size) {
+		size_t size = buf->size ? buf->size : INITIAL_BUFFER_SIZE;
+		while (buf->len + len + 1 > size) {
+			size *= BUFFER_GROWTH_FACTOR;
+		}
+
+		char *new_data = realloc(buf->data, size);
+		if (!new_data) {
+			return 0;
+		}
+		buf->data = new_data;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return 1;
+}
+
+/**
+ * Append one character to BUF
+ */
+static int buf_push(CPBuf *buf, char ch)
+{
+	return cparse_buf_append(buf, &ch, 1);
+}
+
+/**
+ * Drop trailing whitespace of BUF
+ */
+static void buf_rtrim(CPBuf *buf)
+{
+	while (buf->len > 0 && isspace((unsigned char)buf->data[buf->len - 1])) {
+		buf->len--;
+	}
+	if (buf->data) {
+		buf->data[buf->len] = '\0';
+	}
+}
+
+/**
+ * Empty BUF, keeping its storage for the next token
+ */
+static void buf_reset(CPBuf *buf)
+{
+	buf->len = 0;
+	if (buf->data) {
+		buf->data[0] = '\0';
+	}
+}
+
+// ==================== Lexer ====================
+
+/* Lexer states */
+enum
+{
+	L_LINE,         /* Start of line, skipping blanks */
+	L_COMMENT,      /* Comment, up to end of line */
+	L_SKIP,         /* Ignored rest of line */
+	L_SECTION,      /* Inside [section] */
+	L_KEY,          /* Key, possibly quoted */
+	L_AFTER_KEY,    /* Blanks between key and '=' */
+	L_VALUE_START,  /* Blanks after '=' */
+	L_SIMPLE,       /* Unquoted value */
+	L_QUOTED,       /* Quoted value */
+	L_ESCAPE,       /* After a backslash in a quoted value */
+	L_CONTINUE      /* Leading blanks of a multiline continuation */
+};
+
+/**
+ * Initialize lexer
+ */
+void cparse_lexer_init(CPLexer *lx, const XConfigCallbacks *cb, void *user)
+{
+	if (!lx) return;
+
+	memset(lx, 0, sizeof(CPLexer));
+	lx->state = L_LINE;
+	lx->line = 1;
+	lx->cb = cb;
+	lx->user = user;
+}
+
+/**
+ * Free lexer buffers
+ */
+void cparse_lexer_free(CPLexer *lx)
+{
+	if (!lx) return;
+
+	free(lx->key.data);
+	free(lx->value.data);
+	memset(&lx->key, 0, sizeof(CPBuf));
+	memset(&lx->value, 0, sizeof(CPBuf));
+}
+
+/* Messages of DIAG_* codes */
+static const char *const lexer_messages[] = {
+	[DIAG_SECTION] = "Missing ']' in section header",
+	[DIAG_KEY_QUOTE] = "Unclosed quotes in key",
+	[DIAG_EQUALS] = "Expected '=' after key",
+	[DIAG_VALUE_QUOTE] = "Unclosed quote",
+	[DIAG_KEY_LENGTH] = "Key longer than 65535 bytes",
+};
+
+/**
+ * Report error CODE at offset POS of the current line
+ */
+static void lexer_error(CPLexer *lx, int code, size_t pos)
+{
+	const char *msg = lexer_messages[code];
+
+	lx->error_code = code;
+	lx->error_column = (int)(pos - lx->line_start) + 1;
+	if (lx->cb && lx->cb->on_error &&
+	    lx->cb->on_error(lx->user, lx->line, msg, strlen(msg))) {
+		lx->stopped = 1;
+	}
+}
+
+/**
+ * Emit the section name held in the key buffer
+ */
+static void lexer_emit_section(CPLexer *lx)
+{
+	buf_rtrim(&lx->key);
+	if (lx->cb && lx->cb->on_section &&
+	    lx->cb->on_section(lx->user, lx->key.data ? lx->key.data : "", lx->key.len)) {
+		lx->stopped = 1;
+	}
+	buf_reset(&lx->key);
+}
+
+/**
+ * Emit the current key-value pair
+ */
+static void lexer_emit_entry(CPLexer *lx)
+{
+	if (lx->cb && lx->cb->on_entry &&
+	    lx->cb->on_entry(lx->user, lx->key.data ? lx->key.data : "", lx->key.len,
+				lx->value.data ? lx->value.data : "", lx->value.len)) {
+		lx->stopped = 1;
+	}
+	buf_reset(&lx->key);
+	buf_reset(&lx->value);
+}
+
+/**
+ * Map the character after a backslash
+ */
+static char lexer_unescape(char ch)
+{
+	switch (ch) {
+	case 'n': return '\n';
+	case 't': return '\t';
+	case 'r': return '\r';
+	case '0': return '\0';
+	default: return ch; /* '\\', quotes and others stand for themselves */
+	}
+}
+
+/**
+ * Append the raw text of a quoted value, as kept by a raw lexer, to
+ * OUT with its escapes mapped and continued lines joined exactly as
+ * the lexer would have done
+ */
+int cparse_unescape(CPBuf *out, const char *raw, size_t len)
+{
+	const char *p = raw;
+	const char *end = raw + len;
+
+	while (p < end) {
+		const char *run = p;
+		while (p < end && *p != '\\' && *p != '\n') {
+			p++;
+		}
+		if (!cparse_buf_append(out, run, p - run)) return 0;
+		if (p == end) break;
+
+		char ch = *p++;
+		if (ch == '\\') {
+			if (p == end) break;
+			ch = *p++;
+			if (ch != '\n') {
+				if (!buf_push(out, lexer_unescape(ch))) return 0;
+				continue;
+			}
+		}
+
+		/* A newline, escaped or not: continued lines are joined with a space */
+		if (!buf_push(out, '\n')) return 0;
+		while (p < end && *p != '\n' && isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (p < end && *p != '\n' && *p != '#' && *p != ';' && *p != '[') {
+			if (!buf_push(out, ' ')) return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Count a newline at offset POS
+ */
+static void lexer_newline(CPLexer *lx, size_t pos)
+{
+	lx->line++;
+	lx->line_start = pos + 1;
+}
+
+/* Offset of P in the whole input */
+#define LEXER_POS(p) (lx->offset + (size_t)((p) - data))
+
+/**
+ * Feed LEN bytes of input. The lexer keeps its whole state between
+ * calls, so chunk boundaries may fall anywhere. Memory is bounded by
+ * the longest key and value. Returns 0 if parsing must stop.
+ */
+int cparse_lexer_feed(CPLexer *lx, const char *data, size_t len)
+{
+	if (!lx) return 0;
+
+	const char *p = data;
+	const char *end = data + len;
+
+	while (p < end && !lx->stopped) {
+		char ch = *p;
+
+		switch (lx->state) {
+		case L_LINE:
+			if (ch == '\n') {
+				lexer_newline(lx, LEXER_POS(p));
+			} else if (ch == '#' || ch == ';') {
+				lx->state = L_COMMENT;
+			} else if (ch == '[') {
+				buf_reset(&lx->key);
+				lx->token_start = lx->line_start;
+				lx->token_line = lx->line;
+				lx->state = L_SECTION;
+			} else if (!isspace((unsigned char)ch)) {
+				buf_reset(&lx->key);
+				buf_reset(&lx->value);
+				lx->quote = 0;
+				lx->escaped = 0;
+				lx->token_start = lx->line_start;
+				lx->token_line = lx->line;
+				lx->state = L_KEY;
+				continue; /* Reprocess as part of the key */
+			}
+			p++;
+			break;
+
+		case L_COMMENT:
+		case L_SKIP: {
+			const char *nl = memchr(p, '\n', end - p);
+			if (!nl) {
+				p = end;
+				break;
+			}
+			lexer_newline(lx, LEXER_POS(nl));
+			lx->state = L_LINE;
+			p = nl + 1;
+			break;
+		}
+
+		case L_SECTION:
+			if (ch == ']') {
+				lx->value_end = LEXER_POS(p) + 1;
+				lexer_emit_section(lx);
+				lx->state = L_SKIP;
+			} else if (ch == '\n') {
+				lexer_error(lx, DIAG_SECTION, LEXER_POS(p));
+				lexer_newline(lx, LEXER_POS(p));
+				lx->state = L_LINE;
+			} else if (!buf_push(&lx->key, ch)) {
+				return 0;
+			}
+			p++;
+			break;
+
+		case L_KEY:
+			if (lx->quote) {
+				if (ch == lx->quote) {
+					lx->quote = 0;
+				} else if (ch == '\n') {
+					lexer_error(lx, DIAG_KEY_QUOTE, LEXER_POS(p));
+					lexer_newline(lx, LEXER_POS(p));
+					lx->state = L_LINE;
+				} else if (!buf_push(&lx->key, ch)) {
+					return 0;
+				}
+			} else if (ch == '=') {
+				lx->state = L_VALUE_START;
+			} else if (ch == '\n') {
+				lexer_error(lx, DIAG_EQUALS, LEXER_POS(p));
+				lexer_newline(lx, LEXER_POS(p));
+				lx->state = L_LINE;
+			} else if (isspace((unsigned char)ch)) {
+				lx->state = L_AFTER_KEY;
+			} else if (ch == '"' || ch == '\'') {
+				lx->quote = ch;
+			} else if (!buf_push(&lx->key, ch)) {
+				return 0;
+			}
+			p++;
+			break;
+
+		case L_AFTER_KEY:
+			if (ch == '=') {
+				lx->state = L_VALUE_START;
+			} else if (ch == '\n') {
+				lexer_error(lx, DIAG_EQUALS, LEXER_POS(p));
+				lexer_newline(lx, LEXER_POS(p));
+				lx->state = L_LINE;
+			} else if (!isspace((unsigned char)ch)) {
+				lexer_error(lx, DIAG_EQUALS, LEXER_POS(p));
+				lx->state = L_SKIP;
+			}
+			p++;
+			break;
+
+		case L_VALUE_START:
+			if (ch == '"' || ch == '\'') {
+				lx->quote = ch;
+				lx->value_start = LEXER_POS(p);
+				lx->state = L_QUOTED;
+				p++;
+			} else if (ch != '\n' && isspace((unsigned char)ch)) {
+				p++;
+			} else {
+				lx->value_start = LEXER_POS(p);
+				lx->state = L_SIMPLE;
+			}
+			break;
+
+		case L_SIMPLE: {
+			/* Take the run of plain characters at once */
+			const char *run = p;
+			while (p < end && *p != '\n' && *p != '#' && *p != ';') {
+				p++;
+			}
+			if (!cparse_buf_append(&lx->value, run, p - run)) {
+				return 0;
+			}
+			if (p == end) break;
+
+			buf_rtrim(&lx->value);
+			lx->value_end = lx->value_start + lx->value.len;
+			lexer_emit_entry(lx);
+			if (*p == '\n') {
+				lexer_newline(lx, LEXER_POS(p));
+				lx->state = L_LINE;
+			} else {
+				lx->state = L_COMMENT;
+			}
+			p++;
+			break;
+		}
+
+		case L_QUOTED: {
+			const char *run = p;
+			if (lx->raw) {
+				/* Escapes are kept, so they do not end the run */
+				while (p < end && *p != lx->quote && *p != '\n') {
+					if (*p == '\\') {
+						if (p + 1 == end || p[1] == '\n') break;
+						lx->escaped = 1;
+						p++;
+					}
+					p++;
+				}
+			} else {
+				while (p < end && *p != lx->quote && *p != '\\' && *p != '\n') {
+					p++;
+				}
+			}
+			if (!cparse_buf_append(&lx->value, run, p - run)) {
+				return 0;
+			}
+			if (p == end) break;
+
+			if (*p == lx->quote) {
+				lx->value_end = LEXER_POS(p) + 1;
+				lexer_emit_entry(lx);
+				lx->state = L_SKIP;
+			} else if (*p == '\\') {
+				if (lx->raw) {
+					if (!buf_push(&lx->value, '\\')) return 0;
+					lx->escaped = 1;
+				}
+				lx->state = L_ESCAPE;
+			} else {
+				if (!buf_push(&lx->value, '\n')) return 0;
+				lexer_newline(lx, LEXER_POS(p));
+				if (lx->raw) {
+					/* Joined by cparse_unescape() */
+					lx->escaped = 1;
+				} else {
+					lx->state = L_CONTINUE;
+				}
+			}
+			p++;
+			break;
+		}
+
+		case L_ESCAPE:
+			if (!buf_push(&lx->value, lx->raw ? ch : lexer_unescape(ch))) {
+				return 0;
+			}
+			if (ch == '\n') {
+				lexer_newline(lx, LEXER_POS(p));
+				lx->state = lx->raw ? L_QUOTED : L_CONTINUE;
+			} else {
+				lx->state = L_QUOTED;
+			}
+			p++;
+			break;
+
+		case L_CONTINUE:
+			if (ch != '\n' && isspace((unsigned char)ch)) {
+				p++;
+				break;
+			}
+			/* Continued lines are joined with a space */
+			if (ch != lx->quote && ch != '\n' && ch != '#' && ch != ';' && ch != '[') {
+				if (!buf_push(&lx->value, ' ')) return 0;
+			}
+			lx->state = L_QUOTED;
+			break;
+		}
+	}
+
+	lx->offset += len;
+	return !lx->stopped;
+}
+
+#undef LEXER_POS
+
+/**
+ * Finish input, flushing a pending entry or reporting an unterminated one
+ */
+int cparse_lexer_finish(CPLexer *lx)
+{
+	if (!lx) return 0;
+	if (lx->stopped) return 0;
+
+	switch (lx->state) {
+	case L_VALUE_START:
+		lx->value_start = lx->offset;
+		/* fall through */
+	case L_SIMPLE:
+		buf_rtrim(&lx->value);
+		lx->value_end = lx->value_start + lx->value.len;
+		lexer_emit_entry(lx);
+		break;
+	case L_QUOTED:
+	case L_ESCAPE:
+	case L_CONTINUE:
+		lexer_error(lx, DIAG_VALUE_QUOTE, lx->offset);
+		break;
+	case L_SECTION:
+		lexer_error(lx, DIAG_SECTION, lx->offset);
+		break;
+	case L_KEY:
+		lexer_error(lx, lx->quote ? DIAG_KEY_QUOTE : DIAG_EQUALS, lx->offset);
+		break;
+	case L_AFTER_KEY:
+		lexer_error(lx, DIAG_EQUALS, lx->offset);
+		break;
+	default:
+		break;
+	}
+
+	lx->state = L_LINE;
+	return !lx->stopped;
+}
+
+/**
+ * Feed a block of decompressed input to the lexer
+ */
+static int lexer_feed_block(void *user, const char *data, size_t len)
+{
+	return cparse_lexer_feed(user, data, len);
+}
+
+/**
+ * Feed all of STATE's input to LEXER, decompressed if it is gzip or
+ * zstd data
+ */
+static int lexer_feed_state(CPLexer *lexer, CPState *st)
+{
+	if (st->type == P_STR) {
+		size_t len = st->len ? st->len - st->off : strlen(st->str + st->off);
+		cparse_lexer_feed(lexer, st->str + st->off, len);
+		st->off += len;
+		return 1;
+	}
+
+	if (st->type != P_FD) {
+		cparse_set_error(st, "Invalid type: %d", st->type);
+		return 0;
+	}
+
+	char *chunk = malloc(READ_CHUNK_SIZE);
+	if (!chunk) {
+		cparse_set_error(st, "Failed to allocate memory");
+		return 0;
+	}
+
+	/* The first bytes tell whether the input is compressed */
+	size_t head = 0;
+	ssize_t n = 0;
+	while (head < COMPRESS_MAGIC_SIZE &&
+	       (n = read(st->fd, chunk + head, READ_CHUNK_SIZE - head)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			cparse_set_error(st, "Read failed: %s", strerror(errno));
+			free(chunk);
+			return 0;
+		}
+		head += n;
+	}
+	st->off += head;
+
+	int kind = cparse_compression(chunk, head);
+	if (kind != COMPRESS_NONE) {
+		int ok = cparse_decompress(st->fd, chunk, head, kind, lexer_feed_block, lexer);
+		free(chunk);
+		return ok;
+	}
+
+	/* The head is input too, all of it for a source that short. Read
+	 * on unless that was the end and the callbacks did not stop. */
+	int ok = 1;
+	int more = (head == 0 || cparse_lexer_feed(lexer, chunk, head)) && n != 0;
+
+	while (more && (n = read(st->fd, chunk, READ_CHUNK_SIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			cparse_set_error(st, "Read failed: %s", strerror(errno));
+			ok = 0;
+			break;
+		}
+		st->off += n;
+		if (!cparse_lexer_feed(lexer, chunk, n)) break;
+	}
+
+	free(chunk);
+	return ok;
+}
+
+/**
+ * Feed STATE's input through the lexer into callbacks
+ */
+int cparse_events(CPState *st, const XConfigCallbacks *cb, void *user)
+{
+	if (!st) return 0;
+
+	CPLexer lexer;
+	cparse_lexer_init(&lexer, cb, user);
+
+	int ok = lexer_feed_state(&lexer, st);
+	if (ok) {
+		cparse_lexer_finish(&lexer);
+	}
+
+	cparse_lexer_free(&lexer);
+	return ok;
+}
+
+// ==================== Diagnostics ====================
+
+/**
+ * Set how many diagnostics the parses started by this thread keep
+ */
+void cparse_set_diag_limit(size_t limit)
+{
+	glb_diag_limit = limit;
+}
+
+/**
+ * Diagnostics kept per parse started by this thread
+ */
+size_t cparse_get_diag_limit(void)
+{
+	return glb_diag_limit;
+}
+
+/**
+ * Record a diagnostic whose message is PREFIX (may be NULL), ": " and
+ * the LEN bytes of MSG. Past the limit it is only counted.
+ */
+static int diag_add(ConfigDiags *diags, int line, int column, int code,
+			const char *prefix, const char *msg, size_t len)
+{
+	diags->total++;
+	if (diags->count >= diags->limit || diags->text.len >= UINT32_MAX) return 1;
+
+	if (diags->count == diags->size) {
+		size_t size = diags->size ? diags->size * BUFFER_GROWTH_FACTOR : 16;
+		if (size > diags->limit) size = diags->limit;
+
+		XConfigDiag *records = realloc(diags->records, size * sizeof(XConfigDiag));
+		if (!records) return 0;
+		diags->records = records;
+		diags->size = size;
+	}
+
+	uint32_t message = diags->text.len;
+	if ((prefix && (!cparse_buf_append(&diags->text, prefix, strlen(prefix)) ||
+			!cparse_buf_append(&diags->text, ": ", 2))) ||
+	    !cparse_buf_append(&diags->text, msg, len) ||
+	    !buf_push(&diags->text, '\0')) {
+		return 0;
+	}
+
+	XConfigDiag *d = &diags->records[diags->count++];
+	d->line = line;
+	d->column = column;
+	d->code = code;
+	d->message = message;
+	return 1;
+}
+
+/**
+ * Append the diagnostics of SRC to DST, within DST's limit. FILE, if
+ * any, prefixes the messages, lines being those of that file.
+ */
+int cparse_diag_merge(Config *dst, const Config *src, const char *file)
+{
+	const ConfigDiags *from = &src->diags;
+
+	for (size_t i = 0; i < from->count; i++) {
+		const XConfigDiag *d = &from->records[i];
+		const char *msg = from->text.data + d->message;
+
+		if (!diag_add(&dst->diags, d->line, d->column, d->code, file, msg, strlen(msg))) {
+			cparse_set_error(NULL, "Failed to allocate memory");
+			return 0;
+		}
+	}
+
+	/* Those past the source's limit are counted all the same */
+	dst->diags.total += from->total - from->count;
+	return 1;
+}
+
+// ==================== Main Parser ====================
+
+/**
+ * Source span of the token the lexer just emitted
+ */
+static int load_span(CPLoader *ld, ConfigSpan *span)
+{
+	const CPLexer *lx = &ld->lexer;
+
+	/* Spans are 32-bit, larger sources cannot be edited in place */
+	if (lx->value_end > UINT32_MAX) {
+		cparse_set_error(NULL, "Source too large to preserve its layout");
+		ld->failed = 1;
+		return 0;
+	}
+
+	span->line_start = lx->token_start;
+	span->value_start = lx->value_start;
+	span->value_end = lx->value_end;
+	return 1;
+}
+
+/**
+ * Record diagnostic CODE and go on with the next line, or stop with
+ * CONFIG_FAIL_FAST. Nothing is printed.
+ */
+static int load_diag(CPLoader *ld, int line, int column, int code, const char *msg, size_t len)
+{
+	Config *config = ld->config;
+
+	/* The first error describes the parse, formatted once */
+	if ((config->flags & CONFIG_FAIL_FAST) || config->diags.total == 0) {
+		cparse_set_error(NULL, "Line %d, column %d: %s", line, column, msg);
+	}
+
+	if (config->flags & CONFIG_FAIL_FAST) {
+		ld->failed = 1;
+		return 1;
+	}
+
+	if (!diag_add(&config->diags, line, column, code, NULL, msg, len)) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		ld->failed = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Section event: append a section
+ */
+static int load_on_section(void *user, const char *name, size_t len)
+{
+	CPLoader *ld = user;
+	(void)len;
+
+	ConfigSection *section = config_add_section(ld->config, name);
+	if (!section) {
+		cparse_set_error(NULL, "Failed to add section: %s", name);
+		ld->failed = 1;
+		return 1;
+	}
+	section->line = ld->lexer.token_line;
+
+	if (ld->config->flags & CONFIG_PRESERVE) {
+		ld->lexer.value_start = ld->lexer.token_start;
+		if (!load_span(ld, &section->span)) return 1;
+		section->flags |= SECTION_SPAN;
+	}
+
+	if (strcmp(name, INCLUDE_KEY) == 0) {
+		ld->config->current_section->flags |= SECTION_INCLUDE;
+	}
+
+	return 0;
+}
+
+/**
+ * Entry event: add to the current section, or record an include
+ */
+static int load_on_entry(void *user, const char *key, size_t key_len,
+			const char *value, size_t value_len)
+{
+	CPLoader *ld = user;
+	ConfigSpan span;
+
+	/* Key lengths are 16 bits, the line is skipped like a malformed one */
+	if (key_len > ENTRY_MAX_KEY) {
+		const char *msg = lexer_messages[DIAG_KEY_LENGTH];
+		return load_diag(ld, ld->lexer.token_line, 1, DIAG_KEY_LENGTH, msg, strlen(msg));
+	}
+
+	int preserve = ld->config->flags & CONFIG_PRESERVE;
+	if (preserve && !load_span(ld, &span)) {
+		return 1;
+	}
+
+	if (config_is_include(ld->config, key)) {
+		/* Paths are needed now, decode them right away */
+		CPBuf path = { NULL, 0, 0 };
+		int ok = !ld->lexer.escaped || cparse_unescape(&path, value, value_len);
+		ok = ok && config_add_include(ld->config, path.data ? path.data : value);
+		free(path.data);
+
+		if (!ok) {
+			cparse_set_error(NULL, "Failed to add include directive");
+			ld->failed = 1;
+			return 1;
 		}
 	} else {
-		cparse_set_error(st, "Invalid source: %d", from);
-		return;
+		/* Kept encoded, but hashed decoded like a value set decoded */
+		CPBuf *decoded = ld->lexer.escaped ? &ld->decoded : NULL;
+		if (decoded) {
+			buf_reset(decoded);
+		}
+
+		if ((decoded && !cparse_unescape(decoded, value, value_len)) ||
+		    !config_add_entry_at(ld->config, key, key_len, value, value_len,
+					preserve ? &span : NULL, ld->lexer.token_line, decoded)) {
+			cparse_set_error(NULL, "Failed to add configuration entry");
+			ld->failed = 1;
+			return 1;
+		}
 	}
-	
-	st->type = from;
-	st->off = 0;
+
+	return 0;
+}
+
+/**
+ * Error event: record a diagnostic and go on with the next line, or
+ * stop with CONFIG_FAIL_FAST
+ */
+static int load_on_error(void *user, int line, const char *msg, size_t len)
+{
+	CPLoader *ld = user;
+
+	return load_diag(ld, line, ld->lexer.error_column, ld->lexer.error_code, msg, len);
 }
 
-// ==================== Character Input ====================
+static const XConfigCallbacks load_callbacks = {
+	load_on_section,
+	load_on_entry,
+	load_on_error
+};
 
 /**
- * Get next character from input
+ * Start building a configuration from raw input
  */
-static int cparse_getc(CPState *st)
+int cparse_loader_init(CPLoader *ld, unsigned flags)
 {
-	if (!st) return EOF;
-	
-	int ch = EOF;
-	
-	if (st->type == P_FD) {
-		char buf[1];
-		if (read(st->fd, buf, 1) <= 0) {
-			return EOF;
-		}
-		st->off++;
-		ch = buf[0];
-	} else if (st->type == P_STR) {
-		if (st->off >= strlen(st->str)) {
-			return EOF;
-		}
-		ch = st->str[st->off++];
-	} else {
-		cparse_set_error(st, "Invalid type: %d", st->type);
-		ch = -2;
+	if (!ld) return 0;
+
+	memset(ld, 0, sizeof(CPLoader));
+
+	ld->config = malloc(sizeof(Config));
+	if (!ld->config) {
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		return 0;
 	}
-	
-	return ch;
+
+	config_init(ld->config);
+	ld->config->flags = flags;
+	ld->config->diags.limit = cparse_get_diag_limit();
+
+	/* Create default section for entries before any section header */
+	if (!config_add_section(ld->config, "")) {
+		cparse_set_error(NULL, "Failed to create default section");
+		free(ld->config);
+		ld->config = NULL;
+		return 0;
+	}
+
+	cparse_lexer_init(&ld->lexer, &load_callbacks, ld);
+	ld->lexer.raw = (flags & CONFIG_DEFER_ESCAPES) != 0;
+	return 1;
 }
 
 /**
- * Peek at next character without consuming it
+ * Feed a chunk of input, the chunk may end anywhere
  */
-static int cparse_peek(CPState *st)
+int cparse_loader_feed(CPLoader *ld, const char *data, size_t len)
 {
-	if (!st) return EOF;
-	
-	off_t saved_off = st->off;
-	int ch = cparse_getc(st);
-	st->off = saved_off;
-	return ch;
+	if (!ld || !ld->config || ld->failed) return 0;
+
+	return cparse_lexer_feed(&ld->lexer, data, len) && !ld->failed;
 }
 
 /**
- * Clean up parser resources
+ * End of input, returns the configuration (includes not resolved)
+ * and detaches it from the loader
  */
-void cparse_cleanup(CPState *st)
+Config *cparse_loader_finish(CPLoader *ld)
 {
-	if (st && st->type == P_STR && st->str) {
-		free(st->str);
-		st->str = NULL;
+	if (!ld || !ld->config) return NULL;
+
+	cparse_lexer_finish(&ld->lexer);
+
+	Config *config = ld->config;
+	ld->config = NULL;
+
+	if (ld->failed) {
+		cparse_free(config);
+		return NULL;
 	}
-}
 
-// ==================== Parser Utilities ====================
+	return config;
+}
 
 /**
- * Skip whitespace characters
+ * Free loader buffers and an unfinished configuration
  */
-static void skip_whitespace(CPState *st)
+void cparse_loader_free(CPLoader *ld)
 {
-	if (!st) return;
-	
-	int ch;
-	while ((ch = cparse_peek(st)) != EOF) {
-		if (isspace(ch) && ch != '\n') {
-			cparse_getc(st); /* Consume whitespace */
-		} else {
-			break;
-		}
-	}
+	if (!ld) return;
+
+	cparse_free(ld->config);
+	ld->config = NULL;
+	cparse_lexer_free(&ld->lexer);
+	free(ld->decoded.data);
+	memset(&ld->decoded, 0, sizeof(CPBuf));
 }
 
 /**
- * Skip comment lines
+ * Parse a whole document of LEN bytes into the loader's own config,
+ * which is emptied with cparse_reset() and reused, lexer buffers too.
+ * Once earlier documents made room, a parse allocates nothing. The
+ * config stays the loader's, until the next parse or
+ * cparse_loader_free(). Returns NULL on error, the config kept.
  */
-static int skip_comments(CPState *st)
+Config *cparse_loader_parse(CPLoader *ld, const char *data, size_t len, unsigned flags)
 {
-	if (!st) return 0;
-	
-	skip_whitespace(st);
-	
-	int ch = cparse_peek(st);
-	if (ch == '\n') {
-		cparse_getc(st); /* Skip empty line */
-		return 1;
+	if (!ld || !data) return NULL;
+
+	if (ld->config) {
+		cparse_reset(ld->config);
+	} else if ((ld->config = malloc(sizeof(Config))) != NULL) {
+		config_init(ld->config);
+	} else {
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		return NULL;
 	}
-	
-	if (ch == '#' || ch == ';') { /* Comment line */
-		while ((ch = cparse_getc(st)) != EOF && ch != '\n') {
-			/* Skip entire line */
-		}
-		return 1;
+
+	Config *config = ld->config;
+	config->flags = flags;
+	config->diags.limit = cparse_get_diag_limit();
+	if (!config_add_section(config, "")) {
+		cparse_set_error(NULL, "Failed to create default section");
+		return NULL;
 	}
-	
-	return 0;
-}
 
-// ==================== Value Reading ====================
+	CPBuf key = ld->lexer.key, value = ld->lexer.value;
+	cparse_lexer_init(&ld->lexer, &load_callbacks, ld);
+	ld->lexer.key = key;
+	ld->lexer.value = value;
+	buf_reset(&ld->lexer.key);
+	buf_reset(&ld->lexer.value);
+	ld->lexer.raw = (flags & CONFIG_DEFER_ESCAPES) != 0;
+	ld->failed = 0;
+
+	cparse_lexer_feed(&ld->lexer, data, len);
+	cparse_lexer_finish(&ld->lexer);
+
+	return ld->failed ? NULL : config;
+}
 
 /**
- * Read simple value (without quotes)
+ * Parse the entries in [START, END) of SOURCE into SECTION of CONFIG.
+ * Offsets and lines are those of the whole source, so spans and
+ * reported lines are the same as with a full parse.
  */
-static char *read_simple_value(CPState *st)
+int cparse_load_range(Config *config, ConfigSection *section, const char *source,
+			size_t start, size_t end, int line)
 {
-	if (!st) return NULL;
-	
-	size_t buffer_size = INITIAL_BUFFER_SIZE;
-	char *buffer = malloc(buffer_size);
-	if (!buffer) return NULL;
-	
-	size_t pos = 0;
-	int ch;
-	
-	while ((ch = cparse_peek(st)) != EOF && ch != '\n' && ch != '#' && ch != ';') {
-		ch = cparse_getc(st);
-		
-		/* Resize buffer if needed */
-		if (pos + 1 >= buffer_size) {
-			buffer_size *= BUFFER_GROWTH_FACTOR;
-			char *new_buffer = realloc(buffer, buffer_size);
-			if (!new_buffer) {
-				free(buffer);
-				return NULL;
-			}
-			buffer = new_buffer;
-		}
-		
-		buffer[pos++] = ch;
-	}
-	
-	/* Trim trailing whitespace */
-	while (pos > 0 && isspace(buffer[pos - 1])) {
-		pos--;
-	}
-	
-	buffer[pos] = '\0';
-	
-	/* Shrink buffer to actual size */
-	if (pos + 1 < buffer_size) {
-		char *shrunk_buffer = realloc(buffer, pos + 1);
-		if (shrunk_buffer) {
-			buffer = shrunk_buffer;
-		}
-	}
-	
-	return buffer;
+	CPLoader ld;
+
+	memset(&ld, 0, sizeof(CPLoader));
+	ld.config = config;
+	config->current_section = section;
+
+	cparse_lexer_init(&ld.lexer, &load_callbacks, &ld);
+	ld.lexer.offset = start;
+	ld.lexer.line_start = start;
+	ld.lexer.line = line;
+	ld.lexer.raw = (config->flags & CONFIG_DEFER_ESCAPES) != 0;
+
+	cparse_lexer_feed(&ld.lexer, source + start, end - start);
+	cparse_lexer_finish(&ld.lexer);
+	cparse_lexer_free(&ld.lexer);
+	free(ld.decoded.data);
+
+	return !ld.failed;
 }
 
 /**
- * Read quoted value with support for multiline and escape sequences
+ * Parse configuration without resolving include directives
  */
-static char *read_quoted_value(CPState *st, char quote_char)
+Config *cparse_parse(CPState *st)
 {
 	if (!st) return NULL;
-	
-	cparse_getc(st); /* Consume opening quote */
-	
-	size_t buffer_size = INITIAL_BUFFER_SIZE;
-	char *buffer = malloc(buffer_size);
-	if (!buffer) return NULL;
-	
-	size_t pos = 0;
-	int ch;
-	int escape = 0;
-	
-	while ((ch = cparse_getc(st)) != EOF) {
-		if (escape) {
-			/* Handle escape sequences */
-			switch (ch) {
-			case 'n': ch = '\n'; break;
-			case 't': ch = '\t'; break;
-			case 'r': ch = '\r'; break;
-			case '\\': ch = '\\'; break;
-			case '"': ch = '"'; break;
-			case '\'': ch = '\''; break;
-			default: break; /* Keep other escaped characters */
-			}
-			escape = 0;
-		} else if (ch == '\\') {
-			escape = 1;
-			continue;
-		} else if (ch == quote_char) {
-			break; /* End of quoted value */
-		}
-		
-		/* Resize buffer if needed */
-		if (pos + 1 >= buffer_size) {
-			buffer_size *= BUFFER_GROWTH_FACTOR;
-			char *new_buffer = realloc(buffer, buffer_size);
-			if (!new_buffer) {
-				free(buffer);
-				return NULL;
-			}
-			buffer = new_buffer;
-		}
-		
-		buffer[pos++] = ch;
-		
-		/* Handle multiline values */
-		if (ch == '\n') {
-			skip_whitespace(st);
-			int next_ch = cparse_peek(st);
-			if (next_ch != quote_char && next_ch != '\n' && next_ch != '#' && next_ch != ';' && next_ch != '[') {
-				/* Continue multiline value */
-				if (pos + 1 >= buffer_size) {
-					buffer_size *= BUFFER_GROWTH_FACTOR;
-					char *new_buffer = realloc(buffer, buffer_size);
-					if (!new_buffer) {
-						free(buffer);
-						return NULL;
-					}
-					buffer = new_buffer;
-				}
-				buffer[pos++] = ' '; /* Add space between lines */
-			}
-		}
-	}
-	
-	if (ch != quote_char) {
-		cparse_set_error(st, "Unclosed quote");
-		free(buffer);
+
+	CPLoader ld;
+	if (!cparse_loader_init(&ld, st->flags)) {
 		return NULL;
 	}
-	
-	buffer[pos] = '\0';
-	
-	/* Shrink buffer to actual size */
-	if (pos + 1 < buffer_size) {
-		char *shrunk_buffer = realloc(buffer, pos + 1);
-		if (shrunk_buffer) {
-			buffer = shrunk_buffer;
-		}
+
+	Config *config = NULL;
+	if (lexer_feed_state(&ld.lexer, st)) {
+		config = cparse_loader_finish(&ld);
 	}
-	
-	return buffer;
+
+	cparse_loader_free(&ld);
+	return config;
 }
 
 /**
- * Read configuration value
+ * Main configuration parsing function
  */
-static char *read_value(CPState *st)
+Config *cparse_load(CPState *st)
 {
-	if (!st) return NULL;
-	
-	skip_whitespace(st);
-	int ch = cparse_peek(st);
-	
-	if (ch == '"' || ch == '\'') {
-		return read_quoted_value(st, ch);
-	} else {
-		return read_simple_value(st);
+	/* Failing fast needs every line checked now, not on first read */
+	if (st && (st->flags & CONFIG_FAIL_FAST)) {
+		st->flags &= ~CONFIG_LAZY;
+	}
+
+	Config *config = (st && st->type == P_STR && (st->flags & CONFIG_LAZY))
+		? cparse_lazy_load(st) : cparse_parse(st);
+
+	if (config && config->include_count > 0) {
+		/* Splicing copies every section, parse them all */
+		if (!cparse_lazy_load_all(config)) {
+			cparse_free(config);
+			return NULL;
+		}
+		config = cparse_include_resolve(config, st->path);
 	}
-}
 
-// ==================== Key Reading ====================
+	return config;
+}
 
 /**
- * Read key name
+ * Free configuration memory
  */
-static char *read_key(CPState *st)
+void cparse_free(Config *config)
 {
-	if (!st) return NULL;
-	
-	skip_whitespace(st);
-	
-	size_t buffer_size = INITIAL_BUFFER_SIZE;
-	char *buffer = malloc(buffer_size);
-	if (!buffer) return NULL;
-	
-	size_t pos = 0;
-	int ch;
-	int in_quotes = 0;
-	char quote_char = 0;
-	
-	while ((ch = cparse_peek(st)) != EOF) {
-		if (ch == '=' && !in_quotes) break;
-		if (isspace(ch) && !in_quotes) break;
-		if (ch == '\n') break;
-		
-		ch = cparse_getc(st);
-		
-		if ((ch == '"' || ch == '\'') && !in_quotes) {
-			in_quotes = 1;
-			quote_char = ch;
-			continue;
-		}
-		
-		if (ch == quote_char && in_quotes) {
-			in_quotes = 0;
-			continue;
-		}
-		
-		/* Resize buffer if needed */
-		if (pos + 1 >= buffer_size) {
-			buffer_size *= BUFFER_GROWTH_FACTOR;
-			char *new_buffer = realloc(buffer, buffer_size);
-			if (!new_buffer) {
-				free(buffer);
-				return NULL;
-			}
-			buffer = new_buffer;
-		}
-		
-		buffer[pos++] = ch;
-	}
-	
-	if (in_quotes) {
-		cparse_set_error(st, "Unclosed quotes in key");
-		free(buffer);
-		return NULL;
-	}
-	
-	buffer[pos] = '\0';
-	
-	/* Trim whitespace from key */
-	while (pos > 0 && isspace(buffer[pos - 1])) {
-		buffer[--pos] = '\0';
-	}
-	
-	/* Shrink buffer to actual size */
-	if (pos + 1 < buffer_size) {
-		char *shrunk_buffer = realloc(buffer, pos + 1);
-		if (shrunk_buffer) {
-			buffer = shrunk_buffer;
-		}
+	if (config) {
+		config_free(config);
+		free(config);
 	}
-	
-	return buffer;
 }
 
-// ==================== Section Reading ====================
+// ==================== Configuration Query ====================
 
 /**
- * Read section name [section]
+ * Find entry by section and key, stores its section in WHERE
  */
-static char *read_section(CPState *st)
+ConfigEntry *cparse_find(const Config *config, const char *section,
+			const char *key, ConfigSection **where)
 {
-	if (!st) return NULL;
-	
-	skip_whitespace(st);
-	int ch = cparse_getc(st);
-	
-	if (ch != '[') {
-		st->off--; /* Put character back */
-		return NULL;
-	}
-	
-	size_t buffer_size = INITIAL_BUFFER_SIZE;
-	char *buffer = malloc(buffer_size);
-	if (!buffer) return NULL;
-	
-	size_t pos = 0;
-	
-	while ((ch = cparse_getc(st)) != EOF && ch != ']' && ch != '\n') {
-		/* Resize buffer if needed */
-		if (pos + 1 >= buffer_size) {
-			buffer_size *= BUFFER_GROWTH_FACTOR;
-			char *new_buffer = realloc(buffer, buffer_size);
-			if (!new_buffer) {
-				free(buffer);
-				return NULL;
-			}
-			buffer = new_buffer;
-		}
-		
-		buffer[pos++] = ch;
-	}
-	
-	if (ch != ']') {
-		cparse_set_error(st, "Missing ']' in section header");
-		free(buffer);
-		return NULL;
-	}
-	
-	buffer[pos] = '\0';
-	
-	/* Skip to end of line */
-	while ((ch = cparse_getc(st)) != EOF && ch != '\n') {
-		/* Skip remaining characters */
-	}
-	
-	/* Trim whitespace from section name */
-	while (pos > 0 && isspace(buffer[pos - 1])) {
-		buffer[--pos] = '\0';
+	if (!config || !key) return NULL;
+
+	/* A specific section is only searched in the first of its name */
+	if (section) {
+		ConfigSection *cs = config_find_section(config, section);
+		ConfigEntry *entry = cs ? config_find_entry(config, cs, key) : NULL;
+		if (entry && where) *where = cs;
+		return entry;
 	}
-	
-	/* Shrink buffer to actual size */
-	if (pos + 1 < buffer_size) {
-		char *shrunk_buffer = realloc(buffer, pos + 1);
-		if (shrunk_buffer) {
-			buffer = shrunk_buffer;
+
+	/* If section is NULL, search in all sections */
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		ConfigEntry *entry = config_find_entry(config, cs, key);
+		if (entry) {
+			if (where) *where = cs;
+			return entry;
 		}
 	}
-	
-	return buffer;
-}
 
-// ==================== Entry Parsing ====================
+	return NULL; /* Key not found */
+}
 
 /**
- * Parse single configuration entry
+ * Read value from specified section and key. Returns NULL if not found
  */
-static int parse_config_entry(CPState *st, Config *config, int *line_num)
+const char *cparse_read(Config *config, const char *section, const char *key, size_t *len)
 {
-	if (!st || !config) return 0;
-	
-	/* Skip comments and blank lines */
-	while (skip_comments(st)) {
-		(*line_num)++;
-	}
-	
-	skip_whitespace(st);
-	int ch = cparse_peek(st);
-	
-	if (ch == EOF) return 0;
-	if (ch == '[') return 0; /* Section line */
-	
-	/* Read key */
-	char *key = read_key(st);
-	if (!key) return 0;
-	
-	/* Find equals sign */
-	skip_whitespace(st);
-	ch = cparse_getc(st);
-	if (ch != '=') {
-		cparse_set_error(st, "Expected '=' after key");
-		free(key);
-		return 0;
-	}
-	
-	/* Read value */
-	char *value = read_value(st);
-	if (!value) {
-		free(key);
-		return 0;
-	}
-	
-	/* Add to configuration */
-	if (!config_add_entry(config, key, value)) {
-		cparse_set_error(st, "Failed to add configuration entry");
-		free(key);
-		free(value);
-		return 0;
+	if (config && config->image) {
+		return cparse_image_read(config->image, section, key, len);
 	}
 
-	free(key);
-	free(value);
+	ConfigSection *where = NULL;
+	ConfigEntry *entry = cparse_find(config, section, key, &where);
 
-	/* Skip to end of line */
-	while ((ch = cparse_peek(st)) != EOF && ch != '\n') {
-		cparse_getc(st);
-	}
-	if (ch == '\n') {
-		cparse_getc(st);
-		(*line_num)++;
-	}
+	if (!entry) return NULL;
 
-	return 1;
+	return cparse_entry_value(config, where, entry, len);
 }
 
-// ==================== Main Parser ====================
-
 /**
- * Main configuration parsing function
+ * Value of ENTRY in SECTION as read, references expanded. Its length,
+ * stored with the value, goes to LEN if not NULL.
  */
-Config *cparse_load(CPState *st)
+const char *cparse_entry_value(Config *config, ConfigSection *section, ConfigEntry *entry,
+				size_t *len)
 {
-	if (!st) return NULL;
-
-	Config *config = malloc(sizeof(Config));
-	if (!config) {
-		cparse_set_error(st, "Failed to allocate configuration memory");
-		return NULL;
+	/* Plain values are returned as is */
+	if (entry->flags & ENTRY_REFS) {
+		return cparse_interp_value(config, section, entry, len);
 	}
 
-	config_init(config);
+	const char *value = entry_value(entry);
+	if (value && len) *len = entry_value_len(entry);
+	return value;
+}
 
-	/* Create default section for entries before any section header */
-	if (!config_add_section(config, "")) {
-		cparse_set_error(st, "Failed to create default section");
-		free(config);
+/**
+ * Decoded value of an ENTRY_ENCODED entry, decoded by the first read.
+ * Concurrent readers may both decode it, one copy is published and
+ * the other dropped.
+ */
+const EntryDecoded *cparse_entry_decode(const ConfigEntry *entry)
+{
+	EntryDecoded *decoded = __atomic_load_n(&entry->u.ptr.decoded, __ATOMIC_ACQUIRE);
+	if (decoded) return decoded;
+
+	CPBuf buf = { NULL, 0, 0 };
+	if (!cparse_unescape(&buf, entry->u.ptr.value, entry->value_len) || !buf.data ||
+	    !(decoded = malloc(sizeof(EntryDecoded) + buf.len + 1))) {
+		free(buf.data);
+		cparse_set_error(NULL, "Failed to allocate memory");
 		return NULL;
 	}
 
-	int line_num = 1;
+	/* The buffer grew by doubling, keep only the value */
+	decoded->len = buf.len;
+	memcpy(decoded->data, buf.data, buf.len + 1);
+	free(buf.data);
 
-	while (1) {
-		/* Skip comments and whitespace */
-		while (skip_comments(st)) {
-			line_num++;
-		}
+	/* Decoding fills an entry its readers see as const */
+	EntryDecoded *expected = NULL;
+	if (!__atomic_compare_exchange_n(&((ConfigEntry *)entry)->u.ptr.decoded, &expected, decoded, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(decoded);
+		decoded = expected;
+	}
 
-		/* Check for section */
-		char *section_name = read_section(st);
-		if (section_name) {
-			if (!config_add_section(config, section_name)) {
-				cparse_set_error(st, "Failed to add section: %s", section_name);
-				free(section_name);
-				config_free(config);
-				free(config);
-				return NULL;
-			}
-			free(section_name);
-			continue;
-		}
+	return decoded;
+}
 
-		/* Parse key-value pair */
-		if (parse_config_entry(st, config, &line_num)) {
-			/* Entry successfully added */
-		} else {
-			/* Check for end of input */
-			int ch = cparse_peek(st);
-			if (ch == EOF) break;
-
-			/* Report errors and skip line */
-			if (strlen(glb_err_buf) > 0) {
-				fprintf(stderr, "Error at line %d: %s\n", line_num, glb_err_buf);
-				memset(glb_err_buf, 0, MAX_ERRBUF);
-				
-				/* Skip erroneous line */
-				while ((ch = cparse_getc(st)) != EOF && ch != '\n') {
-					/* Skip characters */
-				}
-				if (ch == '\n') line_num++;
-			}
-		}
-	}
+// ==================== Pointer Map ====================
 
-	return config;
+/**
+ * Hash a pointer into a slot index
+ */
+static size_t map_slot(uintptr_t key, size_t capacity)
+{
+	return (size_t)(((uint64_t)(key >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
 }
 
 /**
- * Free configuration memory
+ * Get value stored for KEY, NULL if none
  */
-void cparse_free(Config *config)
+void *cparse_map_get(const CPMap *map, const void *key)
 {
-	if (config) {
-		config_free(config);
-		free(config);
+	if (!map || map->capacity == 0) return NULL;
+
+	size_t i = map_slot((uintptr_t)key, map->capacity);
+	while (map->keys[i]) {
+		if (map->keys[i] == (uintptr_t)key) {
+			return map->values[i];
+		}
+		i = (i + 1) & (map->capacity - 1);
 	}
-}
 
-// ==================== Configuration Query ====================
+	return NULL;
+}
 
 /**
- * Read value from specified section and key. Returns NULL if not found
+ * Store VALUE for KEY, replacing an old value
  */
-const char *cparse_read(const Config *config, const char *section, const char *key)
+int cparse_map_put(CPMap *map, const void *key, void *value)
 {
-	if (!config || !key) return NULL;
+	if (!map || !key) return 0;
 
-	/* If section is NULL, search in all sections */
-	const ConfigSection *current_section = config->sections;
+	/* Keep the load factor under 1/2 */
+	if ((map->count + 1) * 2 > map->capacity) {
+		CPMap grown = { NULL, NULL, 0, map->capacity ? map->capacity * 2 : 16 };
 
-	while (current_section) {
-		/* If specific section is requested, skip non-matching sections */
-		if (section && (!current_section->name || strcmp(current_section->name, section) != 0)) {
-			current_section = current_section->next;
-			continue;
+		grown.keys = calloc(grown.capacity, sizeof(uintptr_t));
+		grown.values = calloc(grown.capacity, sizeof(void *));
+		if (!grown.keys || !grown.values) {
+			free(grown.keys);
+			free(grown.values);
+			return 0;
 		}
 
-		/* Search for key in current section */
-		const ConfigEntry *entry = current_section->entries;
-		while (entry) {
-			if (entry->key && strcmp(entry->key, key) == 0) {
-				return entry->value;
+		for (size_t i = 0; i < map->capacity; i++) {
+			if (map->keys[i]) {
+				cparse_map_put(&grown, (void *)map->keys[i], map->values[i]);
 			}
-			entry = entry->next;
 		}
 
-		/* If specific section was requested, we're done after checking it */
-		if (section) break;
+		cparse_map_free(map);
+		*map = grown;
+	}
+
+	size_t i = map_slot((uintptr_t)key, map->capacity);
+	while (map->keys[i] && map->keys[i] != (uintptr_t)key) {
+		i = (i + 1) & (map->capacity - 1);
+	}
 
-		current_section = current_section->next;
+	if (!map->keys[i]) {
+		map->keys[i] = (uintptr_t)key;
+		map->count++;
 	}
-	
-	return NULL; /* Key not found */
+	map->values[i] = value;
+
+	return 1;
+}
+
+/**
+ * Free map storage, values are owned by the caller
+ */
+void cparse_map_free(CPMap *map)
+{
+	if (!map) return;
+
+	free(map->keys);
+	free(map->values);
+	memset(map, 0, sizeof(CPMap));
 }
 
 /**
@@ -10,6 +10,9 @@
 #endif // _STDIO_H
 
 #include <sys/types.h> // For off_t
+#include <sys/uio.h>   // For struct iovec
+#include <stdint.h>
+#include <string.h>
 
 #if !defined(NO_TRACE)
 # define TRACE(...) do { \
@@ -23,6 +26,23 @@
 #define MAX_ERRBUF 512
 #define INITIAL_BUFFER_SIZE 64
 #define BUFFER_GROWTH_FACTOR 2
+#define READ_CHUNK_SIZE 65536
+#define POOL_MAX_THREADS 16
+#define INCLUDE_MAX_THREADS 4
+#define DIRECTORY_MAX_THREADS 16
+#define DIRECTORY_PATTERN "*.conf"
+#define DIAG_DEFAULT_LIMIT 100 /* Diagnostics kept per parse */
+#define EMIT_FLUSH_SIZE 4096   /* Output passed to a sink at a time */
+#define BUILD_SHARDS 64
+#define BUILD_MAX_THREADS 16
+#define SECTION_TABLE_MIN 8    /* Sections searched in a list up to here */
+#define ENTRY_INLINE_SIZE 24    /* Key and value with their NULs */
+#define ENTRY_MAX_KEY 65535     /* Longest key, KEY_LEN is 16 bits */
+#define ARENA_MIN_CHUNK 1024
+#define ARENA_MAX_CHUNK 65536
+#define INCLUDE_KEY "include"
+#define WRITE_IOV_MAX 1024     /* Buffers per writev(), Linux UIO_MAXIOV */
+#define CACHE_DEFAULT_BUDGET ((size_t)64 << 20) /* Memory of the file cache */
 
 #if !defined(__CPState_defined)
 typedef struct
@@ -34,38 +54,461 @@ typedef struct
 	} type;
 
 	char *str;
+	size_t len;       /* Of STR, 0: up to its NUL */
 	int fd;
 	off_t off;
+	const char *path; /* Source file, used to resolve includes */
+	unsigned flags;   /* XC_* parse flags */
 } CPState;
 #define __CPState_defined
 #endif /* __CPState_defined */
 
+#if !defined(__XConfigCallbacks_defined)
+/* Event callbacks, views are NUL-terminated and valid during the call.
+ * Return non-zero to stop parsing. */
+typedef struct
+{
+	int (*on_section)(void *user, const char *name, size_t len);
+	int (*on_entry)(void *user, const char *key, size_t key_len,
+			const char *value, size_t value_len);
+	int (*on_error)(void *user, int line, const char *msg, size_t len);
+} XConfigCallbacks;
+#define __XConfigCallbacks_defined
+#endif /* __XConfigCallbacks_defined */
+
+#if !defined(__XConfigLoadStat_defined)
+/* Per-file timing of XConfig_ParseDirectory() */
+typedef struct
+{
+	const char *file;   /* File name inside the directory */
+	uint64_t read_ns;   /* Open and read */
+	uint64_t parse_ns;  /* Parse, including its includes */
+} XConfigLoadStat;
+#define __XConfigLoadStat_defined
+#endif /* __XConfigLoadStat_defined */
+
+#if !defined(__XConfigDiag_defined)
+/* Malformed line found by a parse, see XConfig_GetDiagnostics() */
+typedef struct
+{
+	int line;
+	int column;          /* 1-based byte column */
+	int code;            /* XC_DIAG_* */
+	uint32_t message;    /* Offset of the message in the diagnostics text */
+} XConfigDiag;
+#define __XConfigDiag_defined
+#endif /* __XConfigDiag_defined */
+
+#if !defined(__XConfigViolation_defined)
+/* Schema violation found by XConfig_Validate() */
+typedef struct
+{
+	int kind;            /* XC_VIOLATION_* */
+	const char *section;
+	const char *key;     /* NULL when about the section */
+	const char *value;   /* Offending value, NULL if missing */
+	int line;            /* Entry or section header, 0 if unknown */
+} XConfigViolation;
+#define __XConfigViolation_defined
+#endif /* __XConfigViolation_defined */
+
+#if !defined(__XConfigScanFn_defined)
+/* Key scan callback, return non-zero to stop the scan */
+typedef int (*XConfigScanFn)(void *user, const char *key, const char *value);
+#define __XConfigScanFn_defined
+#endif /* __XConfigScanFn_defined */
+
+#if !defined(__XConfigKV_defined)
+/* Key-value pair of XConfig_AddKeyValues() */
+typedef struct
+{
+	const char *key;
+	const char *value;
+} XConfigKV;
+#define __XConfigKV_defined
+#endif /* __XConfigKV_defined */
+
+#if !defined(__XConfigStr_defined)
+/* Element of XConfig_ReadList(), not NUL-terminated */
+typedef struct
+{
+	const char *ptr;
+	size_t len;
+} XConfigStr;
+#define __XConfigStr_defined
+#endif /* __XConfigStr_defined */
+
+#if !defined(__XConfigDiffFn_defined)
+/* Diff callback, OLD is NULL for an added key and NEW for a removed
+ * one. Return non-zero to stop the diff */
+typedef int (*XConfigDiffFn)(void *user, int kind, const char *section, const char *key,
+				const char *old_value, const char *new_value);
+#define __XConfigDiffFn_defined
+#endif /* __XConfigDiffFn_defined */
+
+#if !defined(__XConfigConflictFn_defined)
+/* Merge conflict callback, a NULL value is a missing key. Return
+ * non-zero to give up the merge */
+typedef int (*XConfigConflictFn)(void *user, const char *section, const char *key,
+				const char *base, const char *ours, const char *theirs);
+#define __XConfigConflictFn_defined
+#endif /* __XConfigConflictFn_defined */
+
+#if !defined(__XConfigSink_defined)
+/* Output of XConfig_Emit(): WRITE if set, else the file descriptor FD.
+ * WRITE returns non-zero to stop the output */
+typedef struct
+{
+	int fd;
+	int (*write)(void *user, const char *data, size_t len);
+	void *user;
+} XConfigSink;
+#define __XConfigSink_defined
+#endif /* __XConfigSink_defined */
+
+#if !defined(__XConfigCacheStats_defined)
+/* Counters of the file cache, see XConfig_ParseFileCached() */
+typedef struct
+{
+	uint64_t hits;       /* Opens that found the file unchanged */
+	uint64_t misses;     /* Opens that parsed it */
+	uint64_t evictions;  /* Files dropped to stay within the budget */
+	size_t entries;      /* Files cached now */
+	size_t bytes;        /* Their memory, as charged to the budget */
+	size_t budget;
+} XConfigCacheStats;
+#define __XConfigCacheStats_defined
+#endif /* __XConfigCacheStats_defined */
+
+#if !defined(__XConfigFingerprint_defined)
+/* 128-bit content hash, see XConfig_Fingerprint() */
+typedef struct
+{
+	uint64_t hi;
+	uint64_t lo;
+} XConfigFingerprint;
+#define __XConfigFingerprint_defined
+#endif /* __XConfigFingerprint_defined */
+
+/* Receives blocks of output, returns 0 to stop */
+typedef int (*CPBlockFn)(void *user, const char *data, size_t len);
+
+/* Growable byte buffer, always NUL-terminated when non-empty */
+typedef struct
+{
+	char *data;
+	size_t len;
+	size_t size;
+} CPBuf;
+
+/* Streaming lexer, input may be fed in arbitrary chunks */
+typedef struct
+{
+	int state;
+	int line;
+	char quote;         /* Quote of the current key or value */
+	CPBuf key;          /* Key, or section name */
+	CPBuf value;
+	const XConfigCallbacks *cb;
+	void *user;
+	int stopped;        /* A callback asked to stop */
+	size_t offset;      /* Input consumed before the current chunk */
+	size_t line_start;  /* Offset of the current line */
+	size_t token_start; /* Line of the current entry or section header */
+	int token_line;     /* Its line number */
+	size_t value_start; /* Value, opening quote included */
+	size_t value_end;   /* Past the value, or past ']' of a section */
+	int raw;            /* Keep quoted values undecoded, see ENTRY_ENCODED */
+	int escaped;        /* The raw value has escapes or continued lines */
+	int error_code;     /* DIAG_* of the error being reported */
+	int error_column;
+} CPLexer;
+
 typedef struct ConfigEntry ConfigEntry;
 typedef struct ConfigSection ConfigSection;
 typedef struct Config Config;
 
+/* Incremental configuration builder fed with raw input */
+typedef struct
+{
+	CPLexer lexer;
+	Config *config;
+	CPBuf decoded;      /* Escaped value decoded for the fingerprint */
+	int failed;
+} CPLoader;
+typedef struct ConfigInterp ConfigInterp;
+typedef struct ConfigImage ConfigImage;
+typedef struct ConfigKeyTable ConfigKeyTable;
+typedef struct ConfigSectionTable ConfigSectionTable;
+typedef struct ConfigSchema ConfigSchema;
+typedef struct ConfigLazy ConfigLazy;
+typedef struct ConfigBuilder ConfigBuilder;
+typedef struct ConfigLists ConfigLists;
+typedef struct ConfigCacheNode ConfigCacheNode;
+
+/* Keys of a section in strcmp() order, repeated keys once */
+typedef struct
+{
+	size_t count;
+	ConfigEntry *entries[];
+} ConfigIndex;
+typedef struct ConfigChunk ConfigChunk;
+
+/* Diagnostics of the parses that built a config */
+typedef struct
+{
+	XConfigDiag *records;
+	size_t count;         /* Kept, at most LIMIT */
+	size_t size;
+	size_t total;         /* Reported, kept or not */
+	size_t limit;
+	CPBuf text;           /* Messages, each NUL-terminated */
+} ConfigDiags;
+
+/* Config flags, must match XC_* in xconfig.h */
+#define CONFIG_INTERPOLATE 0x1
+#define CONFIG_PRESERVE 0x2
+#define CONFIG_ICASE 0x4
+#define CONFIG_LINES 0x8
+#define CONFIG_LAZY 0x10
+#define CONFIG_DEFER_ESCAPES 0x20
+#define CONFIG_FAIL_FAST 0x40
+#define CONFIG_DIR_STRICT 0x100
+
+/* Entry flags */
+#define ENTRY_REFS 0x1       /* Value contains ${...} references */
+#define ENTRY_INLINE 0x2     /* Key and value are stored in the node */
+#define ENTRY_VALUE_HEAP 0x4 /* Value was malloc'ed by an update */
+#define ENTRY_SPAN 0x8       /* Node is followed by its ConfigSpan */
+#define ENTRY_DIRTY 0x10     /* Value changed since it was parsed */
+#define ENTRY_HASH 0x20      /* Folded key hash follows the node (and span) */
+#define ENTRY_LINE 0x40      /* Source line follows the node (span and hash) */
+#define ENTRY_ENCODED 0x80   /* Value is the raw quoted text, decoded on read */
+
+/* Schema types, flags and violation kinds, must match XC_TYPE_*,
+ * XC_SCHEMA_* and XC_VIOLATION_* in xconfig.h */
+#define SCHEMA_STRING 0
+#define SCHEMA_INT 1
+#define SCHEMA_FLOAT 2
+#define SCHEMA_BOOL 3
+#define SCHEMA_STRICT 0x1
+#define VIOLATION_MISSING 1
+#define VIOLATION_UNKNOWN 2
+#define VIOLATION_TYPE 3
+#define VIOLATION_RANGE 4
+#define VIOLATION_ENUM 5
+
+/* Diagnostic codes, must match XC_DIAG_* in xconfig.h */
+#define DIAG_SECTION 1
+#define DIAG_KEY_QUOTE 2
+#define DIAG_EQUALS 3
+#define DIAG_VALUE_QUOTE 4
+#define DIAG_KEY_LENGTH 5
+
+/* Diff kinds, must match XC_DIFF_* in xconfig.h */
+#define DIFF_ADDED 1
+#define DIFF_REMOVED 2
+#define DIFF_CHANGED 3
+
+/* Output formats, must match XC_EMIT_* in xconfig.h */
+#define EMIT_INI 0
+#define EMIT_JSON 1
+#define EMIT_ENV 2
+
+/* Compression of an input, told by its first bytes */
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1    /* Built with XCONFIG_ZLIB */
+#define COMPRESS_ZSTD 2    /* Built with XCONFIG_ZSTD */
+#define COMPRESS_MAGIC_SIZE 4
+
+/* Where an entry (or section header) is in its source text */
+typedef struct
+{
+	uint32_t line_start;
+	uint32_t value_start; /* Opening quote included */
+	uint32_t value_end;   /* Closing quote included, or past ']' */
+} ConfigSpan;
+
+/* Value of an ENTRY_ENCODED entry once decoded, with its length */
+typedef struct
+{
+	size_t len;
+	char data[];
+} EntryDecoded;
+
+/* 40 bytes on 64-bit. Nodes and strings come from the config's arena,
+ * so a short pair such as 'port = 8080' costs one node and no malloc. */
 struct ConfigEntry
 {
-	char *key;
-	char *value;
 	ConfigEntry *next;
+	uint32_t value_len;
+	uint16_t key_len;
+	uint16_t flags;
+	union
+	{
+		char data[ENTRY_INLINE_SIZE]; /* key '\0' value '\0' */
+		struct
+		{
+			char *key;
+			char *value;
+			EntryDecoded *decoded; /* ENTRY_ENCODED: VALUE decoded, on first read */
+		} ptr;
+	} u;
 };
 
+/* Bump allocator chunk, never moved or freed before the config */
+struct ConfigChunk
+{
+	ConfigChunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+/* Key of an entry */
+static inline const char *entry_key(const ConfigEntry *entry)
+{
+	return (entry->flags & ENTRY_INLINE) ? entry->u.data : entry->u.ptr.key;
+}
+
+/* Decoded value of an ENTRY_ENCODED entry, memoized */
+const EntryDecoded *cparse_entry_decode(const ConfigEntry *entry);
+
+/* Value of an entry, NUL-terminated but may hold NULs, see entry_value_len() */
+static inline const char *entry_value(const ConfigEntry *entry)
+{
+	if (entry->flags & ENTRY_INLINE) return entry->u.data + entry->key_len + 1;
+	if (entry->flags & ENTRY_ENCODED) {
+		const EntryDecoded *decoded = cparse_entry_decode(entry);
+		return decoded ? decoded->data : NULL;
+	}
+	return entry->u.ptr.value;
+}
+
+/* Length of entry_value(), VALUE_LEN is the raw length while encoded */
+static inline size_t entry_value_len(const ConfigEntry *entry)
+{
+	if (!(entry->flags & ENTRY_ENCODED)) return entry->value_len;
+
+	const EntryDecoded *decoded = cparse_entry_decode(entry);
+	return decoded ? decoded->len : 0;
+}
+
+/* First "${" in the LEN bytes of VALUE, NULL if none */
+static inline const char *cparse_find_ref(const char *value, size_t len)
+{
+	const char *end = value + len;
+
+	for (const char *p = value; p + 1 < end; p++) {
+		p = memchr(p, '$', end - p - 1);
+		if (!p) break;
+		if (p[1] == '{') return p;
+	}
+	return NULL;
+}
+
+/* Source span of an entry, NULL if it was not parsed with CONFIG_PRESERVE */
+static inline const ConfigSpan *entry_span(const ConfigEntry *entry)
+{
+	return (entry->flags & ENTRY_SPAN) ? (const ConfigSpan *)(entry + 1) : NULL;
+}
+
+/* Folded key hash, stored for CONFIG_ICASE */
+static inline uint32_t entry_hash(const ConfigEntry *entry)
+{
+	const char *tail = (const char *)(entry + 1) +
+		((entry->flags & ENTRY_SPAN) ? sizeof(ConfigSpan) : 0);
+	uint32_t hash;
+
+	memcpy(&hash, tail, sizeof(hash));
+	return hash;
+}
+
+/* Source line of an entry, 0 unless parsed with CONFIG_LINES */
+static inline int entry_line(const ConfigEntry *entry)
+{
+	if (!(entry->flags & ENTRY_LINE)) return 0;
+
+	const char *tail = (const char *)(entry + 1) +
+		((entry->flags & ENTRY_SPAN) ? sizeof(ConfigSpan) : 0) +
+		((entry->flags & ENTRY_HASH) ? sizeof(uint32_t) : 0);
+	uint32_t line;
+
+	memcpy(&line, tail, sizeof(line));
+	return (int)line;
+}
+
+/* Section flags */
+#define SECTION_INCLUDE 0x1 /* Placeholder holding include directives */
+#define SECTION_SPAN 0x2    /* Header was parsed, SPAN is valid */
+#define SECTION_LAZY 0x4    /* Entries not parsed yet, see section_ready() */
+#define SECTION_MERGED 0x8  /* Entries moved to a section of another builder stage */
+
 struct ConfigSection
 {
 	char *name;
+	size_t name_size;     /* Allocated for NAME, kept by a reused section */
 	ConfigEntry *entries;
+	ConfigEntry *last_entry; /* Tail of ENTRIES */
 	ConfigSection *next;
+	int flags;
+	ConfigSpan span;
+	ConfigIndex *index;   /* Sorted keys, built by the first scan */
+	ConfigKeyTable *keys; /* Hashed keys, built by the first hashed read */
+	uint32_t name_hash;   /* cparse_fold_hash() of the name */
+	XConfigFingerprint fp_name; /* Hash of the name, see cparse_fp_name() */
+	uint64_t fp_last;     /* Key hash of LAST_ENTRY, 0 when empty */
+	int line;             /* Header line, 0 if not parsed */
+	size_t body_start;    /* Unparsed entries in the source, SECTION_LAZY */
+	size_t body_end;
 };
 
 struct Config
 {
 	ConfigSection *sections;
+	ConfigSection *last_section; /* Tail of SECTIONS */
 	ConfigSection *current_section;
 	size_t entry_count;
 	size_t section_count;
+	size_t include_count;
+	unsigned flags;
+	ConfigInterp *interp; /* Interpolation state, created on demand */
+	ConfigChunk *arena;   /* Entries and their strings */
+	XConfigLoadStat *load_stats; /* Set by cparse_load_directory() */
+	size_t load_stat_count;
+	ConfigSpan *removed;  /* Parsed entries removed since, CONFIG_PRESERVE */
+	size_t removed_count;
+	size_t removed_capacity;
+	const ConfigImage *image; /* Attached read-only image, no sections then */
+	size_t image_size;
+	ConfigLazy *lazy;     /* Source of unparsed sections, CONFIG_LAZY */
+	ConfigSectionTable *section_table; /* Sections by name, built by a lookup */
+	ConfigDiags diags;    /* Malformed lines, in source order */
+	ConfigLists *lists;   /* Split list values, created by the first list read */
+	ConfigSection *spare_sections; /* Emptied by cparse_reset(), reused by adds */
+	ConfigCacheNode *cache; /* Shared through the file cache, read-only then */
+	XConfigFingerprint fingerprint; /* Sum of the terms of every section and entry */
 };
 
+/* Parse the entries of a CONFIG_LAZY section on first use */
+int cparse_lazy_section(const Config *config, ConfigSection *section);
+
+/* Check that the entries of SECTION are parsed, parsing them if needed */
+static inline int section_ready(const Config *config, ConfigSection *section)
+{
+	if (!(__atomic_load_n(&section->flags, __ATOMIC_ACQUIRE) & SECTION_LAZY)) return 1;
+	return cparse_lazy_section(config, section);
+}
+
+/* Open addressing map from pointers to pointers */
+typedef struct
+{
+	uintptr_t *keys;
+	void **values;
+	size_t count;
+	size_t capacity;
+} CPMap;
+
 /* Initialize parser state */
 void cparse_init(CPState *state, int from, int fd, const char *str);
 
@@ -75,11 +518,279 @@ ConfigSection *config_add_section(Config *config, const char *name);
 /* Add key-value pair to current section */
 int config_add_entry(Config *config, const char *key, const char *value);
 
+/* Add key and the VALUE_LEN bytes of VALUE, NULs included */
+int config_add_entry_len(Config *config, const char *key, const char *value, size_t value_len);
+
+/* Add key-value pair with its source span and line to current section,
+ * DECODED if VALUE is the raw text of a quoted value with escapes */
+int config_add_entry_at(Config *config, const char *key, size_t key_len,
+			const char *value, size_t value_len,
+			const ConfigSpan *span, int line, const CPBuf *decoded);
+
+/* Unlink an entry from SECTION */
+int config_remove_entry(Config *config, ConfigSection *section, ConfigEntry *entry);
+
+/* Append a batch of pairs to the current section in one block */
+int config_add_entries(Config *config, const XConfigKV *kvs, size_t count);
+
+/* Preallocate for sections and entries about to be added */
+int config_reserve(Config *config, size_t sections, size_t entries, size_t bytes);
+
+/* Replace the value of an existing entry with VALUE_LEN bytes */
+int config_set_value(Config *config, const ConfigSection *section, ConfigEntry *entry,
+			const char *value, size_t value_len);
+
+/* Find a section by name */
+ConfigSection *config_find_section(const Config *config, const char *name);
+
+/* Find the first entry of SECTION named KEY */
+ConfigEntry *config_find_entry(const Config *config, const ConfigSection *section, const char *key);
+
+/* Compare section names, ignoring ASCII case with CONFIG_ICASE */
+int config_name_equal(const Config *config, const char *a, const char *b);
+
+/* Compare keys in scan order, ignoring ASCII case with CONFIG_ICASE */
+int config_key_compare(const Config *config, const char *a, const char *b, size_t n);
+
+/* ASCII case folding, 16 bytes at a time where SSE2 is available */
+void cparse_fold(char *dst, const char *src, size_t len);
+uint32_t cparse_fold_hash(const char *str, size_t len);
+int cparse_fold_equal(const char *a, const char *b, size_t len);
+
+/* Merge a section into DST, later values win unless STRICT */
+int config_merge_section(Config *dst, const ConfigSection *src, int strict);
+
+/* Parse [START, END) of SOURCE, starting at LINE, into SECTION */
+int cparse_load_range(Config *config, ConfigSection *section, const char *source,
+			size_t start, size_t end, int line);
+
+/* Index the section headers of STATE's string, parse sections on use */
+Config *cparse_lazy_load(CPState *state);
+
+/* Parse every section a CONFIG_LAZY config has not parsed yet */
+int cparse_lazy_load_all(const Config *config);
+
+/* Free the lazy parsing state of CONFIG */
+void cparse_lazy_free(Config *config);
+
 /* Main configuration parsing function */
 Config *cparse_load(CPState *state);
 
-/* Read value from specified section and key. Returns NULL if not found */
-const char *cparse_read(const Config *config, const char *section, const char *key);
+/* Parse configuration without resolving include directives */
+Config *cparse_parse(CPState *state);
+
+/* Feed STATE's input through the lexer into callbacks */
+int cparse_events(CPState *state, const XConfigCallbacks *cb, void *user);
+
+/* Append LEN bytes to BUF, keeping it NUL-terminated */
+int cparse_buf_append(CPBuf *buf, const char *data, size_t len);
+
+/* Append the raw text RAW of a quoted value to OUT, decoded as lexed */
+int cparse_unescape(CPBuf *out, const char *raw, size_t len);
+
+/* Incremental configuration builder */
+int cparse_loader_init(CPLoader *loader, unsigned flags);
+int cparse_loader_feed(CPLoader *loader, const char *data, size_t len);
+Config *cparse_loader_finish(CPLoader *loader);
+void cparse_loader_free(CPLoader *loader);
+
+/* Parse a whole document into the loader's own config, reusing the
+ * memory of the previous one */
+Config *cparse_loader_parse(CPLoader *loader, const char *data, size_t len, unsigned flags);
+
+/* Empty CONFIG for another parse, keeping its memory */
+void cparse_reset(Config *config);
+
+/* Streaming lexer */
+void cparse_lexer_init(CPLexer *lexer, const XConfigCallbacks *cb, void *user);
+int cparse_lexer_feed(CPLexer *lexer, const char *data, size_t len);
+int cparse_lexer_finish(CPLexer *lexer);
+void cparse_lexer_free(CPLexer *lexer);
+
+/* Resolve include directives of CONFIG, consumes CONFIG */
+Config *cparse_include_resolve(Config *config, const char *path);
+
+/* Load all files of DIR matching PATTERN into one configuration */
+Config *cparse_load_directory(const char *dir, const char *pattern, unsigned flags);
+
+/* Read a whole file into a NUL-terminated buffer, decompressed */
+char *cparse_read_file(const char *path, size_t *length);
+char *cparse_read_fd(int fd, size_t *length);
+
+/* gzip and zstd input, see COMPRESS_* */
+int cparse_compression(const void *head, size_t len);
+int cparse_fd_compression(int fd);
+int cparse_decompress(int fd, const void *head, size_t len, int kind, CPBlockFn fn, void *user);
+char *cparse_decompress_all(int fd, const void *head, size_t len, int kind, size_t *length);
+
+/* Write COUNT buffers to PATH through a temporary file and rename() */
+int cparse_write_file(const char *path, const struct iovec *iov, size_t count);
+int cparse_write_stream(const char *path, int (*fn)(void *user, int fd), void *user);
+
+/* Check that a section NAME can be written as "[NAME]" */
+int cparse_check_section_name(const char *name);
+
+/* Append 'key = "value"' in the parser's syntax, escapes included */
+int cparse_format_entry(CPBuf *buf, const ConfigEntry *entry);
+
+/* Save CONFIG parsed from SOURCE to PATH, rewriting only what changed */
+int cparse_save(const Config *config, const char *source, size_t len, const char *path);
+
+/* Run FN(ARG, 0..COUNT-1) on up to MAX_THREADS worker threads */
+void cparse_pool_run(size_t count, unsigned max_threads,
+			void (*fn)(void *arg, size_t index), void *arg);
+
+/* Find entry by section and key, stores its section in WHERE */
+ConfigEntry *cparse_find(const Config *config, const char *section,
+			const char *key, ConfigSection **where);
+
+/* Read value from specified section and key, its length in LEN if
+ * not NULL. Returns NULL if not found */
+const char *cparse_read(Config *config, const char *section, const char *key, size_t *len);
+
+/* Value of ENTRY in SECTION as read, references expanded */
+const char *cparse_entry_value(Config *config, ConfigSection *section, ConfigEntry *entry,
+				size_t *len);
+
+/* Visit keys of SECTION in order, by prefix or in [FROM, TO) */
+int cparse_scan(Config *config, const char *section, const char *from, const char *to,
+		int prefix, XConfigScanFn fn, void *user);
+
+/* Find entry by precomputed cparse_fold_hash() of section and key */
+ConfigEntry *cparse_find_hashed(Config *config, const char *section, uint32_t section_hash,
+				const char *key, uint32_t key_hash, ConfigSection **where);
+
+/* Find KEY by its cparse_fold_hash() in SECTION's key table */
+ConfigEntry *cparse_section_find(const Config *config, ConfigSection *section,
+				const char *key, size_t len, uint32_t hash);
+
+/* Drop the sorted and hashed keys of SECTION */
+void cparse_index_invalidate(ConfigSection *section);
+
+/* Empty the tables of a reset config in place, see cparse_reset() */
+void cparse_index_clear(Config *config, ConfigSection *section);
+
+/* Update the key tables of SECTION after ENTRY was appended */
+void cparse_index_added(const Config *config, ConfigSection *section, ConfigEntry *entry);
+
+/* Find a section by name through the section table */
+ConfigSection *cparse_index_section(const Config *config, const char *name, uint32_t hash);
+void cparse_index_section_added(Config *config, ConfigSection *section);
+int cparse_index_reserve_sections(Config *config, size_t capacity);
+
+/* Position of the first pair of KVS whose key SECTION or an earlier
+ * pair has, COUNT if none, (size_t)-1 on error */
+size_t cparse_index_find_taken(const Config *config, ConfigSection *section,
+				const XConfigKV *kvs, size_t count);
+
+/* Export CONFIG as a sealed memfd image, returns the descriptor */
+int cparse_image_export(Config *config);
+
+/* Map a sealed image read-only */
+Config *cparse_image_attach(int fd);
+
+/* Read a value and its length from an attached image */
+const char *cparse_image_read(const ConfigImage *image, const char *section, const char *key,
+				size_t *len);
+
+/* Fingerprint of the config an image was exported from */
+void cparse_image_fingerprint(const ConfigImage *image, XConfigFingerprint *fp);
+
+/* Unmap the image of CONFIG */
+void cparse_image_free(Config *config);
+
+/* Schema declarations, compiled once and then read-only */
+ConfigSchema *cparse_schema_new(unsigned flags);
+int cparse_schema_section(ConfigSchema *schema, const char *section, int required);
+int cparse_schema_key(ConfigSchema *schema, const char *section, const char *key,
+			int type, int required);
+int cparse_schema_range(ConfigSchema *schema, const char *section, const char *key,
+			double min, double max);
+int cparse_schema_enum(ConfigSchema *schema, const char *section, const char *key,
+			const char *const *values, size_t count);
+int cparse_schema_compile(ConfigSchema *schema);
+void cparse_schema_free(ConfigSchema *schema);
+
+/* Check CONFIG against a compiled SCHEMA in one pass */
+int cparse_validate(Config *config, const ConfigSchema *schema,
+			XConfigViolation **violations, size_t *count);
+
+/* Concurrent builder, one lock-free stage per producer thread */
+ConfigBuilder *cparse_builder_new(unsigned flags, unsigned producers);
+int cparse_builder_add(ConfigBuilder *builder, unsigned producer, const char *section,
+			const char *key, const char *value);
+Config *cparse_builder_freeze(ConfigBuilder *builder);
+void cparse_builder_free(ConfigBuilder *builder);
+
+/* Keys that differ between A and B, by stored value */
+int cparse_diff(Config *a, Config *b, XConfigDiffFn fn, void *user);
+
+/* Three-way merge of the changes from BASE to OURS and THEIRS */
+Config *cparse_merge3(Config *base, Config *ours, Config *theirs,
+			XConfigConflictFn fn, void *user);
+
+/* Write CONFIG to SINK as EMIT_*, through a buffer of bounded size */
+int cparse_emit(Config *config, int format, const XConfigSink *sink);
+
+/* Create interpolation state */
+int cparse_interp_init(Config *config);
+
+/* Expanded value of an entry with references and its length, memoized */
+const char *cparse_interp_value(Config *config, ConfigSection *section, ConfigEntry *entry,
+				size_t *len);
+
+/* Drop memoized expansions depending on ENTRY */
+void cparse_interp_invalidate(Config *config, ConfigEntry *entry);
+
+/* Free interpolation state */
+void cparse_interp_free(Config *config);
+
+/* Elements of a value as an array of XConfigStr, int64_t or double */
+const void *cparse_list_read(Config *config, const char *section, const char *key,
+				int type, size_t *count);
+
+/* Drop the elements split from ENTRY's value */
+void cparse_list_invalidate(Config *config, ConfigEntry *entry);
+
+/* Free list state */
+void cparse_list_free(Config *config);
+
+/* Config of the file at PATH, shared and unparsed while it is unchanged */
+Config *cparse_cache_open(const char *path, unsigned flags);
+
+/* Drop a reference taken by cparse_cache_open() */
+void cparse_cache_release(Config *config);
+
+/* Limit the memory of cached files, evicting the least recently used */
+void cparse_cache_set_budget(size_t bytes);
+
+/* Counters and size of the file cache */
+void cparse_cache_stats(XConfigCacheStats *stats);
+
+/* Drop every cached file, configs still open stay valid */
+void cparse_cache_clear(void);
+
+/* Fingerprint terms, kept up to date by the adds, updates and removals */
+void cparse_fp_name(ConfigSection *section);
+void cparse_fp_section(XConfigFingerprint *fp, const ConfigSection *prev,
+			const ConfigSection *section, int sign);
+void cparse_fp_entry_added(Config *config, ConfigSection *section, const ConfigEntry *entry,
+			const CPBuf *decoded);
+XConfigFingerprint cparse_fp_value(const ConfigSection *section, const ConfigEntry *entry);
+void cparse_fp_apply(Config *config, XConfigFingerprint term, int sign);
+void cparse_fp_entry_removed(Config *config, ConfigSection *section,
+			const ConfigEntry *prev, const ConfigEntry *entry);
+
+/* Adjust FP for appending the entries of SECTION to FIRST */
+void cparse_fp_splice(XConfigFingerprint *fp, ConfigSection *first, const ConfigSection *section);
+
+/* 128-bit content hash of CONFIG, O(1) once it is parsed */
+int cparse_fingerprint(const Config *config, XConfigFingerprint *fp);
+
+/* Pointer map helpers */
+void *cparse_map_get(const CPMap *map, const void *key);
+int cparse_map_put(CPMap *map, const void *key, void *value);
+void cparse_map_free(CPMap *map);
 
 /* Clean up parser resources */
 void cparse_cleanup(CPState *st);
@@ -93,4 +804,11 @@ const char *cparse_get_error(void);
 /* Set error message */
 void cparse_set_error(CPState *st, const char *msg, ...);
 
+/* Diagnostics kept per parse started by the calling thread */
+void cparse_set_diag_limit(size_t limit);
+size_t cparse_get_diag_limit(void);
+
+/* Append the diagnostics of SRC to DST, messages prefixed with FILE */
+int cparse_diag_merge(Config *dst, const Config *src, const char *file);
+
 #endif
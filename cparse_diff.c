@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* First section of each name of a config, by name hash */
+typedef struct
+{
+	const Config *config;
+	ConfigSection **slots;
+	size_t size;          /* Power of two, at least twice the sections */
+} DiffSections;
+
+// ==================== Helpers ====================
+
+/**
+ * Find the first section named NAME
+ */
+static ConfigSection *sections_find(const DiffSections *map, const char *name, uint32_t hash)
+{
+	size_t mask = map->size - 1;
+
+	for (size_t i = hash & mask; map->slots[i]; i = (i + 1) & mask) {
+		ConfigSection *cs = map->slots[i];
+		if (cs->name_hash == hash && config_name_equal(map->config, cs->name, name)) {
+			return cs;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Map the sections of CONFIG, reads only see the first of a name
+ */
+static int sections_build(DiffSections *map, const Config *config)
+{
+	size_t size = 16;
+	while (size < config->section_count * 2) size *= 2;
+
+	map->config = config;
+	map->size = size;
+	map->slots = calloc(size, sizeof(ConfigSection *));
+	if (!map->slots) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (sections_find(map, cs->name, cs->name_hash)) continue;
+
+		size_t i = cs->name_hash & (size - 1);
+		while (map->slots[i]) i = (i + 1) & (size - 1);
+		map->slots[i] = cs;
+	}
+
+	return 1;
+}
+
+/**
+ * Folded hash of an entry's key, stored for CONFIG_ICASE
+ */
+static uint32_t diff_hash(const ConfigEntry *entry)
+{
+	return (entry->flags & ENTRY_HASH) ? entry_hash(entry)
+		: cparse_fold_hash(entry_key(entry), entry->key_len);
+}
+
+/**
+ * Entry of MAP's config a read of SECTION and ENTRY's key would find.
+ * NULL if the section or the key is missing.
+ */
+static ConfigEntry *diff_find(const DiffSections *map, const ConfigSection *section,
+				const ConfigEntry *entry, uint32_t hash)
+{
+	ConfigSection *cs = sections_find(map, section->name, section->name_hash);
+	return cs ? cparse_section_find(map->config, cs, entry_key(entry), entry->key_len, hash) : NULL;
+}
+
+/**
+ * Check that CONFIG can be walked: no image, every section parsed
+ */
+static int diff_ready(const Config *config)
+{
+	if (!config) return 0;
+
+	if (config->image) {
+		cparse_set_error(NULL, "Config is a read-only shared image");
+		return 0;
+	}
+
+	return cparse_lazy_load_all(config);
+}
+
+/**
+ * Compare the values of two entries by their stored lengths, NULL for
+ * a missing key. Both values have been read already.
+ */
+static int diff_equal(const ConfigEntry *a, const ConfigEntry *b)
+{
+	if (a == b) return 1;
+	if (!a || !b) return 0;
+
+	size_t len = entry_value_len(a);
+	return len == entry_value_len(b) && memcmp(entry_value(a), entry_value(b), len) == 0;
+}
+
+// ==================== Diff ====================
+
+/**
+ * Call FN for every key whose value differs between A and B: first
+ * the keys of A removed or changed, in A's order, then the keys added,
+ * in B's order. Keys are those reads see, the first of repeated keys
+ * in the first section of a name, and values are compared as stored,
+ * references not expanded. Sections and keys are found through hash
+ * tables, so the cost is linear in the size of both configs. Returns
+ * 0 on error, FN returning non-zero stops the diff successfully.
+ */
+int cparse_diff(Config *a, Config *b, XConfigDiffFn fn, void *user)
+{
+	if (!fn || !diff_ready(a) || !diff_ready(b)) return 0;
+
+	DiffSections ma, mb;
+	if (!sections_build(&ma, a)) return 0;
+	if (!sections_build(&mb, b)) {
+		free(ma.slots);
+		return 0;
+	}
+
+	int ok = 1, stop = 0;
+
+	for (ConfigSection *cs = a->sections; cs && !stop; cs = cs->next) {
+		if (sections_find(&ma, cs->name, cs->name_hash) != cs) continue;
+
+		for (ConfigEntry *ce = cs->entries; ce && !stop; ce = ce->next) {
+			uint32_t hash = diff_hash(ce);
+			if (cparse_section_find(a, cs, entry_key(ce), ce->key_len, hash) != ce) continue;
+
+			ConfigEntry *other = diff_find(&mb, cs, ce, hash);
+			const char *old_value = entry_value(ce);
+			const char *new_value = other ? entry_value(other) : NULL;
+			if (!old_value || (other && !new_value)) {
+				ok = 0;
+				break;
+			}
+
+			if (!other) {
+				stop = fn(user, DIFF_REMOVED, cs->name, entry_key(ce), old_value, NULL);
+			} else if (!diff_equal(ce, other)) {
+				stop = fn(user, DIFF_CHANGED, cs->name, entry_key(ce), old_value, new_value);
+			}
+		}
+		if (!ok) break;
+	}
+
+	for (ConfigSection *cs = b->sections; ok && cs && !stop; cs = cs->next) {
+		if (sections_find(&mb, cs->name, cs->name_hash) != cs) continue;
+
+		for (ConfigEntry *ce = cs->entries; ce && !stop; ce = ce->next) {
+			uint32_t hash = diff_hash(ce);
+			if (cparse_section_find(b, cs, entry_key(ce), ce->key_len, hash) != ce) continue;
+			if (diff_find(&ma, cs, ce, hash)) continue;
+
+			const char *new_value = entry_value(ce);
+			if (!new_value) {
+				ok = 0;
+				break;
+			}
+			stop = fn(user, DIFF_ADDED, cs->name, entry_key(ce), NULL, new_value);
+		}
+	}
+
+	free(ma.slots);
+	free(mb.slots);
+	return ok;
+}
+
+// ==================== Three-Way Merge ====================
+
+typedef struct
+{
+	Config *result;
+	DiffSections sections; /* Of RESULT, grown as sections are added */
+	size_t count;
+	XConfigConflictFn fn;
+	void *user;
+	int stopped;
+} MergeState;
+
+/**
+ * Section NAME of the result, added on first use
+ */
+static ConfigSection *merge_section(MergeState *ms, const char *name, uint32_t hash)
+{
+	DiffSections *map = &ms->sections;
+
+	ConfigSection *cs = sections_find(map, name, hash);
+	if (cs) return cs;
+
+	if ((ms->count + 1) * 2 > map->size) {
+		DiffSections grown = { ms->result, NULL, map->size * 2 };
+		grown.slots = calloc(grown.size, sizeof(ConfigSection *));
+		if (!grown.slots) return NULL;
+
+		for (size_t i = 0; i < map->size; i++) {
+			if (!map->slots[i]) continue;
+			size_t j = map->slots[i]->name_hash & (grown.size - 1);
+			while (grown.slots[j]) j = (j + 1) & (grown.size - 1);
+			grown.slots[j] = map->slots[i];
+		}
+
+		free(map->slots);
+		*map = grown;
+	}
+
+	cs = config_add_section(ms->result, name);
+	if (!cs) return NULL;
+
+	size_t i = hash & (map->size - 1);
+	while (map->slots[i]) i = (i + 1) & (map->size - 1);
+	map->slots[i] = cs;
+	ms->count++;
+
+	return cs;
+}
+
+/**
+ * Entry whose value the merge takes given the BASE, OURS and THEIRS
+ * entries of a key, NULL for a deleted key. A conflict keeps OURS.
+ */
+static const ConfigEntry *merge_value(MergeState *ms, const char *section, const char *key,
+				const ConfigEntry *base, const ConfigEntry *ours,
+				const ConfigEntry *theirs)
+{
+	if (diff_equal(ours, theirs) || diff_equal(base, theirs)) return ours;
+	if (diff_equal(base, ours)) return theirs;
+
+	if (ms->fn && ms->fn(ms->user, section, key, base ? entry_value(base) : NULL,
+			ours ? entry_value(ours) : NULL, theirs ? entry_value(theirs) : NULL)) {
+		ms->stopped = 1;
+	}
+	return ours;
+}
+
+/**
+ * Merge the keys of SIDE, OURS or THEIRS, into the result. With
+ * THEIRS, only keys OURS does not have are left.
+ */
+static int merge_side(MergeState *ms, Config *side, const DiffSections *self,
+			const DiffSections *base, const DiffSections *ours,
+			const DiffSections *theirs, int is_ours)
+{
+	for (ConfigSection *cs = side->sections; cs && !ms->stopped; cs = cs->next) {
+		if (sections_find(self, cs->name, cs->name_hash) != cs) continue;
+
+		ConfigSection *target = NULL;
+
+		for (ConfigEntry *ce = cs->entries; ce && !ms->stopped; ce = ce->next) {
+			uint32_t hash = diff_hash(ce);
+			if (cparse_section_find(side, cs, entry_key(ce), ce->key_len, hash) != ce) continue;
+
+			ConfigEntry *our_entry = is_ours ? ce : diff_find(ours, cs, ce, hash);
+			if (!is_ours && our_entry) continue;
+
+			ConfigEntry *base_entry = diff_find(base, cs, ce, hash);
+			ConfigEntry *their_entry = is_ours ? diff_find(theirs, cs, ce, hash) : ce;
+
+			const char *base_value = base_entry ? entry_value(base_entry) : NULL;
+			const char *our_value = our_entry ? entry_value(our_entry) : NULL;
+			const char *their_value = their_entry ? entry_value(their_entry) : NULL;
+			if ((base_entry && !base_value) || (our_entry && !our_value) ||
+			    (their_entry && !their_value)) {
+				return 0;
+			}
+
+			const ConfigEntry *chosen = merge_value(ms, cs->name, entry_key(ce),
+								base_entry, our_entry, their_entry);
+			if (!chosen) continue;
+
+			if (!target && !(target = merge_section(ms, cs->name, cs->name_hash))) {
+				cparse_set_error(NULL, "Failed to add section: %s", cs->name);
+				return 0;
+			}
+
+			ms->result->current_section = target;
+			if (!config_add_entry_len(ms->result, entry_key(ce), entry_value(chosen),
+						entry_value_len(chosen))) {
+				cparse_set_error(NULL, "Failed to add configuration entry");
+				return 0;
+			}
+		}
+
+		/* Keep sections left empty, unless the merge deleted them */
+		if (!target && !cs->entries && is_ours &&
+		    !merge_section(ms, cs->name, cs->name_hash)) {
+			cparse_set_error(NULL, "Failed to add section: %s", cs->name);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Three-way merge: a key changed on one side only takes that side's
+ * value, added and deleted keys included. A key changed differently
+ * on both sides is a conflict, passed to FN, and keeps OURS; FN
+ * returning non-zero gives up the merge. The result has the flags of
+ * OURS and its order, then the keys only THEIRS added, in its order.
+ * Keys and values are compared like cparse_diff() does.
+ */
+Config *cparse_merge3(Config *base, Config *ours, Config *theirs,
+			XConfigConflictFn fn, void *user)
+{
+	if (!diff_ready(base) || !diff_ready(ours) || !diff_ready(theirs)) return NULL;
+
+	MergeState ms;
+	memset(&ms, 0, sizeof(MergeState));
+	ms.fn = fn;
+	ms.user = user;
+
+	DiffSections mb = { 0 }, mo = { 0 }, mt = { 0 };
+	ms.result = calloc(1, sizeof(Config));
+	int ok = ms.result != NULL;
+	if (ok) {
+		ms.result->flags = ours->flags & (CONFIG_INTERPOLATE | CONFIG_ICASE);
+		ms.sections.config = ms.result;
+		ms.sections.size = 16;
+		ms.sections.slots = calloc(ms.sections.size, sizeof(ConfigSection *));
+		ok = ms.sections.slots != NULL;
+	}
+	if (!ok) {
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+	}
+
+	ok = ok && sections_build(&mb, base) && sections_build(&mo, ours) && sections_build(&mt, theirs);
+
+	/* Entries before any section header come first, as when parsed */
+	uint32_t none = cparse_fold_hash("", 0);
+	ok = ok && ((!sections_find(&mo, "", none) && !sections_find(&mt, "", none)) ||
+			merge_section(&ms, "", none));
+
+	ok = ok && merge_side(&ms, ours, &mo, &mb, &mo, &mt, 1) &&
+		merge_side(&ms, theirs, &mt, &mb, &mo, &mt, 0);
+
+	free(mb.slots);
+	free(mo.slots);
+	free(mt.slots);
+	free(ms.sections.slots);
+
+	if (ok && ms.stopped) {
+		cparse_set_error(NULL, "Merge given up at a conflict");
+		ok = 0;
+	}
+	if (!ok) {
+		cparse_free(ms.result);
+		return NULL;
+	}
+
+	return ms.result;
+}
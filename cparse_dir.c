@@ -0,0 +1,243 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+typedef struct
+{
+	char *name;     /* File name inside the directory */
+	char *path;
+	unsigned flags;
+	size_t diag_limit;
+	Config *config;
+	uint64_t read_ns;
+	uint64_t parse_ns;
+	char error[MAX_ERRBUF];
+} DirFile;
+
+// ==================== Helpers ====================
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static uint64_t dir_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * qsort() comparator, lexical file name order
+ */
+static int dir_compare(const void *a, const void *b)
+{
+	return strcmp(((const DirFile *)a)->name, ((const DirFile *)b)->name);
+}
+
+// ==================== Loading ====================
+
+/**
+ * Worker: read and parse one file
+ */
+static void dir_load_worker(void *arg, size_t index)
+{
+	DirFile *f = &((DirFile *)arg)[index];
+	CPState st;
+
+	uint64_t start = dir_now();
+
+	memset(&st, 0, sizeof(CPState));
+	st.type = P_STR;
+	st.str = cparse_read_file(f->path, &st.len);
+	st.path = f->path;
+	st.flags = f->flags;
+
+	uint64_t read_done = dir_now();
+	f->read_ns = read_done - start;
+
+	if (!st.str) {
+		snprintf(f->error, MAX_ERRBUF, "Cannot read '%s': %s", f->name, strerror(errno));
+		return;
+	}
+
+	/* Workers keep as many diagnostics as the thread that started the load */
+	cparse_set_diag_limit(f->diag_limit);
+	f->config = cparse_load(&st);
+	if (!f->config) {
+		snprintf(f->error, MAX_ERRBUF, "%s: %s", f->name, cparse_get_error());
+	}
+
+	cparse_cleanup(&st);
+	f->parse_ns = dir_now() - read_done;
+}
+
+/**
+ * Start the kernel reading every listed file, so the files queued
+ * behind the workers are already on their way when one gets to them
+ */
+static void dir_prefetch(const DirFile *files, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		int fd = open(files[i].path, O_RDONLY);
+		if (fd < 0) continue; /* The worker reports it */
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+/**
+ * List regular files of DIR matching PATTERN, sorted by name
+ */
+static DirFile *dir_list(const char *dir, const char *pattern, size_t *count)
+{
+	DIR *d = opendir(dir);
+	if (!d) {
+		cparse_set_error(NULL, "Cannot open directory '%s': %s", dir, strerror(errno));
+		return NULL;
+	}
+
+	DirFile *files = NULL;
+	size_t n = 0, capacity = 0;
+	struct dirent *de;
+
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || fnmatch(pattern, de->d_name, 0) != 0) {
+			continue;
+		}
+
+		size_t path_len = strlen(dir) + strlen(de->d_name) + 2;
+		char *path = malloc(path_len);
+		if (!path) goto fail;
+		snprintf(path, path_len, "%s/%s", dir, de->d_name);
+
+		struct stat sb;
+		if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		if (n == capacity) {
+			capacity = capacity ? capacity * BUFFER_GROWTH_FACTOR : 64;
+			DirFile *grown = realloc(files, capacity * sizeof(DirFile));
+			if (!grown) {
+				free(path);
+				goto fail;
+			}
+			files = grown;
+		}
+
+		memset(&files[n], 0, sizeof(DirFile));
+		files[n].path = path;
+		files[n].name = path + strlen(dir) + 1;
+		n++;
+	}
+
+	closedir(d);
+	qsort(files, n, sizeof(DirFile), dir_compare);
+	*count = n;
+	return files ? files : calloc(1, sizeof(DirFile));
+
+fail:
+	for (size_t i = 0; i < n; i++) {
+		free(files[i].path);
+	}
+	free(files);
+	closedir(d);
+	cparse_set_error(NULL, "Failed to allocate memory");
+	return NULL;
+}
+
+/**
+ * Load all files of DIR matching PATTERN into one configuration.
+ * Files are read and parsed concurrently, then merged in lexical name
+ * order: later files win, or a repeated key is an error with
+ * CONFIG_DIR_STRICT. Per-file timings are kept in the result.
+ */
+Config *cparse_load_directory(const char *dir, const char *pattern, unsigned flags)
+{
+	size_t count = 0;
+	Config *result = NULL;
+
+	if (!dir) return NULL;
+
+	DirFile *files = dir_list(dir, pattern ? pattern : DIRECTORY_PATTERN, &count);
+	if (!files) return NULL;
+
+	/* A merged directory is never saved back in place, and merging
+	 * reads every section anyway */
+	flags &= ~(CONFIG_PRESERVE | CONFIG_LAZY);
+	for (size_t i = 0; i < count; i++) {
+		files[i].flags = flags;
+		files[i].diag_limit = cparse_get_diag_limit();
+	}
+
+	dir_prefetch(files, count);
+	cparse_pool_run(count, DIRECTORY_MAX_THREADS, dir_load_worker, files);
+
+	result = calloc(1, sizeof(Config));
+	XConfigLoadStat *stats = calloc(count ? count : 1, sizeof(XConfigLoadStat));
+	if (!result || !stats || !config_add_section(result, "")) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		free(stats);
+		free(result);
+		result = NULL;
+		goto out;
+	}
+	result->flags = flags;
+	result->load_stats = stats;
+	result->diags.limit = cparse_get_diag_limit();
+
+	for (size_t i = 0; i < count; i++) {
+		DirFile *f = &files[i];
+
+		if (!f->config) {
+			cparse_set_error(NULL, "%s", f->error);
+			goto fail;
+		}
+
+		for (ConfigSection *cs = f->config->sections; cs; cs = cs->next) {
+			if (!config_merge_section(result, cs, flags & CONFIG_DIR_STRICT)) {
+				char msg[MAX_ERRBUF];
+				snprintf(msg, MAX_ERRBUF, "%s", cparse_get_error());
+				cparse_set_error(NULL, "%s: %s", f->name, msg);
+				goto fail;
+			}
+		}
+
+		if (!cparse_diag_merge(result, f->config, f->name)) {
+			goto fail;
+		}
+
+		stats[i].file = strdup(f->name);
+		stats[i].read_ns = f->read_ns;
+		stats[i].parse_ns = f->parse_ns;
+		if (!stats[i].file) {
+			cparse_set_error(NULL, "Failed to allocate memory");
+			goto fail;
+		}
+		result->load_stat_count++;
+	}
+	goto out;
+
+fail:
+	cparse_free(result);
+	result = NULL;
+
+out:
+	for (size_t i = 0; i < count; i++) {
+		cparse_free(files[i].config);
+		free(files[i].path);
+	}
+	free(files);
+	return result;
+}
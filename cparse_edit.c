@@ -0,0 +1,484 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* Replace [start, end) of the source with text */
+typedef struct
+{
+	size_t start;
+	size_t end;
+	size_t text_off;  /* Into EditList.text */
+	size_t text_len;
+	size_t seq;       /* Generation order, breaks ties */
+} EditOp;
+
+typedef struct
+{
+	EditOp *ops;
+	size_t count;
+	size_t capacity;
+	CPBuf text;       /* Replacement texts, back to back */
+	const char *source;
+	size_t len;
+	int eof_newline;  /* Output so far ends with a newline */
+} EditList;
+
+// ==================== Edit List ====================
+
+/**
+ * Offset past the line that contains POS
+ */
+static size_t edit_line_end(const EditList *el, size_t pos)
+{
+	const char *nl = memchr(el->source + pos, '\n', el->len - pos);
+	return nl ? (size_t)(nl - el->source) + 1 : el->len;
+}
+
+/**
+ * Replace [START, END) with the text appended since TEXT_OFF
+ */
+static int edit_push(EditList *el, size_t start, size_t end, size_t text_off)
+{
+	if (el->count == el->capacity) {
+		size_t capacity = el->capacity ? el->capacity * BUFFER_GROWTH_FACTOR : 16;
+		EditOp *ops = realloc(el->ops, capacity * sizeof(EditOp));
+		if (!ops) return 0;
+		el->ops = ops;
+		el->capacity = capacity;
+	}
+
+	EditOp *op = &el->ops[el->count];
+	op->start = start;
+	op->end = end;
+	op->text_off = text_off;
+	op->text_len = el->text.len - text_off;
+	op->seq = el->count++;
+	return 1;
+}
+
+/**
+ * qsort() comparator, source order. An insertion goes before a
+ * replacement starting at the same offset.
+ */
+static int edit_compare(const void *a, const void *b)
+{
+	const EditOp *x = a, *y = b;
+
+	if (x->start != y->start) return x->start < y->start ? -1 : 1;
+	if (x->end != y->end) return x->end < y->end ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// ==================== Formatting ====================
+
+/**
+ * Check whether VALUE reads back the same without quotes
+ */
+static int edit_is_plain(const char *value, size_t len)
+{
+	if (len == 0) return 1;
+	if (isspace((unsigned char)value[0]) || isspace((unsigned char)value[len - 1])) return 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (strchr("\n\r#;\"'\\", value[i])) return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Append VALUE, quoted and escaped unless BARE and it needs neither
+ */
+static int edit_append_value(CPBuf *buf, const char *value, size_t len, int bare)
+{
+	if (bare && edit_is_plain(value, len)) {
+		return cparse_buf_append(buf, value, len);
+	}
+
+	if (!cparse_buf_append(buf, "\"", 1)) return 0;
+
+	const char *run = value;
+	for (size_t i = 0; i < len; i++) {
+		const char *esc = NULL;
+
+		switch (value[i]) {
+		case '"': esc = "\\\""; break;
+		case '\\': esc = "\\\\"; break;
+		case '\n': esc = "\\n"; break;
+		case '\t': esc = "\\t"; break;
+		case '\r': esc = "\\r"; break;
+		case '\0': esc = "\\0"; break;
+		default: continue;
+		}
+
+		if (!cparse_buf_append(buf, run, value + i - run) || !cparse_buf_append(buf, esc, 2)) {
+			return 0;
+		}
+		run = value + i + 1;
+	}
+
+	return cparse_buf_append(buf, run, value + len - run) && cparse_buf_append(buf, "\"", 1);
+}
+
+/**
+ * Check that "[NAME]" parses back as section NAME, or set the error.
+ * Names have no quoting: ']' and a line end close them, and trailing
+ * space is trimmed.
+ */
+int cparse_check_section_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strpbrk(name, "]\n\r") || (len > 0 && isspace((unsigned char)name[len - 1]))) {
+		cparse_set_error(NULL, "Section name cannot be written: '%s'", name);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Append 'key = "value"' and a newline, the value as stored
+ */
+int cparse_format_entry(CPBuf *buf, const ConfigEntry *entry)
+{
+	const char *key = entry_key(entry);
+	size_t key_len = entry->key_len;
+
+	/* Keys have no escapes, only quotes */
+	const char *quote = "";
+	if (strpbrk(key, " \t=#;[\"'")) {
+		quote = strchr(key, '"') ? "'" : "\"";
+	}
+
+	return cparse_buf_append(buf, quote, strlen(quote)) &&
+		cparse_buf_append(buf, key, key_len) &&
+		cparse_buf_append(buf, quote, strlen(quote)) &&
+		cparse_buf_append(buf, " = ", 3) &&
+		edit_append_value(buf, entry_value(entry), entry_value_len(entry), 0) &&
+		cparse_buf_append(buf, "\n", 1);
+}
+
+// ==================== Section Edits ====================
+
+/**
+ * Edits of one section: changed values are replaced in place, new
+ * entries go after the last parsed one, a new section goes at the end.
+ * DEFAULT_AT is where entries outside of any section are inserted
+ * when none was parsed.
+ */
+static int edit_section(EditList *el, const ConfigSection *cs, size_t default_at)
+{
+	size_t at;
+
+	if (cs->flags & SECTION_SPAN) {
+		at = edit_line_end(el, cs->span.value_end);
+	} else {
+		at = cs->name[0] ? el->len : default_at;
+	}
+
+	int added = 0;
+	for (const ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+		const ConfigSpan *span = entry_span(ce);
+
+		if (!span) {
+			added = 1;
+			continue;
+		}
+		at = edit_line_end(el, span->value_end);
+
+		if (!(ce->flags & ENTRY_DIRTY)) continue;
+
+		/* Keep an unquoted value unquoted when possible */
+		char first = span->value_start < el->len ? el->source[span->value_start] : '\0';
+		size_t text_off = el->text.len;
+		if (!edit_append_value(&el->text, entry_value(ce), entry_value_len(ce),
+					first != '"' && first != '\'') ||
+		    !edit_push(el, span->value_start, span->value_end, text_off)) {
+			return 0;
+		}
+	}
+
+	int fresh = !(cs->flags & SECTION_SPAN) && cs->name[0];
+	if (!added && !fresh) {
+		return 1;
+	}
+
+	size_t text_off = el->text.len;
+
+	if (at == el->len && !el->eof_newline && !cparse_buf_append(&el->text, "\n", 1)) {
+		return 0;
+	}
+
+	if (fresh) {
+		if ((el->len > 0 && !cparse_buf_append(&el->text, "\n", 1)) ||
+		    !cparse_buf_append(&el->text, "[", 1) ||
+		    !cparse_buf_append(&el->text, cs->name, strlen(cs->name)) ||
+		    !cparse_buf_append(&el->text, "]\n", 2)) {
+			return 0;
+		}
+	}
+
+	for (const ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+		if (!entry_span(ce) && !cparse_format_entry(&el->text, ce)) {
+			return 0;
+		}
+	}
+
+	if (at == el->len) {
+		el->eof_newline = 1;
+	}
+
+	return edit_push(el, at, at, text_off);
+}
+
+// ==================== Writing ====================
+
+/**
+ * Write all of IOV to FD, WRITE_IOV_MAX buffers per writev() call
+ */
+static int write_iov(int fd, const struct iovec *iov, size_t count)
+{
+	struct iovec batch[WRITE_IOV_MAX];
+	size_t next = 0, n = 0;
+
+	for (;;) {
+		while (n < WRITE_IOV_MAX && next < count) {
+			if (iov[next].iov_len > 0) {
+				batch[n++] = iov[next];
+			}
+			next++;
+		}
+		if (n == 0) break;
+
+		ssize_t written = writev(fd, batch, n);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+
+		/* Drop what was written, keep the rest of a short write */
+		size_t done = 0;
+		while (done < n && (size_t)written >= batch[done].iov_len) {
+			written -= batch[done].iov_len;
+			done++;
+		}
+		if (done < n) {
+			batch[done].iov_base = (char *)batch[done].iov_base + written;
+			batch[done].iov_len -= written;
+		}
+		memmove(batch, batch + done, (n - done) * sizeof(struct iovec));
+		n -= done;
+	}
+
+	return 1;
+}
+
+/* Buffers of cparse_write_file() */
+typedef struct
+{
+	const struct iovec *iov;
+	size_t count;
+	const char *path;
+} WriteBuffers;
+
+/**
+ * Write function of cparse_write_file()
+ */
+static int write_buffers(void *user, int fd)
+{
+	const WriteBuffers *wb = user;
+
+	if (!write_iov(fd, wb->iov, wb->count)) {
+		cparse_set_error(NULL, "Cannot write '%s': %s", wb->path, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Write COUNT buffers to PATH, see cparse_write_stream()
+ */
+int cparse_write_file(const char *path, const struct iovec *iov, size_t count)
+{
+	WriteBuffers wb = { iov, count, path };
+	return cparse_write_stream(path, write_buffers, &wb);
+}
+
+/**
+ * Create a new file named TMP, its trailing "XXXXXX" replaced like
+ * mkstemp() does, but with MODE less the umask instead of 0600
+ */
+static int edit_create_temp(char *tmp, mode_t mode)
+{
+	static const char digits[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	static unsigned counter;
+	char *suffix = tmp + strlen(tmp) - 6;
+
+	for (int attempt = 0; attempt < 100; attempt++) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		uint64_t x = ((uint64_t)getpid() << 32) ^ (uint64_t)ts.tv_nsec ^
+			__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+		x *= 0x9e3779b97f4a7c15ull;
+		for (int i = 0; i < 6; i++) {
+			suffix[i] = digits[(x >> 40) % 36];
+			x *= 0x9e3779b97f4a7c15ull;
+		}
+
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, mode);
+		if (fd >= 0 || errno != EEXIST) return fd;
+	}
+
+	errno = EEXIST;
+	return -1;
+}
+
+/**
+ * Replace PATH with what FN writes to a descriptor. A temporary file
+ * next to PATH is written, synced and renamed over it, so readers see
+ * either the old or the new file. A symlink is followed, its target
+ * is replaced, and keeps its mode. A new file gets 0666 less the
+ * umask. FN returns 0 on failure, with the error set, and nothing is
+ * replaced then.
+ */
+int cparse_write_stream(const char *path, int (*fn)(void *user, int fd), void *user)
+{
+	if (!path) return 0;
+
+	char *target = realpath(path, NULL);
+	const char *dest = target ? target : path;
+	size_t dest_len = strlen(dest);
+
+	char *tmp = malloc(dest_len + sizeof(".XXXXXX"));
+	if (!tmp) {
+		free(target);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+	memcpy(tmp, dest, dest_len);
+	memcpy(tmp + dest_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+	/* Created with the umask applied by the kernel, a replaced file's
+	 * mode is then copied over it */
+	struct stat sb;
+	int replace = stat(dest, &sb) == 0;
+	int fd = edit_create_temp(tmp, 0666);
+	if (fd < 0) {
+		cparse_set_error(NULL, "Cannot create '%s': %s", tmp, strerror(errno));
+		free(tmp);
+		free(target);
+		return 0;
+	}
+	if (replace) {
+		fchmod(fd, sb.st_mode & 07777);
+	}
+
+	int written = fn(user, fd);
+	int ok = written && fsync(fd) == 0;
+	if (close(fd) < 0) ok = 0;
+	if (ok && rename(tmp, dest) < 0) ok = 0;
+
+	if (!ok) {
+		if (written) {
+			cparse_set_error(NULL, "Cannot write '%s': %s", dest, strerror(errno));
+		}
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(target);
+	return ok;
+}
+
+/**
+ * Save CONFIG, parsed with CONFIG_PRESERVE from SOURCE, to PATH.
+ * Bytes of entries that did not change are written from SOURCE as
+ * they are, so comments and layout survive. Edits are always applied
+ * to the original source, a config can be saved any number of times.
+ */
+int cparse_save(const Config *config, const char *source, size_t len, const char *path)
+{
+	if (!config || !source) return 0;
+	if (!cparse_lazy_load_all(config)) return 0;
+
+	EditList el;
+	memset(&el, 0, sizeof(EditList));
+	el.source = source;
+	el.len = len;
+	el.eof_newline = len == 0 || source[len - 1] == '\n';
+
+	/* New entries outside of any section go before the first header */
+	size_t default_at = len;
+	for (const ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (cs->flags & SECTION_SPAN) {
+			default_at = cs->span.line_start;
+			break;
+		}
+	}
+
+	/* New headers must parse back as their sections, parsed ones do */
+	for (const ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (!(cs->flags & SECTION_SPAN) && !cparse_check_section_name(cs->name)) {
+			return 0;
+		}
+	}
+
+	int ok = 1;
+	for (const ConfigSection *cs = config->sections; ok && cs; cs = cs->next) {
+		if (!(cs->flags & SECTION_INCLUDE)) {
+			ok = edit_section(&el, cs, default_at);
+		}
+	}
+
+	/* Removed entries take their whole line with them */
+	for (size_t i = 0; ok && i < config->removed_count; i++) {
+		const ConfigSpan *span = &config->removed[i];
+		ok = edit_push(&el, span->line_start, edit_line_end(&el, span->value_end), el.text.len);
+	}
+
+	struct iovec *iov = ok ? malloc((el.count * 2 + 1) * sizeof(struct iovec)) : NULL;
+	if (!iov) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		free(el.ops);
+		free(el.text.data);
+		return 0;
+	}
+
+	if (el.count > 0) {
+		qsort(el.ops, el.count, sizeof(EditOp), edit_compare);
+	}
+
+	size_t n = 0, pos = 0;
+	for (size_t i = 0; i < el.count; i++) {
+		const EditOp *op = &el.ops[i];
+
+		if (op->start > pos) {
+			iov[n].iov_base = (char *)source + pos;
+			iov[n++].iov_len = op->start - pos;
+		}
+		if (op->text_len > 0) {
+			iov[n].iov_base = el.text.data + op->text_off;
+			iov[n++].iov_len = op->text_len;
+		}
+		if (op->end > pos) pos = op->end;
+	}
+	iov[n].iov_base = (char *)source + pos;
+	iov[n++].iov_len = len - pos;
+
+	ok = cparse_write_file(path, iov, n);
+
+	free(iov);
+	free(el.ops);
+	free(el.text.data);
+	return ok;
+}
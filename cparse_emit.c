@@ -0,0 +1,332 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* Output buffered for a sink, passed on in pieces of about FLUSH size */
+typedef struct
+{
+	Config *config;
+	const XConfigSink *sink;
+	CPBuf buf;
+	int first;            /* Nothing written in the current block yet */
+} Emitter;
+
+// ==================== Output ====================
+
+/**
+ * Pass the buffered output to the sink and empty the buffer
+ */
+static int emit_flush(Emitter *em)
+{
+	const char *data = em->buf.data;
+	size_t len = em->buf.len;
+
+	em->buf.len = 0;
+	if (len == 0) return 1;
+
+	if (em->sink->write) {
+		if (em->sink->write(em->sink->user, data, len)) {
+			cparse_set_error(NULL, "Output stopped by the sink");
+			return 0;
+		}
+		return 1;
+	}
+
+	while (len > 0) {
+		ssize_t n = write(em->sink->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			cparse_set_error(NULL, "Write failed: %s", strerror(errno));
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/**
+ * An entry or section was formatted, flush once the buffer is full
+ */
+static int emit_done(Emitter *em)
+{
+	return em->buf.len < EMIT_FLUSH_SIZE || emit_flush(em);
+}
+
+/**
+ * Append LEN bytes of DATA
+ */
+static int emit(Emitter *em, const char *data, size_t len)
+{
+	if (!cparse_buf_append(&em->buf, data, len)) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Append the NUL-terminated STR
+ */
+static int emit_str(Emitter *em, const char *str)
+{
+	return emit(em, str, strlen(str));
+}
+
+/**
+ * Check that reads find ENTRY of SECTION: the first of repeated keys
+ * in the first section of a name. JSON and env output skip the rest.
+ */
+static int emit_visible(Emitter *em, ConfigSection *section, ConfigEntry *entry)
+{
+	if (config_find_section(em->config, section->name) != section) return 0;
+
+	uint32_t hash = (entry->flags & ENTRY_HASH) ? entry_hash(entry)
+		: cparse_fold_hash(entry_key(entry), entry->key_len);
+	return cparse_section_find(em->config, section, entry_key(entry), entry->key_len, hash) == entry;
+}
+
+// ==================== INI ====================
+
+/**
+ * Native format: every section and entry as stored, references kept,
+ * values quoted and escaped so that a parse reads them back the same.
+ * A section name that would not read back fails before any output.
+ */
+static int emit_ini(Emitter *em)
+{
+	for (ConfigSection *cs = em->config->sections; cs; cs = cs->next) {
+		if (!cparse_check_section_name(cs->name)) return 0;
+	}
+
+	for (ConfigSection *cs = em->config->sections; cs; cs = cs->next) {
+		if (cs->name[0]) {
+			if ((!em->first && !emit(em, "\n", 1)) || !emit(em, "[", 1) ||
+			    !emit_str(em, cs->name) || !emit(em, "]\n", 2)) {
+				return 0;
+			}
+			em->first = 0;
+		}
+
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+			if (!cparse_format_entry(&em->buf, ce)) {
+				cparse_set_error(NULL, "Failed to allocate memory");
+				return 0;
+			}
+			em->first = 0;
+			if (!emit_done(em)) return 0;
+		}
+	}
+
+	return 1;
+}
+
+// ==================== JSON ====================
+
+/**
+ * Append the LEN bytes of STR as a JSON string, NULs as \u0000
+ */
+static int emit_json_string(Emitter *em, const char *str, size_t len)
+{
+	if (!emit(em, "\"", 1)) return 0;
+
+	const char *run = str;
+	const char *end = str + len;
+	for (const char *p = str; p < end; p++) {
+		unsigned char ch = *p;
+		char esc[8];
+
+		if (ch == '"' || ch == '\\') {
+			esc[0] = '\\';
+			esc[1] = ch;
+			esc[2] = '\0';
+		} else if (ch == '\n') {
+			strcpy(esc, "\\n");
+		} else if (ch == '\t') {
+			strcpy(esc, "\\t");
+		} else if (ch == '\r') {
+			strcpy(esc, "\\r");
+		} else if (ch < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", ch);
+		} else {
+			continue;
+		}
+
+		if (!emit(em, run, p - run) || !emit_str(em, esc)) return 0;
+		run = p + 1;
+	}
+
+	return emit(em, run, end - run) && emit(em, "\"", 1);
+}
+
+/**
+ * Append '"key": "value"' of ENTRY at INDENT, after a comma unless it
+ * is the first member of its object
+ */
+static int emit_json_member(Emitter *em, ConfigSection *section, ConfigEntry *entry, const char *indent)
+{
+	size_t len = 0;
+	const char *value = cparse_entry_value(em->config, section, entry, &len);
+	if (!value) return 0;
+
+	return emit_str(em, em->first ? "\n" : ",\n") && emit_str(em, indent) &&
+		emit_json_string(em, entry_key(entry), entry->key_len) && emit(em, ": ", 2) &&
+		emit_json_string(em, value, len);
+}
+
+/**
+ * One object: entries outside of any section are its members, each
+ * section an object of its entries. Values are strings, as read.
+ */
+static int emit_json(Emitter *em)
+{
+	if (!emit(em, "{", 1)) return 0;
+
+	for (ConfigSection *cs = em->config->sections; cs; cs = cs->next) {
+		if (cs->name[0]) continue;
+
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+			if (!emit_visible(em, cs, ce)) continue;
+			if (!emit_json_member(em, cs, ce, "  ")) return 0;
+			em->first = 0;
+			if (!emit_done(em)) return 0;
+		}
+	}
+
+	for (ConfigSection *cs = em->config->sections; cs; cs = cs->next) {
+		if (!cs->name[0] || config_find_section(em->config, cs->name) != cs) continue;
+
+		if (!emit_str(em, em->first ? "\n  " : ",\n  ") ||
+		    !emit_json_string(em, cs->name, strlen(cs->name)) ||
+		    !emit(em, ": {", 3)) {
+			return 0;
+		}
+
+		em->first = 1;
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+			if (!emit_visible(em, cs, ce)) continue;
+			if (!emit_json_member(em, cs, ce, "    ")) return 0;
+			em->first = 0;
+			if (!emit_done(em)) return 0;
+		}
+
+		if (!emit_str(em, em->first ? "}" : "\n  }")) return 0;
+		em->first = 0;
+	}
+
+	return emit_str(em, em->first ? "}\n" : "\n}\n");
+}
+
+// ==================== Environment ====================
+
+/**
+ * Append NAME as a variable name part: letters upper case, anything
+ * but letters, digits and '_' as '_'
+ */
+static int emit_env_name(Emitter *em, const char *name)
+{
+	for (const char *p = name; *p; p++) {
+		unsigned char ch = *p;
+		char out = isalnum(ch) && ch < 0x80 ? (char)toupper(ch) : '_';
+		if (!emit(em, &out, 1)) return 0;
+	}
+	return 1;
+}
+
+/**
+ * Append VALUE as a shell word, single-quoted unless it needs no quotes.
+ * The environment cannot hold a NUL, a value ends at its first one.
+ */
+static int emit_env_value(Emitter *em, const char *value)
+{
+	size_t len = strlen(value);
+	if (len > 0 && strspn(value, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+				"0123456789_./:@%+,=-") == len) {
+		return emit(em, value, len);
+	}
+
+	if (!emit(em, "'", 1)) return 0;
+
+	const char *run = value;
+	for (const char *q; (q = strchr(run, '\'')); run = q + 1) {
+		if (!emit(em, run, q - run) || !emit(em, "'\\''", 4)) return 0;
+	}
+
+	return emit_str(em, run) && emit(em, "'", 1);
+}
+
+/**
+ * KEY=VALUE lines, SECTION_KEY for keys of a section, values as read
+ * and quoted for a POSIX shell
+ */
+static int emit_env(Emitter *em)
+{
+	for (ConfigSection *cs = em->config->sections; cs; cs = cs->next) {
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+			if (!emit_visible(em, cs, ce)) continue;
+
+			const char *value = cparse_entry_value(em->config, cs, ce, NULL);
+			if (!value) return 0;
+
+			/* Names do not start with a digit */
+			const char *first = cs->name[0] ? cs->name : entry_key(ce);
+			if (isdigit((unsigned char)first[0]) && !emit(em, "_", 1)) return 0;
+
+			if ((cs->name[0] && (!emit_env_name(em, cs->name) || !emit(em, "_", 1))) ||
+			    !emit_env_name(em, entry_key(ce)) || !emit(em, "=", 1) ||
+			    !emit_env_value(em, value) || !emit(em, "\n", 1) || !emit_done(em)) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// ==================== Emitting ====================
+
+/**
+ * Write CONFIG to SINK in FORMAT (EMIT_*). Output goes through a
+ * buffer flushed every EMIT_FLUSH_SIZE bytes, so memory does not grow
+ * with the config, only with its longest entry. Returns 0 on error,
+ * part of the output may have been written then.
+ */
+int cparse_emit(Config *config, int format, const XConfigSink *sink)
+{
+	if (!config || !sink) return 0;
+
+	if (config->image) {
+		cparse_set_error(NULL, "Emitting is not supported on a shared image");
+		return 0;
+	}
+
+	if (!cparse_lazy_load_all(config)) return 0;
+
+	Emitter em;
+	memset(&em, 0, sizeof(Emitter));
+	em.config = config;
+	em.sink = sink;
+	em.first = 1;
+
+	int ok;
+	switch (format) {
+	case EMIT_INI: ok = emit_ini(&em); break;
+	case EMIT_JSON: ok = emit_json(&em); break;
+	case EMIT_ENV: ok = emit_env(&em); break;
+	default:
+		cparse_set_error(NULL, "Unknown output format: %d", format);
+		ok = 0;
+		break;
+	}
+
+	ok = ok && emit_flush(&em);
+
+	free(em.buf.data);
+	return ok;
+}
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* A fingerprint is the sum, lane by lane modulo 2^64, of one term per
+ * section and per entry:
+ *
+ *   section: N(name) + pair(name of the section before, name), none for ""
+ *   entry:   V(section name, key, value) + pair(section name, key before, key)
+ *
+ * A sum is kept up to date in O(1) by every add, update and removal,
+ * the pair terms make it depend on order. Values are hashed decoded,
+ * references not expanded. Not a cryptographic hash. */
+
+#define FP_K0 0xa0761d6478bd642full
+#define FP_K1 0xe7037ed1a0b428dbull
+#define FP_K2 0x8ebc6af09c88c6e3ull
+#define FP_K3 0x589965cc75374cc3ull
+#define FP_K4 0x1d8e4e27c47d124full
+
+#define FP_NAME 0x6e616d65ull  /* Seeds of names and keys */
+#define FP_KEY  0x6b6579ull
+
+// ==================== Hashing ====================
+
+/**
+ * Multiply A by B and fold the 128-bit product
+ */
+static inline uint64_t fp_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t fp_load(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Hash the LEN bytes of DATA into two lanes, 16 bytes a step
+ */
+static XConfigFingerprint fp_hash(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t a = seed ^ FP_K0 ^ fp_mix(len ^ FP_K1, FP_K2);
+	uint64_t b = seed ^ FP_K3;
+	size_t n = len;
+
+	for (; n >= 16; p += 16, n -= 16) {
+		uint64_t x = fp_load(p), y = fp_load(p + 8);
+		a = fp_mix(x ^ a, y ^ FP_K1);
+		b = fp_mix(x ^ FP_K2, y ^ b);
+	}
+
+	unsigned char tail[16] = { 0 };
+	memcpy(tail, p, n);
+	uint64_t x = fp_load(tail), y = fp_load(tail + 8);
+	a = fp_mix(x ^ a, y ^ FP_K1 ^ n);
+	b = fp_mix(x ^ FP_K2 ^ n, y ^ b);
+
+	return (XConfigFingerprint){ fp_mix(b ^ FP_K4, a ^ FP_K0), fp_mix(a ^ FP_K3, b ^ len) };
+}
+
+/**
+ * Term of KEY following PREV in a section with seed SEED, or of a
+ * section following another, the first one following 0
+ */
+static XConfigFingerprint fp_pair(uint64_t seed, uint64_t prev, uint64_t key)
+{
+	uint64_t m = fp_mix(prev ^ FP_K2, key ^ FP_K3) ^ seed;
+	return (XConfigFingerprint){ fp_mix(m ^ FP_K4, seed ^ FP_K1), fp_mix(m ^ FP_K0, key ^ FP_K4) };
+}
+
+/**
+ * Add TERM to FP, or subtract it when SIGN is negative
+ */
+static inline void fp_apply(XConfigFingerprint *fp, XConfigFingerprint term, int sign)
+{
+	if (sign < 0) {
+		fp->hi -= term.hi;
+		fp->lo -= term.lo;
+	} else {
+		fp->hi += term.hi;
+		fp->lo += term.lo;
+	}
+}
+
+static inline uint64_t fp_key(const ConfigEntry *entry)
+{
+	return fp_hash(entry_key(entry), entry->key_len, FP_KEY).lo;
+}
+
+/**
+ * Term of the LEN bytes of VALUE, the value of KEY in a section with
+ * seed SEED
+ */
+static inline XConfigFingerprint fp_bytes(uint64_t seed, uint64_t key, const char *value, size_t len)
+{
+	return fp_hash(value, len, fp_mix(seed ^ FP_K0, key ^ FP_K1));
+}
+
+/**
+ * Term of the value of ENTRY in a section with seed SEED. A value kept
+ * encoded is decoded for it, without keeping the decoded copy.
+ */
+static XConfigFingerprint fp_value(uint64_t seed, const ConfigEntry *entry, uint64_t key)
+{
+	if (!(entry->flags & ENTRY_ENCODED)) {
+		const char *value = (entry->flags & ENTRY_INLINE)
+			? entry->u.data + entry->key_len + 1 : entry->u.ptr.value;
+		return fp_bytes(seed, key, value, entry->value_len);
+	}
+
+	const EntryDecoded *decoded = __atomic_load_n(&entry->u.ptr.decoded, __ATOMIC_ACQUIRE);
+	if (decoded) return fp_bytes(seed, key, decoded->data, decoded->len);
+
+	/* Out of memory, the raw text stands in */
+	CPBuf buf = { NULL, 0, 0 };
+	XConfigFingerprint term = cparse_unescape(&buf, entry->u.ptr.value, entry->value_len)
+		? fp_bytes(seed, key, buf.data ? buf.data : "", buf.len)
+		: fp_bytes(seed, key, entry->u.ptr.value, entry->value_len);
+	free(buf.data);
+	return term;
+}
+
+// ==================== Updates ====================
+
+/**
+ * Hash the name of a section about to be added, it has no entries yet
+ */
+void cparse_fp_name(ConfigSection *section)
+{
+	section->fp_name = fp_hash(section->name, strlen(section->name), FP_NAME);
+	section->fp_last = 0;
+}
+
+/**
+ * Add to FP the term of SECTION following PREV (NULL: first), or
+ * subtract it when SIGN is negative. The section of entries before
+ * any header has none, a config with it empty matches one without it.
+ */
+void cparse_fp_section(XConfigFingerprint *fp, const ConfigSection *prev,
+			const ConfigSection *section, int sign)
+{
+	if (section->name[0] == '\0') return;
+
+	uint64_t before = prev && prev->name[0] != '\0' ? prev->fp_name.lo : 0;
+	fp_apply(fp, section->fp_name, sign);
+	fp_apply(fp, fp_pair(FP_NAME, before, section->fp_name.lo), sign);
+}
+
+/**
+ * Add the terms of ENTRY, appended to SECTION. DECODED, if any, is the
+ * value of an ENTRY_ENCODED entry decoded by the caller.
+ */
+void cparse_fp_entry_added(Config *config, ConfigSection *section, const ConfigEntry *entry,
+			const CPBuf *decoded)
+{
+	uint64_t seed = section->fp_name.lo;
+	uint64_t key = fp_key(entry);
+	XConfigFingerprint term = decoded
+		? fp_bytes(seed, key, decoded->data ? decoded->data : "", decoded->len)
+		: fp_value(seed, entry, key);
+
+	fp_apply(&config->fingerprint, term, 1);
+	fp_apply(&config->fingerprint, fp_pair(seed, section->fp_last, key), 1);
+	section->fp_last = key;
+}
+
+/**
+ * Term of the value of ENTRY of SECTION, to take out before an update
+ * and put back after it
+ */
+XConfigFingerprint cparse_fp_value(const ConfigSection *section, const ConfigEntry *entry)
+{
+	return fp_value(section->fp_name.lo, entry, fp_key(entry));
+}
+
+/**
+ * Apply TERM to the fingerprint of CONFIG, see cparse_fp_value()
+ */
+void cparse_fp_apply(Config *config, XConfigFingerprint term, int sign)
+{
+	fp_apply(&config->fingerprint, term, sign);
+}
+
+/**
+ * Take the terms of ENTRY out, it follows PREV (NULL: first) in
+ * SECTION and is about to be unlinked: its neighbours become a pair
+ */
+void cparse_fp_entry_removed(Config *config, ConfigSection *section,
+			const ConfigEntry *prev, const ConfigEntry *entry)
+{
+	XConfigFingerprint *fp = &config->fingerprint;
+	uint64_t seed = section->fp_name.lo;
+	uint64_t before = prev ? fp_key(prev) : 0;
+	uint64_t key = fp_key(entry);
+
+	fp_apply(fp, fp_value(seed, entry, key), -1);
+	fp_apply(fp, fp_pair(seed, before, key), -1);
+
+	if (entry->next) {
+		uint64_t after = fp_key(entry->next);
+		fp_apply(fp, fp_pair(seed, key, after), -1);
+		fp_apply(fp, fp_pair(seed, before, after), 1);
+	} else {
+		section->fp_last = before;
+	}
+}
+
+/**
+ * Adjust FP for the entries of SECTION, about to be appended to those
+ * of FIRST, a section of the same name. Only the pair at the joint
+ * changes, unless the names differ in case (CONFIG_ICASE) and so every
+ * term does.
+ */
+void cparse_fp_splice(XConfigFingerprint *fp, ConfigSection *first, const ConfigSection *section)
+{
+	const ConfigEntry *head = section->entries;
+	if (!head) return;
+
+	uint64_t from = section->fp_name.lo, to = first->fp_name.lo;
+	uint64_t key = fp_key(head);
+
+	fp_apply(fp, fp_pair(from, 0, key), -1);
+	fp_apply(fp, fp_pair(to, first->fp_last, key), 1);
+	first->fp_last = section->fp_last;
+	if (from == to) return;
+
+	fp_apply(fp, fp_value(from, head, key), -1);
+	fp_apply(fp, fp_value(to, head, key), 1);
+	for (const ConfigEntry *entry = head->next; entry; entry = entry->next) {
+		uint64_t prev = key;
+		key = fp_key(entry);
+
+		fp_apply(fp, fp_pair(from, prev, key), -1);
+		fp_apply(fp, fp_pair(to, prev, key), 1);
+		fp_apply(fp, fp_value(from, entry, key), -1);
+		fp_apply(fp, fp_value(to, entry, key), 1);
+	}
+}
+
+// ==================== Query ====================
+
+/**
+ * Fingerprint of CONFIG, a CONFIG_LAZY one is parsed in full first.
+ * An attached image has the fingerprint of the config it was
+ * exported from.
+ */
+int cparse_fingerprint(const Config *config, XConfigFingerprint *fp)
+{
+	if (!config || !fp) return 0;
+
+	if (config->image) {
+		cparse_image_fingerprint(config->image, fp);
+		return 1;
+	}
+	if (!cparse_lazy_load_all(config)) return 0;
+
+	*fp = config->fingerprint;
+	return 1;
+}
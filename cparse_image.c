@@ -0,0 +1,514 @@
+#define _GNU_SOURCE /* memfd_create(), file seals */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+#define IMAGE_MAGIC "XCIMAGE"
+#define IMAGE_VERSION 3
+#define IMAGE_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+/* Shared image layout. Every reference is an offset from the start of
+ * the image, so it reads the same at any address in any process:
+ *
+ *   ConfigImage | ImageSection[], section index | per section: ImageEntry[], index | strings
+ */
+struct ConfigImage
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t section_count;
+	uint64_t size;
+	uint64_t entry_count;
+	uint32_t flags;        /* CONFIG_ICASE of the exported config */
+	uint32_t section_index_size; /* Power of two, or 0 */
+	uint64_t section_index;  /* uint32_t[section_index_size], section number + 1 */
+	uint64_t fingerprint[2]; /* Of the exported config, hi then lo */
+};
+
+typedef struct
+{
+	uint64_t name;         /* NUL-terminated */
+	uint64_t entries;      /* ImageEntry[entry_count], in source order */
+	uint64_t index;        /* uint32_t[index_size], entry number + 1 */
+	uint32_t entry_count;
+	uint32_t index_size;   /* Power of two, or 0 */
+	uint32_t name_len;
+	uint32_t name_hash;
+} ImageSection;
+
+typedef struct
+{
+	uint64_t key;          /* NUL-terminated */
+	uint64_t value;        /* NUL-terminated, references expanded */
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t hash;
+	uint32_t reserved;
+} ImageEntry;
+
+// ==================== Helpers ====================
+
+/**
+ * FNV-1a hash of a key
+ */
+static uint32_t image_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Hash of KEY as the image indexes it
+ */
+static uint32_t image_key_hash(uint32_t flags, const char *key, size_t len)
+{
+	return (flags & CONFIG_ICASE) ? cparse_fold_hash(key, len) : image_hash(key);
+}
+
+/**
+ * Compare two keys of LEN_A and LEN_B bytes as the image matches them
+ */
+static int image_key_equal(uint32_t flags, const char *a, size_t len_a, const char *b, size_t len_b)
+{
+	if (len_a != len_b) return 0;
+	return (flags & CONFIG_ICASE) ? cparse_fold_equal(a, b, len_a) : memcmp(a, b, len_a) == 0;
+}
+
+/**
+ * Index slots for COUNT entries, load factor at most 1/2
+ */
+static uint32_t image_index_size(size_t count)
+{
+	uint32_t size = count ? 2 : 0;
+	while (size && size < count * 2) {
+		size *= 2;
+	}
+	return size;
+}
+
+/**
+ * Check that [OFF, OFF + LEN) lies within the image
+ */
+static int image_range(const struct ConfigImage *img, uint64_t off, uint64_t len)
+{
+	return off <= img->size && len <= img->size - off;
+}
+
+/**
+ * Check that a string of LEN bytes and its NUL lie within the image
+ */
+static int image_string(const struct ConfigImage *img, uint64_t off, uint64_t len)
+{
+	return image_range(img, off, len + 1) && ((const char *)img)[off + len] == '\0';
+}
+
+static const ImageSection *image_sections(const struct ConfigImage *img)
+{
+	return (const ImageSection *)(img + 1);
+}
+
+// ==================== Export ====================
+
+/**
+ * Write the image of CONFIG into BASE, or only size it when BASE is
+ * NULL. Returns the image size, 0 on error.
+ */
+static uint64_t image_build(Config *config, char *base)
+{
+	uint32_t flags = config->flags & CONFIG_ICASE;
+	uint32_t section_count = 0;
+	uint64_t entry_count = 0;
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (cs->flags & SECTION_INCLUDE) continue;
+		section_count++;
+	}
+
+	uint64_t pos = sizeof(struct ConfigImage) + section_count * sizeof(ImageSection);
+	ImageSection *sections = base ? (ImageSection *)(base + sizeof(struct ConfigImage)) : NULL;
+
+	/* Sections by name, the first of a name wins as in cparse_find() */
+	uint32_t section_index_size = image_index_size(section_count);
+	uint32_t *section_index = base ? (uint32_t *)(base + pos) : NULL;
+	uint64_t section_index_pos = pos;
+	pos += (uint64_t)section_index_size * sizeof(uint32_t);
+	pos = (pos + 7) & ~(uint64_t)7;
+
+	/* Entry tables and their indexes */
+	uint32_t si = 0;
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (cs->flags & SECTION_INCLUDE) continue;
+
+		uint32_t n = 0;
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) n++;
+
+		uint32_t index_size = image_index_size(n);
+		if (sections) {
+			sections[si].entries = pos;
+			sections[si].entry_count = n;
+			sections[si].index = pos + (uint64_t)n * sizeof(ImageEntry);
+			sections[si].index_size = index_size;
+		}
+		pos += (uint64_t)n * sizeof(ImageEntry) + (uint64_t)index_size * sizeof(uint32_t);
+		pos = (pos + 7) & ~(uint64_t)7;
+		entry_count += n;
+		si++;
+	}
+
+	/* String table */
+	si = 0;
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (cs->flags & SECTION_INCLUDE) continue;
+
+		size_t name_len = strlen(cs->name);
+		if (name_len > UINT32_MAX) return 0;
+		if (sections) {
+			ImageSection *is = &sections[si];
+			is->name = pos;
+			is->name_len = name_len;
+			is->name_hash = image_key_hash(flags, cs->name, name_len);
+			memcpy(base + pos, cs->name, name_len + 1);
+
+			uint32_t mask = section_index_size - 1;
+			uint32_t slot = is->name_hash & mask;
+			for (; section_index[slot]; slot = (slot + 1) & mask) {
+				const ImageSection *other = &sections[section_index[slot] - 1];
+				if (other->name_hash == is->name_hash &&
+				    image_key_equal(flags, base + other->name, other->name_len,
+						cs->name, name_len)) break;
+			}
+			if (!section_index[slot]) section_index[slot] = si + 1;
+		}
+		pos += name_len + 1;
+
+		ImageEntry *entries = sections ? (ImageEntry *)(base + sections[si].entries) : NULL;
+		uint32_t *index = sections ? (uint32_t *)(base + sections[si].index) : NULL;
+		uint32_t mask = sections ? sections[si].index_size - 1 : 0;
+		uint32_t n = 0;
+
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next, n++) {
+			/* Expanded once here, never on read */
+			size_t value_len = 0;
+			const char *value = cparse_entry_value(config, cs, ce, &value_len);
+			if (!value || value_len > UINT32_MAX) return 0;
+
+			if (entries) {
+				ImageEntry *ie = &entries[n];
+				ie->key = pos;
+				ie->key_len = ce->key_len;
+				ie->hash = image_key_hash(flags, entry_key(ce), ce->key_len);
+				memcpy(base + pos, entry_key(ce), ce->key_len + 1);
+				ie->value = pos + ce->key_len + 1;
+				ie->value_len = value_len;
+				memcpy(base + ie->value, value, value_len);
+				base[ie->value + value_len] = '\0';
+
+				/* The first of duplicate keys wins, as in cparse_find() */
+				uint32_t slot = ie->hash & mask;
+				for (; index[slot]; slot = (slot + 1) & mask) {
+					const ImageEntry *other = &entries[index[slot] - 1];
+					if (other->hash == ie->hash &&
+					    image_key_equal(flags, base + other->key, other->key_len,
+							base + ie->key, ie->key_len)) break;
+				}
+				if (!index[slot]) index[slot] = n + 1;
+			}
+			pos += ce->key_len + 1 + value_len + 1;
+		}
+		si++;
+	}
+
+	if (base) {
+		struct ConfigImage *img = (struct ConfigImage *)base;
+		memcpy(img->magic, IMAGE_MAGIC, sizeof(img->magic));
+		img->version = IMAGE_VERSION;
+		img->section_count = section_count;
+		img->size = pos;
+		img->entry_count = entry_count;
+		img->flags = flags;
+		img->section_index = section_index_pos;
+		img->section_index_size = section_index_size;
+		img->fingerprint[0] = config->fingerprint.hi;
+		img->fingerprint[1] = config->fingerprint.lo;
+	}
+
+	return pos;
+}
+
+/**
+ * Export CONFIG as a read-only image in a sealed memfd. The image is
+ * self-relative, so any process that gets the descriptor (fork, or a
+ * unix socket) can map it with cparse_image_attach().
+ * Returns the descriptor, or -1.
+ */
+int cparse_image_export(Config *config)
+{
+	if (!config) return -1;
+	if (config->image) {
+		cparse_set_error(NULL, "Config is already a shared image");
+		return -1;
+	}
+	if (!cparse_lazy_load_all(config)) return -1;
+
+	uint64_t size = image_build(config, NULL);
+	if (size == 0) return -1;
+
+	int fd = memfd_create("xconfig", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		cparse_set_error(NULL, "Cannot create shared memory: %s", strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		cparse_set_error(NULL, "Cannot size shared memory: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		cparse_set_error(NULL, "Cannot map shared memory: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* The memfd is zero-filled, free index slots stay 0 */
+	uint64_t built = image_build(config, base);
+	munmap(base, size);
+
+	/* A value that cannot be expanded, the error is set already */
+	if (built != size) {
+		close(fd);
+		return -1;
+	}
+
+	/* No writable mapping is left, seal it for good */
+	if (fcntl(fd, F_ADD_SEALS, IMAGE_SEALS) < 0) {
+		cparse_set_error(NULL, "Cannot seal shared memory: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// ==================== Attach ====================
+
+/**
+ * Check every offset of IMG once, reads then need no checks
+ */
+static int image_validate(const struct ConfigImage *img, size_t size)
+{
+	if (size < sizeof(struct ConfigImage) ||
+	    memcmp(img->magic, IMAGE_MAGIC, sizeof(img->magic)) != 0 ||
+	    img->version != IMAGE_VERSION || img->size != size ||
+	    !image_range(img, sizeof(struct ConfigImage),
+			(uint64_t)img->section_count * sizeof(ImageSection))) {
+		return 0;
+	}
+
+	const char *base = (const char *)img;
+	const ImageSection *sections = image_sections(img);
+
+	/* Probing stops at a free slot, there must be one */
+	if (!image_range(img, img->section_index, (uint64_t)img->section_index_size * sizeof(uint32_t)) ||
+	    (img->section_index_size & (img->section_index_size - 1)) ||
+	    (img->section_count && !img->section_index_size) ||
+	    img->section_index % 4) {
+		return 0;
+	}
+	const uint32_t *section_index = (const uint32_t *)(base + img->section_index);
+	uint32_t free_sections = 0;
+	for (uint32_t i = 0; i < img->section_index_size; i++) {
+		if (section_index[i] > img->section_count) return 0;
+		free_sections += section_index[i] == 0;
+	}
+	if (img->section_index_size && !free_sections) return 0;
+
+	for (uint32_t s = 0; s < img->section_count; s++) {
+		const ImageSection *is = &sections[s];
+
+		if (!image_range(img, is->entries, (uint64_t)is->entry_count * sizeof(ImageEntry)) ||
+		    !image_range(img, is->index, (uint64_t)is->index_size * sizeof(uint32_t)) ||
+		    (is->index_size & (is->index_size - 1)) ||
+		    (is->entry_count && !is->index_size) ||
+		    is->entries % 8 || is->index % 4 ||
+		    !image_string(img, is->name, is->name_len)) {
+			return 0;
+		}
+
+		const ImageEntry *entries = (const ImageEntry *)(base + is->entries);
+		for (uint32_t e = 0; e < is->entry_count; e++) {
+			if (!image_string(img, entries[e].key, entries[e].key_len) ||
+			    !image_string(img, entries[e].value, entries[e].value_len)) {
+				return 0;
+			}
+		}
+
+		const uint32_t *index = (const uint32_t *)(base + is->index);
+		uint32_t free_slots = 0;
+		for (uint32_t i = 0; i < is->index_size; i++) {
+			if (index[i] > is->entry_count) return 0;
+			free_slots += index[i] == 0;
+		}
+		if (is->index_size && !free_slots) return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Map the sealed image FD read-only. Nothing is parsed or copied,
+ * the returned config only points into the shared pages.
+ */
+Config *cparse_image_attach(int fd)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		cparse_set_error(NULL, "Invalid shared image: %s", strerror(errno));
+		return NULL;
+	}
+
+	/* An unsealed image could change under the readers */
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+		cparse_set_error(NULL, "Shared image is not sealed");
+		return NULL;
+	}
+
+	size_t size = sb.st_size;
+	void *base = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (base == MAP_FAILED) {
+		cparse_set_error(NULL, "Cannot map shared image: %s", size ? strerror(errno) : "empty");
+		return NULL;
+	}
+
+	if (!image_validate(base, size)) {
+		cparse_set_error(NULL, "Invalid shared image");
+		munmap(base, size);
+		return NULL;
+	}
+
+	Config *config = calloc(1, sizeof(Config));
+	if (!config) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		munmap(base, size);
+		return NULL;
+	}
+
+	config->image = base;
+	config->image_size = size;
+	config->section_count = config->image->section_count;
+	config->entry_count = config->image->entry_count;
+	return config;
+}
+
+/**
+ * Unmap the image of CONFIG
+ */
+void cparse_image_free(Config *config)
+{
+	if (config && config->image) {
+		munmap((void *)config->image, config->image_size);
+		config->image = NULL;
+		config->image_size = 0;
+	}
+}
+
+// ==================== Query ====================
+
+/**
+ * Fingerprint of the config IMG was exported from, values there are
+ * expanded but the fingerprint is of what was stored
+ */
+void cparse_image_fingerprint(const ConfigImage *img, XConfigFingerprint *fp)
+{
+	fp->hi = img->fingerprint[0];
+	fp->lo = img->fingerprint[1];
+}
+
+/**
+ * Look up KEY in one section of the image, the length of its value
+ * goes to VALUE_LEN if not NULL
+ */
+static const char *image_find(const struct ConfigImage *img, const ImageSection *is,
+				const char *key, size_t len, uint32_t hash, size_t *value_len)
+{
+	if (is->index_size == 0) return NULL;
+
+	const char *base = (const char *)img;
+	const ImageEntry *entries = (const ImageEntry *)(base + is->entries);
+	const uint32_t *index = (const uint32_t *)(base + is->index);
+	uint32_t mask = is->index_size - 1;
+
+	for (uint32_t slot = hash & mask; index[slot]; slot = (slot + 1) & mask) {
+		const ImageEntry *ie = &entries[index[slot] - 1];
+		if (ie->hash == hash && image_key_equal(img->flags, base + ie->key, ie->key_len, key, len)) {
+			if (value_len) *value_len = ie->value_len;
+			return base + ie->value;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find the first section named NAME through the section index
+ */
+static const ImageSection *image_section(const struct ConfigImage *img, const char *name, size_t len)
+{
+	if (img->section_index_size == 0) return NULL;
+
+	const char *base = (const char *)img;
+	const ImageSection *sections = image_sections(img);
+	const uint32_t *index = (const uint32_t *)(base + img->section_index);
+	uint32_t hash = image_key_hash(img->flags, name, len);
+	uint32_t mask = img->section_index_size - 1;
+
+	for (uint32_t slot = hash & mask; index[slot]; slot = (slot + 1) & mask) {
+		const ImageSection *is = &sections[index[slot] - 1];
+		if (is->name_hash == hash &&
+		    image_key_equal(img->flags, base + is->name, is->name_len, name, len)) {
+			return is;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Read a value from a shared image, the same lookup as cparse_read():
+ * a NULL section searches all sections in order
+ */
+const char *cparse_image_read(const ConfigImage *img, const char *section, const char *key,
+				size_t *value_len)
+{
+	if (!img || !key) return NULL;
+
+	size_t len = strlen(key);
+	uint32_t hash = image_key_hash(img->flags, key, len);
+
+	if (section) {
+		const ImageSection *is = image_section(img, section, strlen(section));
+		return is ? image_find(img, is, key, len, hash, value_len) : NULL;
+	}
+
+	const ImageSection *sections = image_sections(img);
+	for (uint32_t s = 0; s < img->section_count; s++) {
+		const char *value = image_find(img, &sections[s], key, len, hash, value_len);
+		if (value) return value;
+	}
+
+	return NULL;
+}
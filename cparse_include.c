@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+typedef struct IncludeFile IncludeFile;
+
+struct IncludeFile
+{
+	char *path;             /* Canonical path, NULL for a string source */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	Config *config;
+	IncludeFile **children; /* Resolved directives, in source order */
+	size_t child_count;
+	int visiting;           /* On the current splice path */
+	unsigned flags;         /* Parse flags taken from the root, CONFIG_FAIL_FAST */
+	size_t diag_limit;
+	char error[MAX_ERRBUF];
+};
+
+/* Files of one load, every file is parsed once */
+typedef struct
+{
+	IncludeFile **files;
+	size_t count;
+	size_t capacity;
+} IncludeList;
+
+// ==================== Include Cache ====================
+
+/**
+ * Find a cached file by path, inode and modification time
+ */
+static IncludeFile *cache_find(IncludeList *cache, const char *path, const struct stat *sb)
+{
+	for (size_t i = 0; i < cache->count; i++) {
+		IncludeFile *f = cache->files[i];
+		if (f->path && f->dev == sb->st_dev && f->ino == sb->st_ino &&
+		    f->mtime.tv_sec == sb->st_mtim.tv_sec &&
+		    f->mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+		    strcmp(f->path, path) == 0) {
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Append FILE to LIST
+ */
+static int list_push(IncludeList *list, IncludeFile *file)
+{
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * BUFFER_GROWTH_FACTOR : 8;
+		IncludeFile **files = realloc(list->files, capacity * sizeof(*files));
+		if (!files) {
+			return 0;
+		}
+		list->files = files;
+		list->capacity = capacity;
+	}
+
+	list->files[list->count++] = file;
+	return 1;
+}
+
+/**
+ * Add a new (not yet loaded) file to the cache
+ */
+static IncludeFile *cache_add(IncludeList *cache, char *path, const struct stat *sb)
+{
+	IncludeFile *f = calloc(1, sizeof(IncludeFile));
+	if (!f || !list_push(cache, f)) {
+		free(f);
+		return NULL;
+	}
+
+	f->path = path;
+	if (sb) {
+		f->dev = sb->st_dev;
+		f->ino = sb->st_ino;
+		f->mtime = sb->st_mtim;
+	}
+
+	return f;
+}
+
+/**
+ * Free all cached files and their configurations
+ */
+static void cache_free(IncludeList *cache)
+{
+	for (size_t i = 0; i < cache->count; i++) {
+		IncludeFile *f = cache->files[i];
+		cparse_free(f->config);
+		free(f->children);
+		free(f->path);
+		free(f);
+	}
+
+	free(cache->files);
+	memset(cache, 0, sizeof(IncludeList));
+}
+
+// ==================== Discovery ====================
+
+/**
+ * Resolve PATH relative to the directory of OWNER, returns canonical path
+ */
+static char *include_resolve_path(const char *owner, const char *path)
+{
+	char joined[PATH_MAX];
+	const char *slash = owner ? strrchr(owner, '/') : NULL;
+
+	if (path[0] == '/' || !slash) {
+		return realpath(path, NULL);
+	}
+
+	int n = snprintf(joined, sizeof(joined), "%.*s/%s", (int)(slash - owner), owner, path);
+	if (n < 0 || (size_t)n >= sizeof(joined)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return realpath(joined, NULL);
+}
+
+/**
+ * Resolve the directives of FILE into cached files. Files that are
+ * not loaded yet are appended to BATCH.
+ */
+static int include_collect(IncludeList *cache, IncludeFile *file, IncludeList *batch)
+{
+	size_t count = file->config->include_count;
+
+	file->children = calloc(count, sizeof(IncludeFile *));
+	if (!file->children) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	for (ConfigSection *cs = file->config->sections; cs; cs = cs->next) {
+		if (!(cs->flags & SECTION_INCLUDE)) continue;
+
+		for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+			struct stat sb;
+			char *path = include_resolve_path(file->path, entry_value(ce));
+
+			if (!path || stat(path, &sb) < 0) {
+				cparse_set_error(NULL, "Cannot include '%s': %s", entry_value(ce), strerror(errno));
+				free(path);
+				return 0;
+			}
+
+			IncludeFile *child = cache_find(cache, path, &sb);
+			if (child) {
+				free(path);
+			} else {
+				child = cache_add(cache, path, &sb);
+				if (!child) {
+					free(path);
+					cparse_set_error(NULL, "Failed to allocate memory");
+					return 0;
+				}
+				if (!list_push(batch, child)) {
+					cparse_set_error(NULL, "Failed to allocate memory");
+					return 0;
+				}
+			}
+
+			file->children[file->child_count++] = child;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Worker: read and parse one included file
+ */
+static void include_load_worker(void *arg, size_t index)
+{
+	IncludeFile *f = ((IncludeFile **)arg)[index];
+	CPState st;
+
+	memset(&st, 0, sizeof(CPState));
+	st.type = P_STR;
+	st.str = cparse_read_file(f->path, &st.len);
+	st.path = f->path;
+	st.flags = f->flags;
+
+	if (!st.str) {
+		snprintf(f->error, MAX_ERRBUF, "Cannot read '%s': %s", f->path, strerror(errno));
+		return;
+	}
+
+	/* Workers keep as many diagnostics as the thread that started the load */
+	cparse_set_diag_limit(f->diag_limit);
+	f->config = cparse_parse(&st);
+	if (!f->config) {
+		snprintf(f->error, MAX_ERRBUF, "%s: %s", f->path, cparse_get_error());
+	}
+
+	cparse_cleanup(&st);
+}
+
+// ==================== Splicing ====================
+
+/**
+ * Copy FILE into DST, expanding include directives in place
+ */
+static int include_splice(Config *dst, IncludeFile *file)
+{
+	if (file->visiting) {
+		cparse_set_error(NULL, "Include cycle detected at '%s'", file->path);
+		return 0;
+	}
+	file->visiting = 1;
+
+	size_t child = 0;
+	for (ConfigSection *cs = file->config->sections; cs; cs = cs->next) {
+		if (cs->flags & SECTION_INCLUDE) {
+			for (ConfigEntry *ce = cs->entries; ce; ce = ce->next) {
+				if (!include_splice(dst, file->children[child++])) {
+					return 0;
+				}
+			}
+			continue;
+		}
+
+		if (!config_merge_section(dst, cs, 0)) {
+			cparse_set_error(NULL, "Failed to merge section '%s'", cs->name);
+			return 0;
+		}
+	}
+
+	file->visiting = 0;
+	return 1;
+}
+
+// ==================== Resolution ====================
+
+/**
+ * Resolve include directives of CONFIG loaded from PATH (NULL when it
+ * came from a string). Included files are loaded level by level on a
+ * small worker pool, every file once per load, then spliced in source
+ * order so the result does not depend on thread scheduling.
+ * CONFIG is consumed, returns the merged configuration or NULL.
+ */
+Config *cparse_include_resolve(Config *config, const char *path)
+{
+	IncludeList cache = { NULL, 0, 0 };
+	IncludeList batch = { NULL, 0, 0 };
+	Config *result = NULL;
+	struct stat sb;
+
+	if (!config) return NULL;
+
+	/* The root file is part of the cache, so self-includes are cycles */
+	char *root_path = path ? realpath(path, NULL) : NULL;
+	IncludeFile *root = cache_add(&cache, root_path,
+				root_path && stat(root_path, &sb) == 0 ? &sb : NULL);
+	if (!root) {
+		free(root_path);
+		cparse_free(config);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+	root->config = config;
+
+	size_t done = 0; /* Files whose directives are collected */
+	while (done < cache.count) {
+		/* Collect the next level */
+		size_t level_end = cache.count;
+		for (; done < level_end; done++) {
+			IncludeFile *f = cache.files[done];
+			if (f->config->include_count > 0 && !include_collect(&cache, f, &batch)) {
+				goto out;
+			}
+		}
+
+		if (batch.count == 0) break;
+
+		for (size_t i = 0; i < batch.count; i++) {
+			batch.files[i]->flags = config->flags & CONFIG_FAIL_FAST;
+			batch.files[i]->diag_limit = config->diags.limit;
+		}
+
+		/* Load it in parallel */
+		cparse_pool_run(batch.count, INCLUDE_MAX_THREADS, include_load_worker, batch.files);
+
+		for (size_t i = 0; i < batch.count; i++) {
+			if (!batch.files[i]->config) {
+				cparse_set_error(NULL, "%s", batch.files[i]->error);
+				goto out;
+			}
+		}
+		batch.count = 0;
+	}
+
+	result = calloc(1, sizeof(Config));
+	if (result) {
+		/* Spliced entries have no place in one source text */
+		result->flags = config->flags & ~(CONFIG_PRESERVE | CONFIG_LAZY);
+		result->diags.limit = config->diags.limit;
+	}
+	if (!result || !config_add_section(result, "")) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		free(result);
+		result = NULL;
+		goto out;
+	}
+
+	if (!include_splice(result, root)) {
+		cparse_free(result);
+		result = NULL;
+		goto out;
+	}
+
+	/* Lines of included files are given with their path */
+	for (size_t i = 0; i < cache.count; i++) {
+		IncludeFile *f = cache.files[i];
+		if (!cparse_diag_merge(result, f->config, f == root ? NULL : f->path)) {
+			cparse_free(result);
+			result = NULL;
+			break;
+		}
+	}
+
+out:
+	free(batch.files);
+	cache_free(&cache);
+	return result;
+}
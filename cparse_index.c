@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+/* Open addressing table of a section's keys, repeated keys once */
+struct ConfigKeyTable
+{
+	size_t size;          /* Power of two, at least twice the keys */
+	size_t count;
+	struct
+	{
+		uint32_t hash;    /* cparse_fold_hash() of the key */
+		ConfigEntry *entry;
+	} slots[];
+};
+
+/* Open addressing table of section names, the first section of a name */
+struct ConfigSectionTable
+{
+	size_t size;          /* Power of two, at least twice the names */
+	size_t count;
+	ConfigSection *slots[];
+};
+
+// ==================== Sorted Key Index ====================
+
+/**
+ * Stable merge sort of COUNT entries by key, TMP holds COUNT pointers
+ */
+static void index_sort(const Config *config, ConfigEntry **entries, ConfigEntry **tmp, size_t count)
+{
+	for (size_t width = 1; width < count; width *= 2) {
+		for (size_t lo = 0; lo < count; lo += 2 * width) {
+			size_t mid = lo + width < count ? lo + width : count;
+			size_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+			size_t a = lo, b = mid, out = lo;
+
+			while (a < mid && b < hi) {
+				/* Ties keep source order, so the first key stays first */
+				tmp[out++] = config_key_compare(config, entry_key(entries[b]),
+								entry_key(entries[a]), SIZE_MAX) < 0
+					? entries[b++] : entries[a++];
+			}
+			while (a < mid) tmp[out++] = entries[a++];
+			while (b < hi) tmp[out++] = entries[b++];
+		}
+		memcpy(entries, tmp, count * sizeof(ConfigEntry *));
+	}
+}
+
+/**
+ * Build the sorted key array of SECTION. Repeated keys keep only the
+ * entry a lookup would find.
+ */
+static ConfigIndex *index_build(const Config *config, ConfigSection *section)
+{
+	size_t count = 0;
+	for (ConfigEntry *ce = section->entries; ce; ce = ce->next) count++;
+
+	ConfigIndex *index = malloc(sizeof(ConfigIndex) + count * sizeof(ConfigEntry *));
+	ConfigEntry **tmp = malloc((count ? count : 1) * sizeof(ConfigEntry *));
+	if (!index || !tmp) {
+		free(index);
+		free(tmp);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	size_t n = 0;
+	for (ConfigEntry *ce = section->entries; ce; ce = ce->next) {
+		index->entries[n++] = ce;
+	}
+	index_sort(config, index->entries, tmp, n);
+	free(tmp);
+
+	index->count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (index->count == 0 ||
+		    config_key_compare(config, entry_key(index->entries[index->count - 1]),
+					entry_key(index->entries[i]), SIZE_MAX) != 0) {
+			index->entries[index->count++] = index->entries[i];
+		}
+	}
+
+	return index;
+}
+
+/**
+ * Sorted key array of SECTION, built on first use. Concurrent readers
+ * may both build it, one copy is published and the other dropped.
+ */
+static const ConfigIndex *index_get(const Config *config, ConfigSection *section)
+{
+	ConfigIndex *index = __atomic_load_n(&section->index, __ATOMIC_ACQUIRE);
+	if (index) return index;
+	if (!section_ready(config, section)) return NULL;
+
+	index = index_build(config, section);
+	if (!index) return NULL;
+
+	ConfigIndex *expected = NULL;
+	if (!__atomic_compare_exchange_n(&section->index, &expected, index, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(index);
+		index = expected;
+	}
+
+	return index;
+}
+
+/**
+ * Drop the sorted and hashed keys of SECTION after its keys changed
+ */
+void cparse_index_invalidate(ConfigSection *section)
+{
+	if (section) {
+		free(section->index);
+		section->index = NULL;
+		free(section->keys);
+		section->keys = NULL;
+	}
+}
+
+/**
+ * Empty the key table of SECTION in place and drop its sorted keys,
+ * or with no SECTION, the section table of CONFIG. The tables of a
+ * reset config are filled again by the adds of the next parse.
+ */
+void cparse_index_clear(Config *config, ConfigSection *section)
+{
+	if (!section) {
+		ConfigSectionTable *table = config->section_table;
+		if (table) {
+			memset(table->slots, 0, table->size * sizeof(ConfigSection *));
+			table->count = 0;
+		}
+		return;
+	}
+
+	free(section->index);
+	section->index = NULL;
+
+	ConfigKeyTable *table = section->keys;
+	if (table) {
+		memset(table->slots, 0, table->size * sizeof(table->slots[0]));
+		table->count = 0;
+	}
+}
+
+/**
+ * First position whose key is not below KEY
+ */
+static size_t index_lower_bound(const Config *config, const ConfigIndex *index, const char *key)
+{
+	size_t lo = 0, hi = index->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (config_key_compare(config, entry_key(index->entries[mid]), key, SIZE_MAX) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// ==================== Scans ====================
+
+/**
+ * Call FN for the keys of SECTION in order, from the first key not
+ * below FROM, while the key starts with FROM (PREFIX set) or is below
+ * TO (NULL: to the end). The cost is a binary search plus the number
+ * of keys visited. Returns 0 on error, FN returning non-zero stops
+ * the scan successfully.
+ */
+int cparse_scan(Config *config, const char *section, const char *from, const char *to,
+		int prefix, XConfigScanFn fn, void *user)
+{
+	if (!config || !fn) return 0;
+
+	if (config->image) {
+		cparse_set_error(NULL, "Key scans are not supported on a shared image");
+		return 0;
+	}
+
+	ConfigSection *cs = config_find_section(config, section ? section : "");
+	if (!cs) {
+		cparse_set_error(NULL, "Section not found");
+		return 0;
+	}
+
+	const ConfigIndex *index = index_get(config, cs);
+	if (!index) return 0;
+
+	size_t from_len = from ? strlen(from) : 0;
+	size_t i = from ? index_lower_bound(config, index, from) : 0;
+
+	for (; i < index->count; i++) {
+		ConfigEntry *ce = index->entries[i];
+		const char *key = entry_key(ce);
+
+		if (prefix ? config_key_compare(config, key, from, from_len) != 0
+			   : (to && config_key_compare(config, key, to, SIZE_MAX) >= 0)) {
+			break;
+		}
+
+		const char *value = cparse_entry_value(config, cs, ce, NULL);
+		if (!value) return 0;
+
+		if (fn(user, key, value)) break;
+	}
+
+	return 1;
+}
+
+// ==================== Hashed Lookup ====================
+
+/**
+ * Compare an entry's key with KEY of LEN bytes
+ */
+static int table_key_equal(const Config *config, const ConfigEntry *entry,
+				const char *key, size_t len)
+{
+	if (config->flags & CONFIG_ICASE) {
+		return entry->key_len == len && cparse_fold_equal(entry_key(entry), key, len);
+	}
+	return entry->key_len == len && memcmp(entry_key(entry), key, len) == 0;
+}
+
+/**
+ * Find KEY in TABLE
+ */
+static ConfigEntry *table_find(const Config *config, const ConfigKeyTable *table,
+				const char *key, size_t len, uint32_t hash)
+{
+	size_t mask = table->size - 1;
+
+	for (size_t i = hash & mask; table->slots[i].entry; i = (i + 1) & mask) {
+		if (table->slots[i].hash == hash && table_key_equal(config, table->slots[i].entry, key, len)) {
+			return table->slots[i].entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Build the key table of SECTION. Folded hashes of a CONFIG_ICASE
+ * config are taken from the entries, others are hashed once here.
+ */
+static ConfigKeyTable *table_build(const Config *config, ConfigSection *section)
+{
+	size_t count = 0;
+	for (ConfigEntry *ce = section->entries; ce; ce = ce->next) count++;
+
+	size_t size = 8;
+	while (size < count * 2) size *= 2;
+
+	ConfigKeyTable *table = calloc(1, sizeof(ConfigKeyTable) + size * sizeof(table->slots[0]));
+	if (!table) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+	table->size = size;
+
+	for (ConfigEntry *ce = section->entries; ce; ce = ce->next) {
+		uint32_t hash = (ce->flags & ENTRY_HASH) ? entry_hash(ce)
+			: cparse_fold_hash(entry_key(ce), ce->key_len);
+
+		/* The first of repeated keys wins */
+		if (table_find(config, table, entry_key(ce), ce->key_len, hash)) continue;
+
+		size_t i = hash & (size - 1);
+		while (table->slots[i].entry) i = (i + 1) & (size - 1);
+		table->slots[i].hash = hash;
+		table->slots[i].entry = ce;
+		table->count++;
+	}
+
+	return table;
+}
+
+/**
+ * Key table of SECTION, built on first use like the sorted keys
+ */
+static const ConfigKeyTable *table_get(const Config *config, ConfigSection *section)
+{
+	ConfigKeyTable *table = __atomic_load_n(&section->keys, __ATOMIC_ACQUIRE);
+	if (table) return table;
+	if (!section_ready(config, section)) return NULL;
+
+	table = table_build(config, section);
+	if (!table) return NULL;
+
+	ConfigKeyTable *expected = NULL;
+	if (!__atomic_compare_exchange_n(&section->keys, &expected, table, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(table);
+		table = expected;
+	}
+
+	return table;
+}
+
+/**
+ * ENTRY was appended to SECTION: the sorted keys are dropped, a key
+ * table takes the entry unless its key is there already, so adding
+ * keys one by one does not rebuild it each time. A table more than
+ * half full is dropped and rebuilt twice as large by the next lookup.
+ */
+void cparse_index_added(const Config *config, ConfigSection *section, ConfigEntry *entry)
+{
+	free(section->index);
+	section->index = NULL;
+
+	ConfigKeyTable *table = section->keys;
+	if (!table) return;
+
+	uint32_t hash = (entry->flags & ENTRY_HASH) ? entry_hash(entry)
+		: cparse_fold_hash(entry_key(entry), entry->key_len);
+	if (table_find(config, table, entry_key(entry), entry->key_len, hash)) return;
+
+	if ((table->count + 1) * 2 > table->size) {
+		free(table);
+		section->keys = NULL;
+		return;
+	}
+
+	size_t i = hash & (table->size - 1);
+	while (table->slots[i].entry) i = (i + 1) & (table->size - 1);
+	table->slots[i].hash = hash;
+	table->slots[i].entry = entry;
+	table->count++;
+}
+
+/**
+ * Find KEY of LEN bytes, whose cparse_fold_hash() is HASH, in SECTION
+ * through its key table
+ */
+ConfigEntry *cparse_section_find(const Config *config, ConfigSection *section,
+				const char *key, size_t len, uint32_t hash)
+{
+	const ConfigKeyTable *table = table_get(config, section);
+	return table ? table_find(config, table, key, len, hash)
+		: config_find_entry(config, section, key);
+}
+
+/**
+ * Find entry by section and key whose cparse_fold_hash() values the
+ * caller computed already (possibly at compile time). Same result as
+ * cparse_find(), in constant time once a section's table is built.
+ */
+ConfigEntry *cparse_find_hashed(Config *config, const char *section, uint32_t section_hash,
+				const char *key, uint32_t key_hash, ConfigSection **where)
+{
+	if (!config || !key) return NULL;
+
+	size_t len = strlen(key);
+
+	if (section) {
+		ConfigSection *cs = cparse_index_section(config, section, section_hash);
+		ConfigEntry *entry = cs ? cparse_section_find(config, cs, key, len, key_hash) : NULL;
+		if (entry && where) *where = cs;
+		return entry;
+	}
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		ConfigEntry *entry = cparse_section_find(config, cs, key, len, key_hash);
+
+		if (entry) {
+			if (where) *where = cs;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+// ==================== Section Lookup ====================
+
+/**
+ * Find the first section named NAME in TABLE
+ */
+static ConfigSection *sections_find(const Config *config, const ConfigSectionTable *table,
+					const char *name, uint32_t hash)
+{
+	size_t mask = table->size - 1;
+
+	for (size_t i = hash & mask; table->slots[i]; i = (i + 1) & mask) {
+		ConfigSection *cs = table->slots[i];
+		if (cs->name_hash == hash && config_name_equal(config, cs->name, name)) {
+			return cs;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Put SECTION in TABLE unless a section of its name is there
+ */
+static void sections_put(const Config *config, ConfigSectionTable *table, ConfigSection *section)
+{
+	if (sections_find(config, table, section->name, section->name_hash)) return;
+
+	size_t i = section->name_hash & (table->size - 1);
+	while (table->slots[i]) i = (i + 1) & (table->size - 1);
+	table->slots[i] = section;
+	table->count++;
+}
+
+/**
+ * Build the section table of CONFIG with room for CAPACITY names
+ */
+static ConfigSectionTable *sections_build(const Config *config, size_t capacity)
+{
+	if (capacity < config->section_count) capacity = config->section_count;
+
+	size_t size = 16;
+	while (size < capacity * 2) size *= 2;
+
+	ConfigSectionTable *table = calloc(1, sizeof(ConfigSectionTable) + size * sizeof(ConfigSection *));
+	if (!table) return NULL;
+	table->size = size;
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		sections_put(config, table, cs);
+	}
+
+	return table;
+}
+
+/**
+ * Find the first section named NAME, whose cparse_fold_hash() is HASH.
+ * Past a few sections a table is built on first use, concurrent
+ * readers may both build it and one copy is published.
+ */
+ConfigSection *cparse_index_section(const Config *config, const char *name, uint32_t hash)
+{
+	ConfigSectionTable *table = __atomic_load_n(&config->section_table, __ATOMIC_ACQUIRE);
+
+	if (!table && config->section_count > SECTION_TABLE_MIN) {
+		table = sections_build(config, 0);
+		if (table) {
+			ConfigSectionTable *expected = NULL;
+			if (!__atomic_compare_exchange_n(&((Config *)config)->section_table, &expected, table, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				free(table);
+				table = expected;
+			}
+		}
+	}
+
+	if (table) return sections_find(config, table, name, hash);
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (cs->name_hash == hash && config_name_equal(config, cs->name, name)) {
+			return cs;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * SECTION was appended to CONFIG, keep its section table up to date
+ */
+void cparse_index_section_added(Config *config, ConfigSection *section)
+{
+	ConfigSectionTable *table = config->section_table;
+	if (!table) return;
+
+	if ((table->count + 1) * 2 > table->size) {
+		/* Rebuilt twice as large by the next lookup */
+		free(table);
+		config->section_table = NULL;
+		return;
+	}
+
+	sections_put(config, table, section);
+}
+
+/**
+ * Size the section table of CONFIG for CAPACITY sections in all
+ */
+int cparse_index_reserve_sections(Config *config, size_t capacity)
+{
+	ConfigSectionTable *table = config->section_table;
+	if (table && table->size >= capacity * 2) return 1;
+
+	table = sections_build(config, capacity);
+	if (!table) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	free(config->section_table);
+	config->section_table = table;
+	return 1;
+}
+
+// ==================== Batch Keys ====================
+
+/**
+ * Position of the first pair of KVS whose key is in SECTION already or
+ * in an earlier pair, COUNT if all keys are new. Keys of the batch are
+ * put in a temporary table, so the check is linear in COUNT.
+ */
+size_t cparse_index_find_taken(const Config *config, ConfigSection *section,
+				const XConfigKV *kvs, size_t count)
+{
+	if (!section_ready(config, section)) return (size_t)-1;
+
+	if (count >= UINT32_MAX) {
+		cparse_set_error(NULL, "Too many pairs in a batch");
+		return (size_t)-1;
+	}
+
+	size_t size = 8;
+	while (size < count * 2) size *= 2;
+
+	struct
+	{
+		uint32_t hash;
+		uint32_t pos;     /* Pair position plus one, 0 if free */
+	} *slots = calloc(size, sizeof(*slots));
+	if (!slots) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return (size_t)-1;
+	}
+
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const char *key = kvs[i].key;
+		size_t len = strlen(key);
+		uint32_t hash = cparse_fold_hash(key, len);
+
+		if (cparse_section_find(config, section, key, len, hash)) break;
+
+		size_t j = hash & (size - 1);
+		for (; slots[j].pos; j = (j + 1) & (size - 1)) {
+			if (slots[j].hash == hash && config_name_equal(config, kvs[slots[j].pos - 1].key, key)) {
+				break;
+			}
+		}
+		if (slots[j].pos) break;
+
+		slots[j].hash = hash;
+		slots[j].pos = i + 1;
+	}
+
+	free(slots);
+	return i;
+}
@@ -0,0 +1,271 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+typedef struct
+{
+	char *expanded;           /* Memoized value, NULL when stale */
+	size_t expanded_len;
+	ConfigEntry **dependents; /* Entries whose expansion used this one */
+	size_t dependent_count;
+	size_t dependent_capacity;
+	int resolving;            /* On the current resolution path */
+} InterpNode;
+
+struct ConfigInterp
+{
+	CPMap nodes;              /* ConfigEntry * -> InterpNode * */
+	pthread_mutex_t lock;
+};
+
+// ==================== Helpers ====================
+
+/**
+ * Get (or create) the node of ENTRY
+ */
+static InterpNode *interp_node(ConfigInterp *interp, ConfigEntry *entry)
+{
+	InterpNode *node = cparse_map_get(&interp->nodes, entry);
+	if (node) {
+		return node;
+	}
+
+	node = calloc(1, sizeof(InterpNode));
+	if (!node || !cparse_map_put(&interp->nodes, entry, node)) {
+		free(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+/**
+ * Remember that DEPENDENT's expansion used TARGET
+ */
+static int interp_add_dependent(ConfigInterp *interp, ConfigEntry *target, ConfigEntry *dependent)
+{
+	InterpNode *node = interp_node(interp, target);
+	if (!node) return 0;
+
+	for (size_t i = 0; i < node->dependent_count; i++) {
+		if (node->dependents[i] == dependent) return 1;
+	}
+
+	if (node->dependent_count == node->dependent_capacity) {
+		size_t capacity = node->dependent_capacity ? node->dependent_capacity * BUFFER_GROWTH_FACTOR : 4;
+		ConfigEntry **dependents = realloc(node->dependents, capacity * sizeof(ConfigEntry *));
+		if (!dependents) return 0;
+		node->dependents = dependents;
+		node->dependent_capacity = capacity;
+	}
+
+	node->dependents[node->dependent_count++] = dependent;
+	return 1;
+}
+
+// ==================== Expansion ====================
+
+/**
+ * Look up a reference 'section.key' (or 'key' in SECTION)
+ */
+static ConfigEntry *interp_lookup(Config *config, ConfigSection *section,
+				const char *ref, size_t len, ConfigSection **where)
+{
+	char *name = malloc(len + 1);
+	if (!name) return NULL;
+
+	memcpy(name, ref, len);
+	name[len] = '\0';
+
+	ConfigEntry *entry;
+	char *dot = strchr(name, '.');
+	if (dot) {
+		*dot = '\0';
+		entry = cparse_find(config, name, dot + 1, where);
+	} else {
+		entry = cparse_find(config, section->name, name, where);
+	}
+
+	if (!entry) {
+		cparse_set_error(NULL, "Undefined reference '${%.*s}'", (int)len, ref);
+	}
+
+	free(name);
+	return entry;
+}
+
+/**
+ * Expand ENTRY of SECTION, its length to LEN. Caller holds the lock.
+ */
+static const char *interp_expand(Config *config, ConfigSection *section, ConfigEntry *entry,
+				size_t *len)
+{
+	ConfigInterp *interp = config->interp;
+	InterpNode *node = interp_node(interp, entry);
+
+	if (!node) return NULL;
+	if (node->expanded) {
+		*len = node->expanded_len;
+		return node->expanded;
+	}
+
+	if (node->resolving) {
+		cparse_set_error(NULL, "Interpolation cycle at '%s.%s'", section->name, entry_key(entry));
+		return NULL;
+	}
+	node->resolving = 1;
+
+	CPBuf buf = { NULL, 0, 0 };
+	const char *p = entry_value(entry);
+	const char *stop = p + entry_value_len(entry);
+	int ok = 1;
+
+	while (ok && p < stop) {
+		const char *ref = cparse_find_ref(p, stop - p);
+		const char *end = ref ? memchr(ref + 2, '}', stop - ref - 2) : NULL;
+
+		if (!ref || !end) {
+			ok = cparse_buf_append(&buf, p, stop - p);
+			break;
+		}
+
+		/* '$${' is a literal '${' */
+		if (ref > p && ref[-1] == '$') {
+			ok = cparse_buf_append(&buf, p, ref - p - 1) && cparse_buf_append(&buf, "${", 2);
+			p = ref + 2;
+			continue;
+		}
+
+		ok = cparse_buf_append(&buf, p, ref - p);
+		if (!ok) break;
+
+		ConfigSection *target_section = NULL;
+		ConfigEntry *target = interp_lookup(config, section, ref + 2, end - ref - 2, &target_section);
+		const char *value = NULL;
+		size_t value_len = 0;
+
+		if (target && (target->flags & ENTRY_REFS)) {
+			value = interp_expand(config, target_section, target, &value_len);
+		} else if (target) {
+			value = entry_value(target);
+			value_len = entry_value_len(target);
+		}
+
+		ok = value && interp_add_dependent(interp, target, entry) &&
+			cparse_buf_append(&buf, value, value_len);
+		p = end + 1;
+	}
+
+	node->resolving = 0;
+
+	if (!ok) {
+		free(buf.data);
+		return NULL;
+	}
+
+	node->expanded = buf.data ? buf.data : calloc(1, 1);
+	node->expanded_len = buf.len;
+	*len = buf.len;
+	return node->expanded;
+}
+
+/**
+ * Create interpolation state, done while the config is being built
+ */
+int cparse_interp_init(Config *config)
+{
+	if (!config) return 0;
+	if (config->interp) return 1;
+
+	ConfigInterp *interp = calloc(1, sizeof(ConfigInterp));
+	if (!interp) {
+		return 0;
+	}
+
+	pthread_mutex_init(&interp->lock, NULL);
+	config->interp = interp;
+	return 1;
+}
+
+/**
+ * Expanded value of an entry with references, memoized until
+ * something it depends on changes
+ */
+const char *cparse_interp_value(Config *config, ConfigSection *section, ConfigEntry *entry,
+				size_t *len)
+{
+	if (!config || !config->interp || !section || !entry) return NULL;
+
+	size_t value_len = 0;
+	pthread_mutex_lock(&config->interp->lock);
+	const char *value = interp_expand(config, section, entry, &value_len);
+	pthread_mutex_unlock(&config->interp->lock);
+
+	if (value && len) *len = value_len;
+	return value;
+}
+
+// ==================== Invalidation ====================
+
+/**
+ * Drop the expansion of ENTRY and of everything built on it, with the
+ * lists split from those expansions
+ */
+static void interp_invalidate(Config *config, ConfigEntry *entry, int changed)
+{
+	ConfigInterp *interp = config->interp;
+	InterpNode *node = cparse_map_get(&interp->nodes, entry);
+	if (!node) return;
+
+	/* A stale expansion has no valid dependents left */
+	if (!changed && !node->expanded) return;
+
+	free(node->expanded);
+	node->expanded = NULL;
+	if (!changed) {
+		cparse_list_invalidate(config, entry);
+	}
+
+	for (size_t i = 0; i < node->dependent_count; i++) {
+		interp_invalidate(config, node->dependents[i], 0);
+	}
+	node->dependent_count = 0;
+}
+
+/**
+ * Drop memoized expansions depending on ENTRY, others are kept
+ */
+void cparse_interp_invalidate(Config *config, ConfigEntry *entry)
+{
+	if (!config || !config->interp) return;
+
+	pthread_mutex_lock(&config->interp->lock);
+	interp_invalidate(config, entry, 1);
+	pthread_mutex_unlock(&config->interp->lock);
+}
+
+/**
+ * Free interpolation state
+ */
+void cparse_interp_free(Config *config)
+{
+	if (!config || !config->interp) return;
+
+	CPMap *nodes = &config->interp->nodes;
+	for (size_t i = 0; i < nodes->capacity; i++) {
+		InterpNode *node = nodes->values[i];
+		if (nodes->keys[i] && node) {
+			free(node->expanded);
+			free(node->dependents);
+			free(node);
+		}
+	}
+
+	cparse_map_free(nodes);
+	pthread_mutex_destroy(&config->interp->lock);
+	free(config->interp);
+	config->interp = NULL;
+}
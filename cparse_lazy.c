@@ -0,0 +1,362 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+struct ConfigLazy
+{
+	const char *source;   /* Borrowed from the parser state */
+	pthread_mutex_t lock; /* Serializes parsing, the arena is shared */
+};
+
+/* A section header found by the skim */
+typedef struct
+{
+	size_t line_start;    /* Offset of its line */
+	size_t name_start;    /* Past '[' */
+	size_t name_end;      /* At ']' */
+	size_t body_start;    /* Past its line */
+	int line;
+} SkimHeader;
+
+// ==================== Header Skim ====================
+
+/*
+ * The skim follows the lexer's rules only as far as needed to tell a
+ * section header from a '[' inside a value: comments, quoted keys and
+ * quoted (possibly multiline) values. Nothing is copied or unescaped.
+ */
+
+/**
+ * Offset past the line containing POS, its newline counted in LINE
+ */
+static size_t skim_next_line(const char *data, size_t len, size_t pos, int *line)
+{
+	const char *nl = memchr(data + pos, '\n', len - pos);
+	if (!nl) return len;
+
+	(*line)++;
+	return (size_t)(nl - data) + 1;
+}
+
+/**
+ * Offset of the first A, B or C from POS, LEN if none
+ */
+static size_t skim_find(const char *data, size_t len, size_t pos, char a, char b, char c)
+{
+#if defined(__SSE2__)
+	__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+
+	for (; pos + 16 <= len; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+						_mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc)));
+		if (mask) return pos + __builtin_ctz(mask);
+	}
+#endif
+
+	for (; pos < len; pos++) {
+		if (data[pos] == a || data[pos] == b || data[pos] == c) return pos;
+	}
+
+	return len;
+}
+
+/**
+ * Offset past the quoted value whose opening quote is at POS
+ */
+static size_t skim_quoted(const char *data, size_t len, size_t pos, int *line)
+{
+	char quote = data[pos++];
+
+	while ((pos = skim_find(data, len, pos, quote, '\\', '\n')) < len) {
+		char ch = data[pos++];
+		if (ch == quote) return pos;
+
+		/* An escaped character never closes the value */
+		if (ch == '\\' && pos < len) ch = data[pos++];
+		if (ch == '\n') (*line)++;
+	}
+
+	return len;
+}
+
+/**
+ * Offset where the next line starts after the entry at POS. A
+ * malformed entry ends at its line like the lexer's error recovery.
+ */
+static size_t skim_entry(const char *data, size_t len, size_t pos, int *line)
+{
+	char quote = 0;
+
+	/* Key, up to '=' */
+	for (;;) {
+		if (pos >= len) return len;
+
+		char ch = data[pos];
+		if (quote) {
+			if (ch == quote) quote = 0;
+			else if (ch == '\n') return skim_next_line(data, len, pos, line);
+		} else if (ch == '=') {
+			pos++;
+			break;
+		} else if (ch == '\n') {
+			return skim_next_line(data, len, pos, line);
+		} else if (isspace((unsigned char)ch)) {
+			while (pos < len && data[pos] != '\n' && isspace((unsigned char)data[pos])) pos++;
+			if (pos >= len || data[pos] != '=') {
+				return skim_next_line(data, len, pos, line);
+			}
+			pos++;
+			break;
+		} else if (ch == '"' || ch == '\'') {
+			quote = ch;
+		}
+		pos++;
+	}
+
+	/* Value */
+	while (pos < len && data[pos] != '\n' && isspace((unsigned char)data[pos])) pos++;
+
+	if (pos < len && (data[pos] == '"' || data[pos] == '\'')) {
+		pos = skim_quoted(data, len, pos, line);
+	}
+
+	return skim_next_line(data, len, pos, line);
+}
+
+/**
+ * Find the next section header from *POS, which is at a line start.
+ * Returns 0 at the end of input.
+ */
+static int skim_header(const char *data, size_t len, size_t *pos, int *line, SkimHeader *header)
+{
+	size_t p = *pos;
+
+	while (p < len) {
+		unsigned char ch = data[p];
+
+		if (ch == '\n') {
+			(*line)++;
+			p++;
+		} else if (isspace(ch)) {
+			p++;
+		} else if (ch == '#' || ch == ';') {
+			p = skim_next_line(data, len, p, line);
+		} else if (ch == '[') {
+			size_t q = p + 1;
+			while (q < len && data[q] != ']' && data[q] != '\n') q++;
+
+			if (q == len || data[q] == '\n') {
+				/* No ']', an error line the section's parse reports */
+				p = skim_next_line(data, len, p, line);
+				continue;
+			}
+
+			size_t start = p;
+			while (start > 0 && data[start - 1] != '\n') start--;
+
+			header->line_start = start;
+			header->name_start = p + 1;
+			header->name_end = q;
+			header->line = *line;
+			header->body_start = skim_next_line(data, len, q, line);
+			*pos = header->body_start;
+			return 1;
+		} else {
+			p = skim_entry(data, len, p, line);
+		}
+	}
+
+	*pos = len;
+	return 0;
+}
+
+// ==================== Lazy Loading ====================
+
+/**
+ * Add the section of HEADER, its entries left unparsed
+ */
+static ConfigSection *lazy_add_section(Config *config, const char *source,
+					const SkimHeader *header, CPBuf *name)
+{
+	size_t end = header->name_end;
+	while (end > header->name_start && isspace((unsigned char)source[end - 1])) end--;
+
+	name->len = 0;
+	ConfigSection *section = NULL;
+	if (cparse_buf_append(name, source + header->name_start, end - header->name_start)) {
+		section = config_add_section(config, name->data);
+	}
+	if (!section) {
+		cparse_set_error(NULL, "Failed to add section: %.*s",
+				(int)(end - header->name_start), source + header->name_start);
+		return NULL;
+	}
+
+	section->line = header->line;
+	section->body_start = header->body_start;
+
+	if (config->flags & CONFIG_PRESERVE) {
+		if (header->name_end + 1 > UINT32_MAX) {
+			cparse_set_error(NULL, "Source too large to preserve its layout");
+			return NULL;
+		}
+		section->span.line_start = header->line_start;
+		section->span.value_start = header->line_start;
+		section->span.value_end = header->name_end + 1;
+		section->flags |= SECTION_SPAN;
+	}
+
+	if (strcmp(section->name, INCLUDE_KEY) == 0) {
+		section->flags |= SECTION_INCLUDE;
+	}
+
+	return section;
+}
+
+/**
+ * The body of SECTION ends at END. Include directives are needed
+ * right away, other entries wait for the first use.
+ */
+static int lazy_close_section(Config *config, ConfigSection *section, size_t end)
+{
+	section->body_end = end;
+
+	if (section->flags & SECTION_INCLUDE) {
+		return cparse_load_range(config, section, config->lazy->source,
+					section->body_start, end, section->line + 1);
+	}
+
+	if (section->body_start < end) {
+		section->flags |= SECTION_LAZY;
+	}
+
+	return 1;
+}
+
+/**
+ * Build a CONFIG_LAZY configuration from STATE's string. Only section
+ * headers are located, and entries before the first one parsed; the
+ * entries of a section are parsed when it is first used. The string
+ * must live as long as the configuration.
+ */
+Config *cparse_lazy_load(CPState *st)
+{
+	const char *source = st->str + st->off;
+	size_t len = st->len ? st->len - st->off : strlen(source);
+
+	Config *config = calloc(1, sizeof(Config));
+	ConfigLazy *lazy = calloc(1, sizeof(ConfigLazy));
+	if (!config || !lazy) {
+		free(config);
+		free(lazy);
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		return NULL;
+	}
+
+	pthread_mutex_init(&lazy->lock, NULL);
+	lazy->source = source;
+	config->lazy = lazy;
+	config->flags = st->flags;
+	config->diags.limit = cparse_get_diag_limit();
+
+	/* Readers may parse sections concurrently, set up shared state now */
+	if (!config_add_section(config, "") ||
+	    ((config->flags & CONFIG_INTERPOLATE) && !cparse_interp_init(config))) {
+		cparse_set_error(NULL, "Failed to allocate configuration memory");
+		cparse_free(config);
+		return NULL;
+	}
+
+	int ok = 1;
+	CPBuf name = { NULL, 0, 0 };
+	SkimHeader header;
+	ConfigSection *last = NULL;
+	size_t pos = 0;
+	int line = 1;
+
+	while (ok && skim_header(source, len, &pos, &line, &header)) {
+		if (last) {
+			ok = lazy_close_section(config, last, header.line_start);
+		} else {
+			/* Entries outside of any section, top level includes among them */
+			ok = cparse_load_range(config, config->sections, source, 0, header.line_start, 1);
+		}
+
+		ok = ok && (last = lazy_add_section(config, source, &header, &name)) != NULL;
+	}
+
+	if (ok) {
+		ok = last ? lazy_close_section(config, last, len)
+			: cparse_load_range(config, config->sections, source, 0, len, 1);
+	}
+
+	free(name.data);
+
+	if (!ok) {
+		cparse_free(config);
+		return NULL;
+	}
+
+	return config;
+}
+
+/**
+ * Parse the entries of SECTION. Threads reading the same config may
+ * get here at once; one parses, the others wait for it.
+ */
+int cparse_lazy_section(const Config *config, ConfigSection *section)
+{
+	ConfigLazy *lazy = config->lazy;
+	int ok = 1;
+
+	pthread_mutex_lock(&lazy->lock);
+
+	if (section->flags & SECTION_LAZY) {
+		/* Parsing fills the section of a config its readers see as const */
+		Config *target = (Config *)config;
+		ConfigSection *current = target->current_section;
+
+		ok = cparse_load_range(target, section, lazy->source, section->body_start,
+					section->body_end, section->line + 1);
+		target->current_section = current;
+
+		__atomic_store_n(&section->flags, section->flags & ~SECTION_LAZY, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&lazy->lock);
+	return ok;
+}
+
+/**
+ * Parse every section still unparsed, before walking the whole config
+ */
+int cparse_lazy_load_all(const Config *config)
+{
+	if (!config || !config->lazy) return 1;
+
+	for (ConfigSection *cs = config->sections; cs; cs = cs->next) {
+		if (!section_ready(config, cs)) return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Free the lazy parsing state, the borrowed source is not freed
+ */
+void cparse_lazy_free(Config *config)
+{
+	if (!config || !config->lazy) return;
+
+	pthread_mutex_destroy(&config->lazy->lock);
+	free(config->lazy);
+	config->lazy = NULL;
+}
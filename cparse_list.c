@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+#define LIST_NUMBER_MAX 128   /* Longest element read as a number */
+
+/* Elements of one value, each array built by the first read of its type */
+typedef struct
+{
+	size_t count;
+	XConfigStr *items;        /* Views into the value, or into TEXT */
+	int64_t *ints;
+	double *floats;
+	char *text;               /* Copy of an expanded value, whose memo may go */
+} ListNode;
+
+struct ConfigLists
+{
+	CPMap nodes;              /* ConfigEntry * -> ListNode * */
+	pthread_mutex_t lock;
+};
+
+// ==================== Splitting ====================
+
+/**
+ * Whitespace as the lexer sees it
+ */
+static int list_space(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+/**
+ * Split the LEN bytes of VALUE into ITEMS (NULL: count only). Returns
+ * the number of elements, or (size_t)-1 for a malformed list.
+ *
+ * A value may be wrapped in '[' and ']'. If it has a comma, elements
+ * are separated by commas and trimmed, a trailing comma is allowed;
+ * otherwise they are separated by whitespace. An element in quotes
+ * may hold either separator, the quotes are not part of it.
+ */
+static size_t list_split(const char *value, size_t len, XConfigStr *items)
+{
+	const char *p = value;
+	const char *end = value + len;
+
+	while (p < end && list_space(*p)) p++;
+	while (end > p && list_space(end[-1])) end--;
+	if (end - p >= 2 && *p == '[' && end[-1] == ']') {
+		p++;
+		end--;
+	}
+
+	int commas = memchr(p, ',', end - p) != NULL;
+	size_t count = 0;
+
+	for (;;) {
+		while (p < end && list_space(*p)) p++;
+		if (p == end) {
+			/* Nothing left: an empty list, or past a trailing comma */
+			break;
+		}
+
+		const char *start = p, *stop;
+		if (*p == '"' || *p == '\'') {
+			const char *close = memchr(p + 1, *p, end - p - 1);
+			if (!close) return (size_t)-1;
+			start = p + 1;
+			stop = close;
+			p = close + 1;
+			while (p < end && list_space(*p)) p++;
+			if (p < end && (commas ? *p != ',' : 0)) return (size_t)-1;
+		} else if (commas) {
+			while (p < end && *p != ',') p++;
+			stop = p;
+			while (stop > start && list_space(stop[-1])) stop--;
+		} else {
+			while (p < end && !list_space(*p)) p++;
+			stop = p;
+		}
+
+		if (items) {
+			items[count].ptr = start;
+			items[count].len = stop - start;
+		}
+		count++;
+
+		if (commas) {
+			if (p == end) break;
+			p++; /* Past ',' */
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Parse element ITEM as a number of TYPE, strtoll()/strtod() rules
+ */
+static int list_number(const XConfigStr *item, int type, int64_t *n, double *d)
+{
+	char buf[LIST_NUMBER_MAX];
+	char *end;
+
+	if (item->len == 0 || item->len >= sizeof(buf)) return 0;
+	memcpy(buf, item->ptr, item->len);
+	buf[item->len] = '\0';
+
+	errno = 0;
+	if (type == SCHEMA_INT) {
+		*n = strtoll(buf, &end, 10);
+	} else {
+		*d = strtod(buf, &end);
+	}
+
+	return errno == 0 && *end == '\0';
+}
+
+// ==================== Building ====================
+
+/**
+ * Split the value of ENTRY into a new node
+ */
+static ListNode *list_build(Config *config, ConfigSection *section, ConfigEntry *entry)
+{
+	size_t len = 0;
+	const char *value = cparse_entry_value(config, section, entry, &len);
+	if (!value) return NULL;
+
+	ListNode *node = calloc(1, sizeof(ListNode));
+	if (!node) goto nomem;
+
+	/* An expansion is dropped when a value it uses changes, keep a copy */
+	if (entry->flags & ENTRY_REFS) {
+		node->text = malloc(len + 1);
+		if (!node->text) goto nomem;
+		memcpy(node->text, value, len + 1);
+		value = node->text;
+	}
+
+	node->count = list_split(value, len, NULL);
+	if (node->count == (size_t)-1) {
+		cparse_set_error(NULL, "Malformed list in '%s': unclosed quote or missing ','", entry_key(entry));
+		goto fail;
+	}
+
+	node->items = malloc((node->count ? node->count : 1) * sizeof(XConfigStr));
+	if (!node->items) goto nomem;
+	list_split(value, len, node->items);
+
+	return node;
+
+nomem:
+	cparse_set_error(NULL, "Failed to allocate memory");
+fail:
+	if (node) {
+		free(node->text);
+		free(node);
+	}
+	return NULL;
+}
+
+/**
+ * Numbers of TYPE of NODE's elements, one array
+ */
+static void *list_numbers(const ListNode *node, int type, const char *key)
+{
+	size_t size = type == SCHEMA_INT ? sizeof(int64_t) : sizeof(double);
+	void *array = malloc((node->count ? node->count : 1) * size);
+	if (!array) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	for (size_t i = 0; i < node->count; i++) {
+		int64_t *n = (int64_t *)array + i;
+		double *d = (double *)array + i;
+
+		if (!list_number(&node->items[i], type, n, d)) {
+			cparse_set_error(NULL, "Element %zu of '%s' is not %s: %.*s", i, key,
+					type == SCHEMA_INT ? "an integer" : "a number",
+					(int)node->items[i].len, node->items[i].ptr);
+			free(array);
+			return NULL;
+		}
+	}
+
+	return array;
+}
+
+/**
+ * Free NODE and its arrays
+ */
+static void list_node_free(ListNode *node)
+{
+	if (!node) return;
+
+	free(node->items);
+	free(node->ints);
+	free(node->floats);
+	free(node->text);
+	free(node);
+}
+
+/**
+ * List state of CONFIG, created by the first list read. Concurrent
+ * readers may both create it, one is published.
+ */
+static ConfigLists *list_state(Config *config)
+{
+	ConfigLists *lists = __atomic_load_n(&config->lists, __ATOMIC_ACQUIRE);
+	if (lists) return lists;
+
+	lists = calloc(1, sizeof(ConfigLists));
+	if (!lists) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+	pthread_mutex_init(&lists->lock, NULL);
+
+	ConfigLists *expected = NULL;
+	if (!__atomic_compare_exchange_n(&config->lists, &expected, lists, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_destroy(&lists->lock);
+		free(lists);
+		lists = expected;
+	}
+
+	return lists;
+}
+
+// ==================== Reading ====================
+
+/**
+ * Elements of the value of KEY as an array of TYPE (SCHEMA_STRING:
+ * XConfigStr views, SCHEMA_INT: int64_t, SCHEMA_FLOAT: double) of
+ * COUNT elements. The value is split by the first read and each array
+ * built by the first read of its type; later reads return the same
+ * arrays until the value changes. NULL if the key is missing or an
+ * element is not a number.
+ */
+const void *cparse_list_read(Config *config, const char *section, const char *key,
+				int type, size_t *count)
+{
+	if (!config || !key) return NULL;
+
+	if (config->image) {
+		cparse_set_error(NULL, "List reads are not supported on a shared image");
+		return NULL;
+	}
+
+	ConfigSection *where = NULL;
+	ConfigEntry *entry = cparse_find(config, section, key, &where);
+	if (!entry) return NULL;
+
+	ConfigLists *lists = list_state(config);
+	if (!lists) return NULL;
+
+	pthread_mutex_lock(&lists->lock);
+	ListNode *node = cparse_map_get(&lists->nodes, entry);
+	const void *array = !node || !node->items ? NULL
+		: type == SCHEMA_INT ? (const void *)node->ints
+		: type == SCHEMA_FLOAT ? (const void *)node->floats : (const void *)node->items;
+	if (array && count) *count = node->count;
+	int split = node && node->items;
+	pthread_mutex_unlock(&lists->lock);
+
+	if (array) return array;
+
+	/* Reading a value takes the interpolation lock, never while holding ours */
+	ListNode *built = NULL;
+	if (!split) {
+		built = list_build(config, where, entry);
+		if (!built) return NULL;
+		node = built;
+	}
+
+	/* Elements of a split value stay put until the value changes */
+	void *numbers = NULL;
+	if (type != SCHEMA_STRING && !(numbers = list_numbers(node, type, entry_key(entry)))) {
+		list_node_free(built);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lists->lock);
+
+	int ok = 1;
+	if (built) {
+		/* Another reader may have split it meanwhile, keep the first */
+		node = cparse_map_get(&lists->nodes, entry);
+		if (!node) {
+			ok = cparse_map_put(&lists->nodes, entry, built);
+			node = ok ? built : NULL;
+			built = ok ? NULL : built;
+		} else if (!node->items) {
+			*node = *built;
+			free(built);
+			built = NULL;
+		}
+	}
+
+	if (ok) {
+		if (type == SCHEMA_INT) {
+			if (!node->ints) {
+				node->ints = numbers;
+				numbers = NULL;
+			}
+			array = node->ints;
+		} else if (type == SCHEMA_FLOAT) {
+			if (!node->floats) {
+				node->floats = numbers;
+				numbers = NULL;
+			}
+			array = node->floats;
+		} else {
+			array = node->items;
+		}
+		if (count) *count = node->count;
+	}
+
+	pthread_mutex_unlock(&lists->lock);
+
+	list_node_free(built);
+	free(numbers);
+
+	if (!ok) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+	}
+	return array;
+}
+
+/**
+ * Drop the split elements of ENTRY after its value changed
+ */
+void cparse_list_invalidate(Config *config, ConfigEntry *entry)
+{
+	if (!config || !config->lists) return;
+
+	ConfigLists *lists = config->lists;
+	pthread_mutex_lock(&lists->lock);
+	ListNode *node = cparse_map_get(&lists->nodes, entry);
+	if (node) {
+		/* Emptied in place, re-split by the next read */
+		free(node->items);
+		free(node->ints);
+		free(node->floats);
+		free(node->text);
+		memset(node, 0, sizeof(ListNode));
+	}
+	pthread_mutex_unlock(&lists->lock);
+}
+
+/**
+ * Free list state
+ */
+void cparse_list_free(Config *config)
+{
+	if (!config || !config->lists) return;
+
+	CPMap *nodes = &config->lists->nodes;
+	for (size_t i = 0; i < nodes->capacity; i++) {
+		if (nodes->keys[i]) {
+			list_node_free(nodes->values[i]);
+		}
+	}
+
+	cparse_map_free(nodes);
+	pthread_mutex_destroy(&config->lists->lock);
+	free(config->lists);
+	config->lists = NULL;
+}
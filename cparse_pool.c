@@ -0,0 +1,66 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+typedef struct
+{
+	size_t count;
+	size_t next;
+	void (*fn)(void *arg, size_t index);
+	void *arg;
+} PoolJob;
+
+// ==================== Worker Pool ====================
+
+/**
+ * Worker loop: claim indexes until the job is exhausted
+ */
+static void *pool_worker(void *data)
+{
+	PoolJob *job = data;
+	size_t index;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		job->fn(job->arg, index);
+	}
+
+	return NULL;
+}
+
+/**
+ * Run FN(ARG, 0..COUNT-1) on up to MAX_THREADS worker threads.
+ * The calling thread takes part in the work, and everything still
+ * runs (serially) if no thread can be created. I/O bound callers may
+ * ask for more threads than there are CPUs.
+ */
+void cparse_pool_run(size_t count, unsigned max_threads,
+			void (*fn)(void *arg, size_t index), void *arg)
+{
+	if (!fn || count == 0) return;
+
+	PoolJob job = { count, 0, fn, arg };
+
+	size_t threads = max_threads ? max_threads : 1;
+
+	if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+	if (threads > count) threads = count;
+
+	pthread_t tids[POOL_MAX_THREADS];
+	size_t started = 0;
+
+	/* The calling thread is worker number zero */
+	while (started + 1 < threads) {
+		if (pthread_create(&tids[started], NULL, pool_worker, &job) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	pool_worker(&job);
+
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
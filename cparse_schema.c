@@ -0,0 +1,666 @@
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _XCONFIG_H
+#include "cparse_core.h"
+
+typedef struct
+{
+	char *name;
+	uint32_t hash;        /* cparse_fold_hash() of the name */
+	int type;             /* SCHEMA_* */
+	int required;
+	int ranged;
+	double min;           /* Value, or length of a string */
+	double max;
+	char **values;        /* Allowed values, none: any */
+	uint32_t *value_hashes;
+	size_t value_count;
+} SchemaKey;
+
+typedef struct
+{
+	char *name;
+	uint32_t hash;
+	int required;
+	SchemaKey *keys;
+	size_t key_count;
+	size_t key_capacity;
+	uint32_t *slots;      /* Key index + 1, 0 is free. Compiled */
+	size_t slot_mask;
+	uint64_t *required_keys; /* Bit per key. Compiled */
+} SchemaSection;
+
+struct ConfigSchema
+{
+	unsigned flags;       /* SCHEMA_* */
+	int compiled;
+	SchemaSection *sections;
+	size_t section_count;
+	size_t section_capacity;
+	uint32_t *slots;      /* Section index + 1, 0 is free. Compiled */
+	size_t slot_mask;
+	uint64_t *required_sections;
+	size_t max_words;     /* Bitset words of the largest section */
+};
+
+/* Violations found so far */
+typedef struct
+{
+	XConfigViolation *items;
+	size_t count;
+	size_t capacity;
+} ViolationList;
+
+/* Words of a bitset of N bits */
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+
+// ==================== Declarations ====================
+
+/**
+ * Copy of STR, or NULL
+ */
+static char *schema_strdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = malloc(len);
+	if (copy) memcpy(copy, str, len);
+	return copy;
+}
+
+/**
+ * Fail a declaration made after compiling
+ */
+static int schema_check_open(const ConfigSchema *schema)
+{
+	if (schema->compiled) {
+		cparse_set_error(NULL, "Schema is already compiled");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Declared section NAME, or NULL
+ */
+static SchemaSection *schema_find_section(ConfigSchema *schema, const char *name)
+{
+	for (size_t i = 0; i < schema->section_count; i++) {
+		if (strcmp(schema->sections[i].name, name) == 0) {
+			return &schema->sections[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Declared key NAME of SECTION, or NULL
+ */
+static SchemaKey *schema_find_key(ConfigSchema *schema, const char *section, const char *name)
+{
+	SchemaSection *ss = schema_find_section(schema, section ? section : "");
+	if (ss) {
+		for (size_t i = 0; i < ss->key_count; i++) {
+			if (strcmp(ss->keys[i].name, name) == 0) {
+				return &ss->keys[i];
+			}
+		}
+	}
+
+	cparse_set_error(NULL, "Key '%s' is not declared in section '%s'", name, section ? section : "");
+	return NULL;
+}
+
+/**
+ * Section NAME, declared as optional if new
+ */
+static SchemaSection *schema_add_section(ConfigSchema *schema, const char *name)
+{
+	SchemaSection *ss = schema_find_section(schema, name);
+	if (ss) return ss;
+
+	if (schema->section_count == schema->section_capacity) {
+		size_t capacity = schema->section_capacity ? schema->section_capacity * BUFFER_GROWTH_FACTOR : 8;
+		SchemaSection *sections = realloc(schema->sections, capacity * sizeof(SchemaSection));
+		if (!sections) goto fail;
+		schema->sections = sections;
+		schema->section_capacity = capacity;
+	}
+
+	ss = &schema->sections[schema->section_count];
+	memset(ss, 0, sizeof(SchemaSection));
+	if (!(ss->name = schema_strdup(name))) goto fail;
+	ss->hash = cparse_fold_hash(name, strlen(name));
+
+	schema->section_count++;
+	return ss;
+
+fail:
+	cparse_set_error(NULL, "Failed to allocate memory");
+	return NULL;
+}
+
+/**
+ * Create an empty schema
+ */
+ConfigSchema *cparse_schema_new(unsigned flags)
+{
+	ConfigSchema *schema = calloc(1, sizeof(ConfigSchema));
+	if (!schema) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return NULL;
+	}
+
+	schema->flags = flags;
+	return schema;
+}
+
+/**
+ * Declare SECTION ("" or NULL: entries before any header)
+ */
+int cparse_schema_section(ConfigSchema *schema, const char *section, int required)
+{
+	if (!schema || !schema_check_open(schema)) return 0;
+
+	SchemaSection *ss = schema_add_section(schema, section ? section : "");
+	if (!ss) return 0;
+
+	ss->required |= required;
+	return 1;
+}
+
+/**
+ * Declare KEY of SECTION with its type, declaring SECTION if needed.
+ * A required key is only looked for when its section is present.
+ */
+int cparse_schema_key(ConfigSchema *schema, const char *section, const char *key,
+			int type, int required)
+{
+	if (!schema || !key || !schema_check_open(schema)) return 0;
+
+	if (type < SCHEMA_STRING || type > SCHEMA_BOOL) {
+		cparse_set_error(NULL, "Unknown type %d for key '%s'", type, key);
+		return 0;
+	}
+
+	SchemaSection *ss = schema_add_section(schema, section ? section : "");
+	if (!ss) return 0;
+
+	for (size_t i = 0; i < ss->key_count; i++) {
+		if (strcmp(ss->keys[i].name, key) == 0) {
+			cparse_set_error(NULL, "Key '%s' is already declared in section '%s'", key, ss->name);
+			return 0;
+		}
+	}
+
+	if (ss->key_count == ss->key_capacity) {
+		size_t capacity = ss->key_capacity ? ss->key_capacity * BUFFER_GROWTH_FACTOR : 8;
+		SchemaKey *keys = realloc(ss->keys, capacity * sizeof(SchemaKey));
+		if (!keys) {
+			cparse_set_error(NULL, "Failed to allocate memory");
+			return 0;
+		}
+		ss->keys = keys;
+		ss->key_capacity = capacity;
+	}
+
+	SchemaKey *sk = &ss->keys[ss->key_count];
+	memset(sk, 0, sizeof(SchemaKey));
+	if (!(sk->name = schema_strdup(key))) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+	sk->hash = cparse_fold_hash(key, strlen(key));
+	sk->type = type;
+	sk->required = required;
+
+	ss->key_count++;
+	return 1;
+}
+
+/**
+ * Bound a number key to [MIN, MAX], or a string key's length
+ */
+int cparse_schema_range(ConfigSchema *schema, const char *section, const char *key,
+			double min, double max)
+{
+	if (!schema || !key || !schema_check_open(schema)) return 0;
+
+	SchemaKey *sk = schema_find_key(schema, section, key);
+	if (!sk) return 0;
+
+	if (sk->type == SCHEMA_BOOL || !(min <= max)) {
+		cparse_set_error(NULL, "Invalid range for key '%s'", key);
+		return 0;
+	}
+
+	sk->ranged = 1;
+	sk->min = min;
+	sk->max = max;
+	return 1;
+}
+
+/**
+ * Restrict KEY to COUNT allowed values, compared as they are written
+ */
+int cparse_schema_enum(ConfigSchema *schema, const char *section, const char *key,
+			const char *const *values, size_t count)
+{
+	if (!schema || !key || (!values && count > 0) || !schema_check_open(schema)) return 0;
+
+	SchemaKey *sk = schema_find_key(schema, section, key);
+	if (!sk) return 0;
+
+	char **copies = calloc(count ? count : 1, sizeof(char *));
+	uint32_t *hashes = malloc((count ? count : 1) * sizeof(uint32_t));
+	int ok = copies && hashes;
+
+	for (size_t i = 0; ok && i < count; i++) {
+		ok = (copies[i] = schema_strdup(values[i])) != NULL;
+		if (ok) hashes[i] = cparse_fold_hash(values[i], strlen(values[i]));
+	}
+
+	if (!ok) {
+		for (size_t i = 0; copies && i < count; i++) free(copies[i]);
+		free(copies);
+		free(hashes);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	for (size_t i = 0; i < sk->value_count; i++) free(sk->values[i]);
+	free(sk->values);
+	free(sk->value_hashes);
+
+	sk->values = copies;
+	sk->value_hashes = hashes;
+	sk->value_count = count;
+	return 1;
+}
+
+// ==================== Compilation ====================
+
+/**
+ * Open addressing table of COUNT names, slots hold index + 1
+ */
+static uint32_t *schema_table(size_t count, const void *items, size_t item_size,
+				size_t hash_offset, size_t *mask)
+{
+	size_t size = 8;
+	while (size < count * 2) size *= 2;
+
+	uint32_t *slots = calloc(size, sizeof(uint32_t));
+	if (!slots) return NULL;
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t hash;
+		memcpy(&hash, (const char *)items + i * item_size + hash_offset, sizeof(hash));
+
+		size_t s = hash & (size - 1);
+		while (slots[s]) s = (s + 1) & (size - 1);
+		slots[s] = i + 1;
+	}
+
+	*mask = size - 1;
+	return slots;
+}
+
+/**
+ * Build the lookup tables and required bitsets. The schema cannot
+ * change afterwards, and can be shared by threads validating at once.
+ */
+int cparse_schema_compile(ConfigSchema *schema)
+{
+	if (!schema || !schema_check_open(schema)) return 0;
+
+	schema->slots = schema_table(schema->section_count, schema->sections, sizeof(SchemaSection),
+				offsetof(SchemaSection, hash), &schema->slot_mask);
+	schema->required_sections = calloc(BITSET_WORDS(schema->section_count) + 1, sizeof(uint64_t));
+	if (!schema->slots || !schema->required_sections) goto fail;
+
+	for (size_t i = 0; i < schema->section_count; i++) {
+		SchemaSection *ss = &schema->sections[i];
+		size_t words = BITSET_WORDS(ss->key_count);
+
+		if (ss->required) {
+			schema->required_sections[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+
+		ss->slots = schema_table(ss->key_count, ss->keys, sizeof(SchemaKey),
+					offsetof(SchemaKey, hash), &ss->slot_mask);
+		ss->required_keys = calloc(words + 1, sizeof(uint64_t));
+		if (!ss->slots || !ss->required_keys) goto fail;
+
+		for (size_t k = 0; k < ss->key_count; k++) {
+			if (ss->keys[k].required) {
+				ss->required_keys[k / 64] |= (uint64_t)1 << (k % 64);
+			}
+		}
+
+		if (words > schema->max_words) schema->max_words = words;
+	}
+
+	schema->compiled = 1;
+	return 1;
+
+fail:
+	cparse_set_error(NULL, "Failed to allocate memory");
+	return 0;
+}
+
+/**
+ * Free a schema, compiled or not
+ */
+void cparse_schema_free(ConfigSchema *schema)
+{
+	if (!schema) return;
+
+	for (size_t i = 0; i < schema->section_count; i++) {
+		SchemaSection *ss = &schema->sections[i];
+
+		for (size_t k = 0; k < ss->key_count; k++) {
+			SchemaKey *sk = &ss->keys[k];
+			for (size_t v = 0; v < sk->value_count; v++) free(sk->values[v]);
+			free(sk->values);
+			free(sk->value_hashes);
+			free(sk->name);
+		}
+
+		free(ss->keys);
+		free(ss->slots);
+		free(ss->required_keys);
+		free(ss->name);
+	}
+
+	free(schema->sections);
+	free(schema->slots);
+	free(schema->required_sections);
+	free(schema);
+}
+
+// ==================== Validation ====================
+
+/**
+ * Compare a config name with a schema name, as CONFIG reads would
+ */
+static int schema_name_equal(const Config *config, const char *name, size_t len, const char *declared)
+{
+	if (config->flags & CONFIG_ICASE) {
+		return strlen(declared) == len && cparse_fold_equal(name, declared, len);
+	}
+	return strcmp(name, declared) == 0;
+}
+
+/**
+ * Index of the declared section NAME, or -1
+ */
+static long schema_lookup_section(const ConfigSchema *schema, const Config *config,
+				const ConfigSection *cs)
+{
+	size_t len = strlen(cs->name);
+
+	for (size_t s = cs->name_hash & schema->slot_mask; schema->slots[s];
+	     s = (s + 1) & schema->slot_mask) {
+		const SchemaSection *ss = &schema->sections[schema->slots[s] - 1];
+		if (ss->hash == cs->name_hash && schema_name_equal(config, cs->name, len, ss->name)) {
+			return schema->slots[s] - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Index of the declared key of ENTRY in SS, or -1
+ */
+static long schema_lookup_key(const SchemaSection *ss, const Config *config, const ConfigEntry *entry)
+{
+	const char *key = entry_key(entry);
+	uint32_t hash = (entry->flags & ENTRY_HASH) ? entry_hash(entry)
+		: cparse_fold_hash(key, entry->key_len);
+
+	for (size_t s = hash & ss->slot_mask; ss->slots[s]; s = (s + 1) & ss->slot_mask) {
+		const SchemaKey *sk = &ss->keys[ss->slots[s] - 1];
+		if (sk->hash == hash && schema_name_equal(config, key, entry->key_len, sk->name)) {
+			return ss->slots[s] - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Record a violation
+ */
+static int violation_push(ViolationList *list, int kind, const char *section,
+			const char *key, const char *value, int line)
+{
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * BUFFER_GROWTH_FACTOR : 8;
+		XConfigViolation *items = realloc(list->items, capacity * sizeof(XConfigViolation));
+		if (!items) return 0;
+		list->items = items;
+		list->capacity = capacity;
+	}
+
+	XConfigViolation *v = &list->items[list->count++];
+	v->kind = kind;
+	v->section = section;
+	v->key = key;
+	v->value = value;
+	v->line = line;
+	return 1;
+}
+
+/**
+ * Parse VALUE as a whole number of type SK, store it in NUMBER
+ */
+static int schema_parse_number(const SchemaKey *sk, const char *value, double *number)
+{
+	char *end;
+
+	if (!*value || strchr(" \t\n\r\f\v", *value)) return 0;
+
+	errno = 0;
+	if (sk->type == SCHEMA_INT) {
+		long long n = strtoll(value, &end, 10);
+		*number = (double)n;
+	} else {
+		*number = strtod(value, &end);
+	}
+
+	return errno == 0 && *end == '\0';
+}
+
+/**
+ * Kind of violation of VALUE of LEN bytes against SK, 0 if it is valid
+ */
+static int schema_check_value(const SchemaKey *sk, const char *value, size_t len)
+{
+	double number = 0;
+
+	switch (sk->type) {
+	case SCHEMA_INT:
+	case SCHEMA_FLOAT:
+		if (!schema_parse_number(sk, value, &number)) return VIOLATION_TYPE;
+		break;
+	case SCHEMA_BOOL:
+		if (strcmp(value, "1") && strcmp(value, "0") &&
+		    strcmp(value, "true") && strcmp(value, "false") &&
+		    strcmp(value, "yes") && strcmp(value, "no") &&
+		    strcmp(value, "on") && strcmp(value, "off")) {
+			return VIOLATION_TYPE;
+		}
+		break;
+	default:
+		number = (double)len;
+		break;
+	}
+
+	if (sk->ranged && (isnan(number) || number < sk->min || number > sk->max)) {
+		return VIOLATION_RANGE;
+	}
+
+	if (sk->values) {
+		uint32_t hash = cparse_fold_hash(value, len);
+		for (size_t i = 0; i < sk->value_count; i++) {
+			if (sk->value_hashes[i] == hash && strlen(sk->values[i]) == len &&
+			    memcmp(sk->values[i], value, len) == 0) {
+				return 0;
+			}
+		}
+		return VIOLATION_ENUM;
+	}
+
+	return 0;
+}
+
+/**
+ * Set the error message from the first violation
+ */
+static void violation_describe(const XConfigViolation *v)
+{
+	static const char *const what[] = {
+		"", "is missing", "is not declared", "has the wrong type",
+		"is out of range", "is not an allowed value"
+	};
+
+	if (v->key) {
+		cparse_set_error(NULL, "Line %d: key '%s' in section '%s' %s",
+				v->line, v->key, v->section, what[v->kind]);
+	} else {
+		cparse_set_error(NULL, "Line %d: section '%s' %s", v->line, v->section, what[v->kind]);
+	}
+}
+
+/**
+ * Check CONFIG against SCHEMA in one walk over its sections and
+ * entries. Declared keys are found through the compiled tables and
+ * marked in a presence bitset, required ones missing are what is left
+ * of the required bits. Only the entries reads see are checked: the
+ * first section of a name and the first of repeated keys.
+ *
+ * Violations are returned in VIOLATIONS (malloc'ed, NULL if none),
+ * in config order with missing sections last. Returns 1 when CONFIG
+ * is valid, 0 on violations (COUNT > 0) or errors (COUNT == 0).
+ */
+int cparse_validate(Config *config, const ConfigSchema *schema,
+			XConfigViolation **violations, size_t *count)
+{
+	if (violations) *violations = NULL;
+	if (count) *count = 0;
+	if (!config || !schema) return 0;
+
+	if (!schema->compiled) {
+		cparse_set_error(NULL, "Schema is not compiled");
+		return 0;
+	}
+	if (config->image) {
+		cparse_set_error(NULL, "Validation is not supported on a shared image");
+		return 0;
+	}
+	if (!cparse_lazy_load_all(config)) return 0;
+
+	size_t section_words = BITSET_WORDS(schema->section_count) + 1;
+	uint64_t *seen = calloc(section_words + schema->max_words + 1, sizeof(uint64_t));
+	if (!seen) {
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+	uint64_t *present = seen + section_words;
+
+	ViolationList list = { NULL, 0, 0 };
+	int strict = schema->flags & SCHEMA_STRICT;
+	int ok = 1;
+
+	for (ConfigSection *cs = config->sections; ok && cs; cs = cs->next) {
+		if (cs->flags & SECTION_INCLUDE) continue;
+
+		long s = schema_lookup_section(schema, config, cs);
+		if (s < 0) {
+			/* The default section always exists, it counts once used */
+			if (strict && (cs->name[0] || cs->entries)) {
+				ok = violation_push(&list, VIOLATION_UNKNOWN, cs->name, NULL, NULL, cs->line);
+			}
+			continue;
+		}
+
+		uint64_t bit = (uint64_t)1 << (s % 64);
+		if (seen[s / 64] & bit) continue;
+		seen[s / 64] |= bit;
+
+		const SchemaSection *ss = &schema->sections[s];
+		size_t words = BITSET_WORDS(ss->key_count);
+		memset(present, 0, words * sizeof(uint64_t));
+
+		for (ConfigEntry *ce = cs->entries; ok && ce; ce = ce->next) {
+			long k = schema_lookup_key(ss, config, ce);
+			if (k < 0) {
+				if (strict) {
+					ok = violation_push(&list, VIOLATION_UNKNOWN, cs->name, entry_key(ce),
+							entry_value(ce), entry_line(ce));
+				}
+				continue;
+			}
+
+			uint64_t key_bit = (uint64_t)1 << (k % 64);
+			if (present[k / 64] & key_bit) continue;
+			present[k / 64] |= key_bit;
+
+			/* References are expanded, as XConfig_Read() returns the value */
+			size_t len = 0;
+			const char *value = cparse_entry_value(config, cs, ce, &len);
+			int kind = value ? schema_check_value(&ss->keys[k], value, len) : VIOLATION_TYPE;
+			if (kind) {
+				ok = violation_push(&list, kind, cs->name, entry_key(ce),
+						value ? value : entry_value(ce), entry_line(ce));
+			}
+		}
+
+		for (size_t w = 0; ok && w < words; w++) {
+			uint64_t missing = ss->required_keys[w] & ~present[w];
+			while (ok && missing) {
+				size_t k = w * 64 + __builtin_ctzll(missing);
+				missing &= missing - 1;
+				ok = violation_push(&list, VIOLATION_MISSING, cs->name, ss->keys[k].name,
+						NULL, cs->line);
+			}
+		}
+	}
+
+	for (size_t w = 0; ok && w < section_words; w++) {
+		uint64_t missing = schema->required_sections[w] & ~seen[w];
+		while (ok && missing) {
+			size_t s = w * 64 + __builtin_ctzll(missing);
+			missing &= missing - 1;
+			ok = violation_push(&list, VIOLATION_MISSING, schema->sections[s].name,
+					NULL, NULL, 0);
+		}
+	}
+
+	free(seen);
+
+	if (!ok) {
+		free(list.items);
+		cparse_set_error(NULL, "Failed to allocate memory");
+		return 0;
+	}
+
+	if (list.count == 0) {
+		return 1;
+	}
+
+	violation_describe(&list.items[0]);
+
+	if (count) *count = list.count;
+	if (violations) {
+		*violations = list.items;
+	} else {
+		free(list.items);
+	}
+
+	return 0;
+}
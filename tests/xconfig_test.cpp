@@ -0,0 +1,254 @@
+/* Checks of the C++ wrapper, built and run by 'make test' */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../xconfig.hpp"
+
+static_assert(xconfig::hash("Port") == xconfig::hash("port"), "names hash ignoring ASCII case");
+static_assert(xconfig::hash("port") != xconfig::hash("ports"), "different names, different hashes");
+static_assert(xconfig::Name("server").hash() == xconfig::hash("server"), "Name hashes at compile time");
+
+static int failures = 0;
+
+#define CHECK(cond)                                                           \
+	do {                                                                      \
+		if (!(cond)) {                                                        \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,       \
+					__LINE__, #cond);                                         \
+			failures++;                                                       \
+		}                                                                     \
+	} while (0)
+
+static const char *const source =
+	"[server]\n"
+	"port = 8080\n"
+	"ratio = 0.25\n"
+	"debug = yes\n"
+	"name = \"hello world\"\n"
+	"bad = 12x\n"
+	"negative = -3\n";
+
+static void test_get()
+{
+	xconfig::Config config = xconfig::Config::parse_string(source);
+	CHECK(config);
+
+	CHECK(config.get<int>("server", "port") == 8080);
+	CHECK(config.get<long long>("server", "negative") == -3);
+	CHECK(config.get<double>("server", "ratio") == 0.25);
+	CHECK(config.get<bool>("server", "debug") == true);
+	CHECK(config.get<std::string>("server", "name") == std::string("hello world"));
+	CHECK(config.get<std::string_view>("server", "name") == std::string_view("hello world"));
+
+	/* Not entirely a number, out of range, not a bool, missing */
+	CHECK(!config.get<int>("server", "bad"));
+	CHECK(!config.get<unsigned>("server", "negative"));
+	CHECK(!config.get<bool>("server", "port"));
+	CHECK(!config.get<int>("server", "missing"));
+	CHECK(!config.get<int>("missing", "port"));
+	CHECK(config.get_or<int>("server", "bad", 7) == 7);
+	CHECK(config.get_or<std::string>("server", "missing", "x") == "x");
+}
+
+static void test_names()
+{
+	/* The compile-time hash is the one the library uses */
+	CHECK(XConfig_Hash("Port", 4) == xconfig::hash("port"));
+
+	xconfig::Config config = xconfig::Config::parse_string(source);
+	std::string section = "server", key = "port";
+	CHECK(config.read(section, key) == std::string_view("8080"));
+	CHECK(config.contains("server", "ratio"));
+	CHECK(!config.contains("server", "Ratio"));
+	CHECK(config.read_or("server", "missing", "none") == "none");
+
+	xconfig::Config folded = xconfig::Config::parse_string(source, XC_ICASE);
+	CHECK(folded.get<int>("SERVER", "Port") == 8080);
+}
+
+static void test_write()
+{
+	xconfig::Config config = xconfig::Config::parse_string(source);
+
+	CHECK(config.set("server", "port", "9090"));
+	CHECK(config.get<int>("server", "port") == 9090);
+
+	/* Values hold any bytes, NULs included */
+	std::string_view binary("a\0b", 3);
+	CHECK(config.set("server", "blob", binary));
+	CHECK(config.read("server", "blob") == binary);
+
+	CHECK(config.remove("server", "blob"));
+	CHECK(!config.contains("server", "blob"));
+
+	xconfig::Config same = xconfig::Config::parse_string(source);
+	CHECK(same.set("server", "port", "9090"));
+	auto a = config.fingerprint(), b = same.fingerprint();
+	CHECK(a && b && a->hi == b->hi && a->lo == b->lo);
+}
+
+static void test_ownership()
+{
+	xconfig::Config empty;
+	CHECK(!empty);
+	CHECK(!empty.read("server", "port"));
+	CHECK(!empty.fingerprint());
+
+	xconfig::Config config = xconfig::Config::parse_string(source);
+	xconfig::Config moved = std::move(config);
+	CHECK(!config);
+	CHECK(moved.get<int>("server", "port") == 8080);
+
+	xconfig::Config broken = xconfig::Config::parse_string("[server\nport = 1\n", XC_FAIL_FAST);
+	CHECK(!broken);
+	CHECK(!xconfig::Config::error().empty());
+
+	/* Failing fast checks every section up front, XC_LAZY or not */
+	static const char *const late = "[a]\nx=1\n[b]\ny=1\n\"bad\nz=2\n";
+	CHECK(!xconfig::Config::parse_string(late, XC_FAIL_FAST));
+	CHECK(!xconfig::Config::parse_string(late, XC_FAIL_FAST | XC_LAZY));
+	CHECK(!xconfig::Config::error().empty());
+	xconfig::Config lenient = xconfig::Config::parse_string(late, XC_LAZY);
+	CHECK(lenient.get<int>("b", "y") == 1);
+	CHECK(lenient.get<int>("b", "z") == 2);
+}
+
+static bool same(const xconfig::Config &a, const xconfig::Config &b)
+{
+	auto x = a.fingerprint(), y = b.fingerprint();
+	return x && y && x->hi == y->hi && x->lo == y->lo;
+}
+
+/* Values kept encoded hash as their decoded bytes */
+static void test_encoded()
+{
+	static const char *const escaped = "[s]\nk = \"a\\tb\"\nlong = \"0123456789abcdef\\n0123456789\"\n";
+
+	xconfig::Config eager = xconfig::Config::parse_string(escaped);
+	xconfig::Config deferred = xconfig::Config::parse_string(escaped, XC_DEFER_ESCAPES);
+	CHECK(same(eager, deferred));
+	CHECK(deferred.read("s", "k") == std::string_view("a\tb"));
+	CHECK(same(eager, deferred));
+
+	xconfig::Config edited = xconfig::Config::parse_string("[s]\nk = x\nlong = y\n");
+	CHECK(edited.set("s", "k", "a\tb"));
+	CHECK(edited.set("s", "long", "0123456789abcdef\n0123456789"));
+	CHECK(same(eager, edited));
+
+	/* Updates and removals take out the decoded term */
+	xconfig::Config other = xconfig::Config::parse_string(escaped, XC_DEFER_ESCAPES);
+	CHECK(other.set("s", "long", "y"));
+	CHECK(eager.set("s", "long", "y"));
+	CHECK(same(eager, other));
+	CHECK(other.remove("s", "k"));
+	CHECK(eager.remove("s", "k"));
+	CHECK(same(eager, other));
+}
+
+static int append_output(void *user, const char *data, size_t len)
+{
+	static_cast<std::string *>(user)->append(data, len);
+	return 0;
+}
+
+static void test_write_file()
+{
+	char dir[] = "/tmp/xconfig_testXXXXXX";
+	CHECK(mkdtemp(dir) != nullptr);
+	std::string path = std::string(dir) + "/new.conf";
+	xconfig::Config config = xconfig::Config::parse_string(source);
+	struct stat sb;
+
+	/* A new file gets 0666 less the umask, a replaced one keeps its mode */
+	mode_t old = umask(077);
+	CHECK(config.write_file(path.c_str()));
+	CHECK(stat(path.c_str(), &sb) == 0 && (sb.st_mode & 0777) == 0600);
+
+	CHECK(chmod(path.c_str(), 0640) == 0);
+	CHECK(config.write_file(path.c_str()));
+	CHECK(stat(path.c_str(), &sb) == 0 && (sb.st_mode & 0777) == 0640);
+	umask(old);
+
+	/* A name the parser would read back differently is not written */
+	for (const char *name : { "a]b", "a\nb", "a " }) {
+		xconfig::Config odd = xconfig::Config::parse_string("[s]\nk = 1\n", XC_PRESERVE);
+		CHECK(XConfig_AddSection(odd.get(), name) && XConfig_AddKeyValue(odd.get(), name, "k", "v"));
+		CHECK(!odd.write_file(path.c_str()));
+		CHECK(!xconfig::Config::error().empty());
+
+		std::string out;
+		XConfigSink sink = { -1, append_output, &out };
+		CHECK(!XConfig_Emit(odd.get(), XC_EMIT_INI, &sink));
+		CHECK(out.empty());
+	}
+
+	unlink(path.c_str());
+	rmdir(dir);
+}
+
+static int count_entry(void *user, const char *, size_t, const char *, size_t)
+{
+	++*static_cast<int *>(user);
+	return 0;
+}
+
+/* Sources shorter than the compression magic are parsed all the same */
+static void test_short_files()
+{
+	static const char *const contents[] = { "", "a", "a=", "a=1" };
+
+	for (int i = 0; i < 4; i++) {
+		char path[] = "/tmp/xconfig_testXXXXXX";
+		int fd = mkstemp(path);
+		CHECK(fd >= 0);
+		if (fd < 0)
+			continue;
+		CHECK(write(fd, contents[i], i) == i);
+		close(fd);
+
+		int entries = 0;
+		XConfigCallbacks cb = { nullptr, count_entry, nullptr };
+		XConfigSource by_path = { nullptr, path, -1 };
+		CHECK(XConfig_ParseEvents(&by_path, &cb, &entries));
+		CHECK(entries == (i >= 2));
+
+		entries = 0;
+		fd = open(path, O_RDONLY);
+		XConfigSource by_fd = { nullptr, nullptr, fd };
+		CHECK(XConfig_ParseEvents(&by_fd, &cb, &entries));
+		CHECK(entries == (i >= 2));
+		close(fd);
+
+		xconfig::Config config = xconfig::Config::parse_file(path);
+		CHECK(config);
+		CHECK(config.read("", "a") == (i == 3 ? std::optional<std::string_view>("1")
+			: i == 2 ? std::optional<std::string_view>("") : std::nullopt));
+
+		unlink(path);
+	}
+}
+
+int main()
+{
+	test_get();
+	test_names();
+	test_write();
+	test_ownership();
+	test_encoded();
+	test_write_file();
+	test_short_files();
+
+	if (failures) {
+		std::fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	std::printf("xconfig.hpp: all checks passed\n");
+	return 0;
+}
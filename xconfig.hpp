@@ -0,0 +1,217 @@
+#ifndef _XCONFIG_HPP
+#define _XCONFIG_HPP
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "XConfig.h"
+
+namespace xconfig {
+
+/* Same hash as XConfig_Hash(): 32-bit FNV-1a of the ASCII lower case */
+constexpr std::uint32_t hash(std::string_view name) noexcept
+{
+	std::uint32_t h = 2166136261u;
+	for (char c : name) {
+		unsigned char ch = static_cast<unsigned char>(c);
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+		h ^= ch;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* A NUL-terminated section or key name with its hash. Built from a
+ * literal in a constant expression, the hash costs nothing at run time:
+ *
+ *     static constexpr xconfig::Name port = "port";
+ */
+class Name
+{
+public:
+	constexpr Name(const char *name) noexcept
+		: name_(name), hash_(xconfig::hash(std::string_view(name))) {}
+
+	Name(const std::string &name) noexcept
+		: name_(name.c_str()), hash_(xconfig::hash(name)) {}
+
+	constexpr const char *c_str() const noexcept { return name_; }
+	constexpr std::uint32_t hash() const noexcept { return hash_; }
+
+private:
+	const char *name_;
+	std::uint32_t hash_;
+};
+
+/* Move-only owner of an XConfig pointer */
+class Config
+{
+public:
+	Config() noexcept = default;
+	explicit Config(XConfig *xc) noexcept : xc_(xc) {}
+
+	Config(const Config &) = delete;
+	Config &operator=(const Config &) = delete;
+
+	Config(Config &&other) noexcept : xc_(other.release()) {}
+
+	Config &operator=(Config &&other) noexcept
+	{
+		if (this != &other)
+			reset(other.release());
+		return *this;
+	}
+
+	~Config() { reset(); }
+
+	/* Factories, an empty Config on error, see error() */
+	static Config parse_file(const char *file, unsigned flags = 0) noexcept
+	{
+		return Config(XConfig_ParseFileEx(file, flags));
+	}
+
+	/* Shared read-only config of the process-wide file cache */
+	static Config parse_file_cached(const char *file, unsigned flags = 0) noexcept
+	{
+		return Config(XConfig_ParseFileCachedEx(file, flags));
+	}
+
+	static Config parse_string(const char *string, unsigned flags = 0) noexcept
+	{
+		return Config(XConfig_ParseStringEx(string, flags));
+	}
+
+	static Config create(unsigned flags = 0) noexcept
+	{
+		return Config(XConfig_CreateEx(flags));
+	}
+
+	static Config attach(int fd) noexcept
+	{
+		return Config(XConfig_Attach(fd));
+	}
+
+	static std::string_view error() noexcept
+	{
+		return XConfig_GetError();
+	}
+
+	explicit operator bool() const noexcept { return xc_ != nullptr; }
+	XConfig *get() const noexcept { return xc_; }
+
+	XConfig *release() noexcept
+	{
+		return std::exchange(xc_, nullptr);
+	}
+
+	void reset(XConfig *xc = nullptr) noexcept
+	{
+		XConfig_Delete(std::exchange(xc_, xc));
+	}
+
+	/* Value as a view into the config, valid until it changes */
+	std::optional<std::string_view> read(Name section, Name key) const noexcept
+	{
+		if (!xc_)
+			return std::nullopt;
+
+		size_t len = 0;
+		const char *value = XConfig_ReadHashedN(xc_, section.c_str(), section.hash(),
+						key.c_str(), key.hash(), &len);
+		if (!value)
+			return std::nullopt;
+		return std::string_view(value, len);
+	}
+
+	/* Value or FALLBACK */
+	std::string_view read_or(Name section, Name key, std::string_view fallback) const noexcept
+	{
+		return read(section, key).value_or(fallback);
+	}
+
+	bool contains(Name section, Name key) const noexcept
+	{
+		return read(section, key).has_value();
+	}
+
+	/* Value converted to T: string_view, string, bool, or a number parsed
+	 * with std::from_chars. Empty if missing or not entirely a T. */
+	template <typename T>
+	std::optional<T> get(Name section, Name key) const
+	{
+		std::optional<std::string_view> value = read(section, key);
+		if (!value)
+			return std::nullopt;
+		return convert<T>(*value);
+	}
+
+	template <typename T>
+	T get_or(Name section, Name key, T fallback) const
+	{
+		return get<T>(section, key).value_or(std::move(fallback));
+	}
+
+	bool set(const char *section, const char *key, std::string_view value) noexcept
+	{
+		return XConfig_SetN(xc_, section, key, value.data() ? value.data() : "", value.size());
+	}
+
+	bool remove(const char *section, const char *key) noexcept
+	{
+		return XConfig_Remove(xc_, section, key);
+	}
+
+	bool write_file(const char *file) const noexcept
+	{
+		return XConfig_WriteFile(xc_, file);
+	}
+
+	/* Content hash, equal for configs with the same entries in order */
+	std::optional<XConfigFingerprint> fingerprint() const noexcept
+	{
+		XConfigFingerprint fp;
+		if (!xc_ || !XConfig_Fingerprint(xc_, &fp))
+			return std::nullopt;
+		return fp;
+	}
+
+private:
+	template <typename T>
+	static std::optional<T> convert(std::string_view value)
+	{
+		if constexpr (std::is_same_v<T, std::string_view>) {
+			return value;
+		} else if constexpr (std::is_same_v<T, std::string>) {
+			return std::string(value);
+		} else if constexpr (std::is_same_v<T, bool>) {
+			if (value == "1" || value == "true" || value == "yes" || value == "on")
+				return true;
+			if (value == "0" || value == "false" || value == "no" || value == "off")
+				return false;
+			return std::nullopt;
+		} else {
+			static_assert(std::is_arithmetic_v<T>, "xconfig::Config::get<T>: unsupported type");
+
+			T result{};
+			const char *first = value.data();
+			const char *last = first + value.size();
+			std::from_chars_result r = std::from_chars(first, last, result);
+			if (r.ec != std::errc() || r.ptr != last)
+				return std::nullopt;
+			return result;
+		}
+	}
+
+	XConfig *xc_ = nullptr;
+};
+
+} // namespace xconfig
+
+#endif // _XCONFIG_HPP